@@ -0,0 +1,656 @@
+/*
+ * A52 Output Plugin - sample processing kernels
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include "a52_dsp.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define A52_DSP_X86	1
+#include <immintrin.h>
+#define TARGET(x)	__attribute__((target(x)))
+#endif
+
+/*
+ * generic C versions
+ */
+static void deinterleave_16_c(void *const *dst, const void *src,
+			      unsigned int channels, const unsigned int *map,
+			      unsigned int frames)
+{
+	unsigned int ch, i;
+
+	for (ch = 0; ch < channels; ch++) {
+		const int16_t *s = (const int16_t *)src + map[ch];
+		int16_t *d = dst[ch];
+
+		for (i = 0; i < frames; i++, s += channels)
+			d[i] = *s;
+	}
+}
+
+static void deinterleave_32_c(void *const *dst, const void *src,
+			      unsigned int channels, const unsigned int *map,
+			      unsigned int frames)
+{
+	unsigned int ch, i;
+
+	for (ch = 0; ch < channels; ch++) {
+		const int32_t *s = (const int32_t *)src + map[ch];
+		int32_t *d = dst[ch];
+
+		for (i = 0; i < frames; i++, s += channels)
+			d[i] = *s;
+	}
+}
+
+static void bswap_16_c(void *buf, unsigned int bytes)
+{
+	uint16_t *p = buf;
+	unsigned int i;
+
+	for (i = 0; i < bytes / 2; i++)
+		p[i] = (uint16_t)((p[i] << 8) | (p[i] >> 8));
+}
+
+static int is_zero_c(const void *buf, unsigned int bytes)
+{
+	const unsigned char *p = buf;
+	uint64_t acc = 0, v;
+	unsigned int i;
+
+	for (i = 0; i + 8 <= bytes; i += 8) {
+		memcpy(&v, p + i, sizeof(v));
+		acc |= v;
+	}
+	for (; i < bytes; i++)
+		acc |= p[i];
+	return !acc;
+}
+
+/* -3dB, in Q15 and as a plain factor */
+#define FOLD_Q15	23170
+#define FOLD_GAIN	0.70710678118654752
+
+static void fold_16_c(void *dst, const void *src, unsigned int frames)
+{
+	int16_t *d = dst;
+	const int16_t *s = src;
+	unsigned int i;
+	int v;
+
+	for (i = 0; i < frames; i++) {
+		v = d[i] + ((s[i] * FOLD_Q15 + (1 << 14)) >> 15);
+		if (v > INT16_MAX)
+			v = INT16_MAX;
+		else if (v < INT16_MIN)
+			v = INT16_MIN;
+		d[i] = v;
+	}
+}
+
+static void fold_32_c(void *dst, const void *src, unsigned int frames)
+{
+	int32_t *d = dst;
+	const int32_t *s = src;
+	unsigned int i;
+	double v;
+
+	for (i = 0; i < frames; i++) {
+		v = (double)d[i] + (double)s[i] * FOLD_GAIN;
+		if (v > INT32_MAX)
+			v = INT32_MAX;
+		else if (v < INT32_MIN)
+			v = INT32_MIN;
+		d[i] = (int32_t)lrint(v);	/* ties to even, as cvtpd2dq */
+	}
+}
+
+static void fold_flt_c(void *dst, const void *src, unsigned int frames)
+{
+	float *d = dst;
+	const float *s = src;
+	unsigned int i;
+
+	for (i = 0; i < frames; i++)
+		d[i] += s[i] * (float)FOLD_GAIN;
+}
+
+#ifdef A52_DSP_X86
+/*
+ * The vector versions transpose blocks of frames, four (SSE2) or eight
+ * (AVX2) at once, in groups of four and two adjacent source channels.
+ * The planes are looked up by the source channel for that.
+ */
+static void planes_by_source(void **planes, void *const *dst,
+			     unsigned int channels, const unsigned int *map)
+{
+	unsigned int ch;
+
+	for (ch = 0; ch < channels; ch++)
+		planes[map[ch]] = dst[ch];
+}
+
+/* the planes advanced by the given number of bytes */
+static void planes_offset(void **planes, void *const *dst,
+			  unsigned int channels, unsigned int ofs)
+{
+	unsigned int ch;
+
+	for (ch = 0; ch < channels; ch++)
+		planes[ch] = (char *)dst[ch] + ofs;
+}
+
+TARGET("sse2")
+static inline __m128i load_32(const void *p)
+{
+	int32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return _mm_cvtsi32_si128(v);
+}
+
+TARGET("sse2")
+static void deinterleave_16_sse2(void *const *dst, const void *src,
+				 unsigned int channels,
+				 const unsigned int *map,
+				 unsigned int frames)
+{
+	const int16_t *s = src;
+	void *planes[A52_DSP_MAX_CHANNELS];
+	unsigned int ch, i, n = frames & ~3U;
+
+	planes_by_source(planes, dst, channels, map);
+
+	for (i = 0; i < n; i += 4) {
+		const int16_t *p = s + i * channels;
+
+		for (ch = 0; ch + 4 <= channels; ch += 4) {
+			__m128i r0 = _mm_loadl_epi64((const __m128i *)(p + ch));
+			__m128i r1 = _mm_loadl_epi64((const __m128i *)(p + channels + ch));
+			__m128i r2 = _mm_loadl_epi64((const __m128i *)(p + 2 * channels + ch));
+			__m128i r3 = _mm_loadl_epi64((const __m128i *)(p + 3 * channels + ch));
+			__m128i t0 = _mm_unpacklo_epi16(r0, r1);
+			__m128i t1 = _mm_unpacklo_epi16(r2, r3);
+			__m128i c01 = _mm_unpacklo_epi32(t0, t1);
+			__m128i c23 = _mm_unpackhi_epi32(t0, t1);
+
+			_mm_storel_epi64((__m128i *)((int16_t *)planes[ch] + i), c01);
+			_mm_storel_epi64((__m128i *)((int16_t *)planes[ch + 1] + i),
+					 _mm_unpackhi_epi64(c01, c01));
+			_mm_storel_epi64((__m128i *)((int16_t *)planes[ch + 2] + i), c23);
+			_mm_storel_epi64((__m128i *)((int16_t *)planes[ch + 3] + i),
+					 _mm_unpackhi_epi64(c23, c23));
+		}
+		for (; ch + 2 <= channels; ch += 2) {
+			__m128i r0 = load_32(p + ch);
+			__m128i r1 = load_32(p + channels + ch);
+			__m128i r2 = load_32(p + 2 * channels + ch);
+			__m128i r3 = load_32(p + 3 * channels + ch);
+			__m128i c01 = _mm_unpacklo_epi32(_mm_unpacklo_epi16(r0, r1),
+							 _mm_unpacklo_epi16(r2, r3));
+
+			_mm_storel_epi64((__m128i *)((int16_t *)planes[ch] + i), c01);
+			_mm_storel_epi64((__m128i *)((int16_t *)planes[ch + 1] + i),
+					 _mm_unpackhi_epi64(c01, c01));
+		}
+		for (; ch < channels; ch++) {
+			int16_t *d = (int16_t *)planes[ch] + i;
+
+			d[0] = p[ch];
+			d[1] = p[channels + ch];
+			d[2] = p[2 * channels + ch];
+			d[3] = p[3 * channels + ch];
+		}
+	}
+
+	if (n < frames) {
+		planes_offset(planes, dst, channels, n * 2);
+		deinterleave_16_c(planes, s + n * channels, channels, map,
+				  frames - n);
+	}
+}
+
+TARGET("sse2")
+static void deinterleave_32_sse2(void *const *dst, const void *src,
+				 unsigned int channels,
+				 const unsigned int *map,
+				 unsigned int frames)
+{
+	const int32_t *s = src;
+	void *planes[A52_DSP_MAX_CHANNELS];
+	unsigned int ch, i, n = frames & ~3U;
+
+	planes_by_source(planes, dst, channels, map);
+
+	for (i = 0; i < n; i += 4) {
+		const int32_t *p = s + i * channels;
+
+		for (ch = 0; ch + 4 <= channels; ch += 4) {
+			__m128i r0 = _mm_loadu_si128((const __m128i *)(p + ch));
+			__m128i r1 = _mm_loadu_si128((const __m128i *)(p + channels + ch));
+			__m128i r2 = _mm_loadu_si128((const __m128i *)(p + 2 * channels + ch));
+			__m128i r3 = _mm_loadu_si128((const __m128i *)(p + 3 * channels + ch));
+			__m128i t0 = _mm_unpacklo_epi32(r0, r1);
+			__m128i t1 = _mm_unpacklo_epi32(r2, r3);
+			__m128i t2 = _mm_unpackhi_epi32(r0, r1);
+			__m128i t3 = _mm_unpackhi_epi32(r2, r3);
+
+			_mm_storeu_si128((__m128i *)((int32_t *)planes[ch] + i),
+					 _mm_unpacklo_epi64(t0, t1));
+			_mm_storeu_si128((__m128i *)((int32_t *)planes[ch + 1] + i),
+					 _mm_unpackhi_epi64(t0, t1));
+			_mm_storeu_si128((__m128i *)((int32_t *)planes[ch + 2] + i),
+					 _mm_unpacklo_epi64(t2, t3));
+			_mm_storeu_si128((__m128i *)((int32_t *)planes[ch + 3] + i),
+					 _mm_unpackhi_epi64(t2, t3));
+		}
+		for (; ch + 2 <= channels; ch += 2) {
+			__m128i r0 = _mm_loadl_epi64((const __m128i *)(p + ch));
+			__m128i r1 = _mm_loadl_epi64((const __m128i *)(p + channels + ch));
+			__m128i r2 = _mm_loadl_epi64((const __m128i *)(p + 2 * channels + ch));
+			__m128i r3 = _mm_loadl_epi64((const __m128i *)(p + 3 * channels + ch));
+			__m128i t0 = _mm_unpacklo_epi32(r0, r1);
+			__m128i t1 = _mm_unpacklo_epi32(r2, r3);
+
+			_mm_storeu_si128((__m128i *)((int32_t *)planes[ch] + i),
+					 _mm_unpacklo_epi64(t0, t1));
+			_mm_storeu_si128((__m128i *)((int32_t *)planes[ch + 1] + i),
+					 _mm_unpackhi_epi64(t0, t1));
+		}
+		for (; ch < channels; ch++) {
+			int32_t *d = (int32_t *)planes[ch] + i;
+
+			d[0] = p[ch];
+			d[1] = p[channels + ch];
+			d[2] = p[2 * channels + ch];
+			d[3] = p[3 * channels + ch];
+		}
+	}
+
+	if (n < frames) {
+		planes_offset(planes, dst, channels, n * 4);
+		deinterleave_32_c(planes, s + n * channels, channels, map,
+				  frames - n);
+	}
+}
+
+/* two 128bit rows of the frames k and k + 4 in the low and high lane */
+#define LOAD_LANES(lo, hi) \
+	_mm256_inserti128_si256(_mm256_castsi128_si256(lo), (hi), 1)
+
+TARGET("avx2")
+static void deinterleave_16_avx2(void *const *dst, const void *src,
+				 unsigned int channels,
+				 const unsigned int *map,
+				 unsigned int frames)
+{
+	const int16_t *s = src;
+	void *planes[A52_DSP_MAX_CHANNELS];
+	unsigned int ch, i, k, n = frames & ~7U;
+	const unsigned int step = 4 * channels;
+
+	planes_by_source(planes, dst, channels, map);
+
+	for (i = 0; i < n; i += 8) {
+		const int16_t *p = s + i * channels;
+		__m256i r[4], t0, t1, c;
+
+		for (ch = 0; ch + 4 <= channels; ch += 4) {
+			for (k = 0; k < 4; k++)
+				r[k] = LOAD_LANES(_mm_loadl_epi64((const __m128i *)(p + k * channels + ch)),
+						  _mm_loadl_epi64((const __m128i *)(p + k * channels + step + ch)));
+			t0 = _mm256_unpacklo_epi16(r[0], r[1]);
+			t1 = _mm256_unpacklo_epi16(r[2], r[3]);
+			c = _mm256_permute4x64_epi64(_mm256_unpacklo_epi32(t0, t1),
+						     _MM_SHUFFLE(3, 1, 2, 0));
+			_mm_storeu_si128((__m128i *)((int16_t *)planes[ch] + i),
+					 _mm256_castsi256_si128(c));
+			_mm_storeu_si128((__m128i *)((int16_t *)planes[ch + 1] + i),
+					 _mm256_extracti128_si256(c, 1));
+			c = _mm256_permute4x64_epi64(_mm256_unpackhi_epi32(t0, t1),
+						     _MM_SHUFFLE(3, 1, 2, 0));
+			_mm_storeu_si128((__m128i *)((int16_t *)planes[ch + 2] + i),
+					 _mm256_castsi256_si128(c));
+			_mm_storeu_si128((__m128i *)((int16_t *)planes[ch + 3] + i),
+					 _mm256_extracti128_si256(c, 1));
+		}
+		for (; ch + 2 <= channels; ch += 2) {
+			for (k = 0; k < 4; k++)
+				r[k] = LOAD_LANES(load_32(p + k * channels + ch),
+						  load_32(p + k * channels + step + ch));
+			t0 = _mm256_unpacklo_epi16(r[0], r[1]);
+			t1 = _mm256_unpacklo_epi16(r[2], r[3]);
+			c = _mm256_permute4x64_epi64(_mm256_unpacklo_epi32(t0, t1),
+						     _MM_SHUFFLE(3, 1, 2, 0));
+			_mm_storeu_si128((__m128i *)((int16_t *)planes[ch] + i),
+					 _mm256_castsi256_si128(c));
+			_mm_storeu_si128((__m128i *)((int16_t *)planes[ch + 1] + i),
+					 _mm256_extracti128_si256(c, 1));
+		}
+		for (; ch < channels; ch++) {
+			int16_t *d = (int16_t *)planes[ch] + i;
+
+			for (k = 0; k < 8; k++)
+				d[k] = p[k * channels + ch];
+		}
+	}
+
+	if (n < frames) {
+		planes_offset(planes, dst, channels, n * 2);
+		deinterleave_16_sse2(planes, s + n * channels, channels, map,
+				     frames - n);
+	}
+}
+
+TARGET("avx2")
+static void deinterleave_32_avx2(void *const *dst, const void *src,
+				 unsigned int channels,
+				 const unsigned int *map,
+				 unsigned int frames)
+{
+	const int32_t *s = src;
+	void *planes[A52_DSP_MAX_CHANNELS];
+	unsigned int ch, i, k, n = frames & ~7U;
+	const unsigned int step = 4 * channels;
+
+	planes_by_source(planes, dst, channels, map);
+
+	for (i = 0; i < n; i += 8) {
+		const int32_t *p = s + i * channels;
+		__m256i r[4], t0, t1, t2, t3;
+
+		for (ch = 0; ch + 4 <= channels; ch += 4) {
+			for (k = 0; k < 4; k++)
+				r[k] = LOAD_LANES(_mm_loadu_si128((const __m128i *)(p + k * channels + ch)),
+						  _mm_loadu_si128((const __m128i *)(p + k * channels + step + ch)));
+			t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+			t1 = _mm256_unpacklo_epi32(r[2], r[3]);
+			t2 = _mm256_unpackhi_epi32(r[0], r[1]);
+			t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+			_mm256_storeu_si256((__m256i *)((int32_t *)planes[ch] + i),
+					    _mm256_unpacklo_epi64(t0, t1));
+			_mm256_storeu_si256((__m256i *)((int32_t *)planes[ch + 1] + i),
+					    _mm256_unpackhi_epi64(t0, t1));
+			_mm256_storeu_si256((__m256i *)((int32_t *)planes[ch + 2] + i),
+					    _mm256_unpacklo_epi64(t2, t3));
+			_mm256_storeu_si256((__m256i *)((int32_t *)planes[ch + 3] + i),
+					    _mm256_unpackhi_epi64(t2, t3));
+		}
+		for (; ch + 2 <= channels; ch += 2) {
+			for (k = 0; k < 4; k++)
+				r[k] = LOAD_LANES(_mm_loadl_epi64((const __m128i *)(p + k * channels + ch)),
+						  _mm_loadl_epi64((const __m128i *)(p + k * channels + step + ch)));
+			t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+			t1 = _mm256_unpacklo_epi32(r[2], r[3]);
+			_mm256_storeu_si256((__m256i *)((int32_t *)planes[ch] + i),
+					    _mm256_unpacklo_epi64(t0, t1));
+			_mm256_storeu_si256((__m256i *)((int32_t *)planes[ch + 1] + i),
+					    _mm256_unpackhi_epi64(t0, t1));
+		}
+		for (; ch < channels; ch++) {
+			int32_t *d = (int32_t *)planes[ch] + i;
+
+			for (k = 0; k < 8; k++)
+				d[k] = p[k * channels + ch];
+		}
+	}
+
+	if (n < frames) {
+		planes_offset(planes, dst, channels, n * 4);
+		deinterleave_32_sse2(planes, s + n * channels, channels, map,
+				     frames - n);
+	}
+}
+
+TARGET("sse2")
+static void bswap_16_sse2(void *buf, unsigned int bytes)
+{
+	unsigned char *p = buf;
+	unsigned int i;
+
+	for (i = 0; i + 16 <= bytes; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *)(p + i), v);
+	}
+	bswap_16_c(p + i, bytes - i);
+}
+
+TARGET("ssse3")
+static void bswap_16_ssse3(void *buf, unsigned int bytes)
+{
+	const __m128i shuf = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+					   9, 8, 11, 10, 13, 12, 15, 14);
+	unsigned char *p = buf;
+	unsigned int i;
+
+	for (i = 0; i + 16 <= bytes; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+
+		_mm_storeu_si128((__m128i *)(p + i), _mm_shuffle_epi8(v, shuf));
+	}
+	bswap_16_c(p + i, bytes - i);
+}
+
+TARGET("avx2")
+static void bswap_16_avx2(void *buf, unsigned int bytes)
+{
+	const __m256i shuf = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+					      9, 8, 11, 10, 13, 12, 15, 14,
+					      1, 0, 3, 2, 5, 4, 7, 6,
+					      9, 8, 11, 10, 13, 12, 15, 14);
+	unsigned char *p = buf;
+	unsigned int i;
+
+	for (i = 0; i + 32 <= bytes; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+
+		_mm256_storeu_si256((__m256i *)(p + i),
+				    _mm256_shuffle_epi8(v, shuf));
+	}
+	bswap_16_ssse3(p + i, bytes - i);
+}
+
+TARGET("sse2")
+static int is_zero_sse2(const void *buf, unsigned int bytes)
+{
+	const unsigned char *p = buf;
+	__m128i acc = _mm_setzero_si128();
+	unsigned int i;
+
+	for (i = 0; i + 16 <= bytes; i += 16)
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + i)));
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff)
+		return 0;
+	return is_zero_c(p + i, bytes - i);
+}
+
+TARGET("avx2")
+static int is_zero_avx2(const void *buf, unsigned int bytes)
+{
+	const unsigned char *p = buf;
+	__m256i acc = _mm256_setzero_si256();
+	unsigned int i;
+
+	for (i = 0; i + 32 <= bytes; i += 32)
+		acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i *)(p + i)));
+	if (!_mm256_testz_si256(acc, acc))
+		return 0;
+	return is_zero_sse2(p + i, bytes - i);
+}
+
+TARGET("ssse3")
+static void fold_16_ssse3(void *dst, const void *src, unsigned int frames)
+{
+	const __m128i gain = _mm_set1_epi16(FOLD_Q15);
+	int16_t *d = dst;
+	const int16_t *s = src;
+	unsigned int i;
+
+	for (i = 0; i + 8 <= frames; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+
+		/* mulhrs rounds just like the C version */
+		v = _mm_adds_epi16(_mm_loadu_si128((const __m128i *)(d + i)),
+				   _mm_mulhrs_epi16(v, gain));
+		_mm_storeu_si128((__m128i *)(d + i), v);
+	}
+	fold_16_c(d + i, s + i, frames - i);
+}
+
+TARGET("avx2")
+static void fold_16_avx2(void *dst, const void *src, unsigned int frames)
+{
+	const __m256i gain = _mm256_set1_epi16(FOLD_Q15);
+	int16_t *d = dst;
+	const int16_t *s = src;
+	unsigned int i;
+
+	for (i = 0; i + 16 <= frames; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+
+		v = _mm256_adds_epi16(_mm256_loadu_si256((const __m256i *)(d + i)),
+				      _mm256_mulhrs_epi16(v, gain));
+		_mm256_storeu_si256((__m256i *)(d + i), v);
+	}
+	fold_16_ssse3(d + i, s + i, frames - i);
+}
+
+/* two 32bit samples of each, in double precision to stay exact */
+TARGET("sse2")
+static inline __m128i fold_32_pd(__m128i d, __m128i s)
+{
+	const __m128d gain = _mm_set1_pd(FOLD_GAIN);
+	const __m128d vmax = _mm_set1_pd(INT32_MAX);
+	const __m128d vmin = _mm_set1_pd(INT32_MIN);
+	__m128d v;
+
+	v = _mm_add_pd(_mm_cvtepi32_pd(d),
+		       _mm_mul_pd(_mm_cvtepi32_pd(s), gain));
+	v = _mm_max_pd(_mm_min_pd(v, vmax), vmin);
+	return _mm_cvtpd_epi32(v);
+}
+
+TARGET("sse2")
+static void fold_32_sse2(void *dst, const void *src, unsigned int frames)
+{
+	int32_t *d = dst;
+	const int32_t *s = src;
+	unsigned int i;
+
+	for (i = 0; i + 4 <= frames; i += 4) {
+		__m128i vd = _mm_loadu_si128((const __m128i *)(d + i));
+		__m128i vs = _mm_loadu_si128((const __m128i *)(s + i));
+		__m128i lo = fold_32_pd(vd, vs);
+		__m128i hi = fold_32_pd(_mm_srli_si128(vd, 8),
+					_mm_srli_si128(vs, 8));
+
+		_mm_storeu_si128((__m128i *)(d + i), _mm_unpacklo_epi64(lo, hi));
+	}
+	fold_32_c(d + i, s + i, frames - i);
+}
+
+TARGET("avx2")
+static void fold_32_avx2(void *dst, const void *src, unsigned int frames)
+{
+	const __m256d gain = _mm256_set1_pd(FOLD_GAIN);
+	const __m256d vmax = _mm256_set1_pd(INT32_MAX);
+	const __m256d vmin = _mm256_set1_pd(INT32_MIN);
+	int32_t *d = dst;
+	const int32_t *s = src;
+	unsigned int i;
+
+	for (i = 0; i + 4 <= frames; i += 4) {
+		__m256d v;
+
+		v = _mm256_add_pd(_mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i *)(d + i))),
+				  _mm256_mul_pd(_mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i *)(s + i))),
+						gain));
+		v = _mm256_max_pd(_mm256_min_pd(v, vmax), vmin);
+		_mm_storeu_si128((__m128i *)(d + i), _mm256_cvtpd_epi32(v));
+	}
+	fold_32_c(d + i, s + i, frames - i);
+}
+
+TARGET("sse2")
+static void fold_flt_sse2(void *dst, const void *src, unsigned int frames)
+{
+	const __m128 gain = _mm_set1_ps((float)FOLD_GAIN);
+	float *d = dst;
+	const float *s = src;
+	unsigned int i;
+
+	for (i = 0; i + 4 <= frames; i += 4)
+		_mm_storeu_ps(d + i, _mm_add_ps(_mm_loadu_ps(d + i),
+						_mm_mul_ps(_mm_loadu_ps(s + i), gain)));
+	fold_flt_c(d + i, s + i, frames - i);
+}
+
+TARGET("avx2")
+static void fold_flt_avx2(void *dst, const void *src, unsigned int frames)
+{
+	const __m256 gain = _mm256_set1_ps((float)FOLD_GAIN);
+	float *d = dst;
+	const float *s = src;
+	unsigned int i;
+
+	for (i = 0; i + 8 <= frames; i += 8)
+		_mm256_storeu_ps(d + i, _mm256_add_ps(_mm256_loadu_ps(d + i),
+						      _mm256_mul_ps(_mm256_loadu_ps(s + i), gain)));
+	fold_flt_sse2(d + i, s + i, frames - i);
+}
+#endif /* A52_DSP_X86 */
+
+void a52_dsp_init(struct a52_dsp *dsp)
+{
+	dsp->deinterleave_16 = deinterleave_16_c;
+	dsp->deinterleave_32 = deinterleave_32_c;
+	dsp->bswap_16 = bswap_16_c;
+	dsp->is_zero = is_zero_c;
+	dsp->fold_16 = fold_16_c;
+	dsp->fold_32 = fold_32_c;
+	dsp->fold_flt = fold_flt_c;
+
+#ifdef A52_DSP_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		dsp->deinterleave_16 = deinterleave_16_sse2;
+		dsp->deinterleave_32 = deinterleave_32_sse2;
+		dsp->bswap_16 = bswap_16_sse2;
+		dsp->is_zero = is_zero_sse2;
+		dsp->fold_32 = fold_32_sse2;
+		dsp->fold_flt = fold_flt_sse2;
+	}
+	if (__builtin_cpu_supports("ssse3")) {
+		dsp->bswap_16 = bswap_16_ssse3;
+		dsp->fold_16 = fold_16_ssse3;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		dsp->deinterleave_16 = deinterleave_16_avx2;
+		dsp->deinterleave_32 = deinterleave_32_avx2;
+		dsp->bswap_16 = bswap_16_avx2;
+		dsp->is_zero = is_zero_avx2;
+		dsp->fold_16 = fold_16_avx2;
+		dsp->fold_32 = fold_32_avx2;
+		dsp->fold_flt = fold_flt_avx2;
+	}
+#endif
+}
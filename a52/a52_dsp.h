@@ -0,0 +1,58 @@
+/*
+ * A52 Output Plugin - sample processing kernels
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __A52_DSP_H
+#define __A52_DSP_H
+
+#define A52_DSP_MAX_CHANNELS	8
+
+/*
+ * Copy interleaved frames of the given number of channels to separate
+ * planes.  The plane dst[i] receives the source channel map[i].
+ */
+typedef void (*a52_deinterleave_t)(void *const *dst, const void *src,
+				   unsigned int channels,
+				   const unsigned int *map,
+				   unsigned int frames);
+
+/* swap the bytes of 16bit words in place; bytes must be even */
+typedef void (*a52_bswap_t)(void *buf, unsigned int bytes);
+
+/* check whether all bytes of the buffer are zero */
+typedef int (*a52_is_zero_t)(const void *buf, unsigned int bytes);
+
+/*
+ * Add the samples of src attenuated by 3dB to dst, for folding an extra
+ * channel into a neighbour.  The integer versions saturate.
+ */
+typedef void (*a52_fold_t)(void *dst, const void *src, unsigned int frames);
+
+struct a52_dsp {
+	a52_deinterleave_t deinterleave_16;
+	a52_deinterleave_t deinterleave_32;
+	a52_bswap_t bswap_16;
+	a52_is_zero_t is_zero;
+	a52_fold_t fold_16;
+	a52_fold_t fold_32;
+	a52_fold_t fold_flt;
+};
+
+/* pick the fastest implementations for the running CPU */
+void a52_dsp_init(struct a52_dsp *dsp);
+
+#endif /* __A52_DSP_H */
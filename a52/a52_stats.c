@@ -0,0 +1,87 @@
+/*
+ * A52 Output Plugin - runtime statistics
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "a52_stats.h"
+
+struct a52_stats *a52_stats_new(const char *path)
+{
+	struct a52_stats *stats;
+	int fd;
+
+	if (!path || !*path) {
+		stats = mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	} else {
+		fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			SYSERR("Cannot open stats file %s", path);
+			return NULL;
+		}
+		/* start from zero, also when a previous run left data */
+		if (ftruncate(fd, 0) < 0 ||
+		    ftruncate(fd, sizeof(*stats)) < 0) {
+			SYSERR("Cannot resize stats file %s", path);
+			close(fd);
+			return NULL;
+		}
+		stats = mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE,
+			     MAP_SHARED, fd, 0);
+		close(fd);
+	}
+	if (stats == MAP_FAILED)
+		return NULL;
+
+	stats->magic = A52_STATS_MAGIC;
+	stats->version = A52_STATS_VERSION;
+	return stats;
+}
+
+void a52_stats_free(struct a52_stats *stats)
+{
+	if (stats)
+		munmap(stats, sizeof(*stats));
+}
+
+void a52_stats_dump(const struct a52_stats *stats, snd_output_t *out)
+{
+	unsigned int i;
+
+	snd_output_printf(out, "  %-13s: %llu\n", "bursts",
+			  (unsigned long long)stats->bursts);
+	snd_output_printf(out, "  %-13s: %llu\n", "silent",
+			  (unsigned long long)stats->silent);
+	snd_output_printf(out, "  %-13s: %llu\n", "short_writes",
+			  (unsigned long long)stats->short_writes);
+	snd_output_printf(out, "  %-13s: %llu\n", "xruns",
+			  (unsigned long long)stats->xruns);
+	snd_output_printf(out, "  %-13s: %llu\n", "encode_max_us",
+			  (unsigned long long)stats->encode_max_ns / 1000);
+	snd_output_printf(out, "  encode time histogram:\n");
+	for (i = 0; i < A52_STATS_BUCKETS; i++) {
+		if (!stats->encode_hist[i])
+			continue;
+		snd_output_printf(out, "    %s%6u us: %llu\n",
+				  i == A52_STATS_BUCKETS - 1 ? ">=" : "< ",
+				  i == A52_STATS_BUCKETS - 1 ? 1U << i : 2U << i,
+				  (unsigned long long)stats->encode_hist[i]);
+	}
+}
@@ -0,0 +1,80 @@
+/*
+ * A52 Output Plugin - runtime statistics
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __A52_STATS_H
+#define __A52_STATS_H
+
+#include <stdint.h>
+#include <time.h>
+#include <alsa/asoundlib.h>
+
+#define A52_STATS_MAGIC		0x41353253	/* "A52S" */
+#define A52_STATS_VERSION	1
+#define A52_STATS_BUCKETS	16
+
+/*
+ * The layout of the stats file.  Each counter is updated by a single
+ * thread with plain 64bit stores, so a reader sees consistent values
+ * per counter but not necessarily a consistent set of them.
+ */
+struct a52_stats {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t bursts;	/* bursts passed to the slave */
+	uint64_t silent;	/* of those, pre-encoded silent bursts */
+	uint64_t short_writes;	/* slave writes returning early or -EAGAIN */
+	uint64_t xruns;
+	uint64_t encode_max_ns;
+	/* encode durations; bucket i counts [2^i, 2^(i+1)) usecs,
+	 * bucket 0 includes anything shorter and the last one anything
+	 * longer
+	 */
+	uint64_t encode_hist[A52_STATS_BUCKETS];
+};
+
+/* allocate the stats, shared through the given file if path is set */
+struct a52_stats *a52_stats_new(const char *path);
+void a52_stats_free(struct a52_stats *stats);
+void a52_stats_dump(const struct a52_stats *stats, snd_output_t *out);
+
+static inline uint64_t a52_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* account an encoded burst started at the given time */
+static inline void a52_stats_encoded(struct a52_stats *stats, uint64_t start)
+{
+	uint64_t ns = a52_stats_now() - start;
+	uint64_t us = ns / 1000;
+	unsigned int b = 0;
+
+	while (us > 1 && b < A52_STATS_BUCKETS - 1) {
+		us >>= 1;
+		b++;
+	}
+	stats->encode_hist[b]++;
+	if (ns > stats->encode_max_ns)
+		stats->encode_max_ns = ns;
+	stats->bursts++;
+}
+
+#endif /* __A52_STATS_H */
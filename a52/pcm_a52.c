@@ -19,14 +19,21 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#define __USE_XOPEN
 #include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 #include <alsa/asoundlib.h>
 #include <alsa/pcm_external.h>
 #include <alsa/pcm_plugin.h>
 #include <libavcodec/avcodec.h>
 #include <libavutil/avutil.h>
+#include "a52_dsp.h"
+#include "a52_stats.h"
 
 #ifndef ESTRPIPE
 #define ESTRPIPE ESPIPE
@@ -56,7 +63,9 @@
 #if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(54, 0, 0)
 #ifndef AV_CH_LAYOUT_STEREO
 #define AV_CH_LAYOUT_STEREO	CH_LAYOUT_STEREO
+#define AV_CH_LAYOUT_SURROUND	CH_LAYOUT_SURROUND
 #define AV_CH_LAYOUT_QUAD	CH_LAYOUT_QUAD
+#define AV_CH_LAYOUT_5POINT0	CH_LAYOUT_5POINT0
 #define AV_CH_LAYOUT_5POINT1	CH_LAYOUT_5POINT1
 #endif
 #endif
@@ -82,41 +91,88 @@
 #define av_frame_free avcodec_free_frame
 #endif
 
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(56, 56, 0)
+#define encoder_delay(avctx)	(avctx)->initial_padding
+#else
+#define encoder_delay(avctx)	(avctx)->delay
+#endif
+
 #define HAVE_AVCODEC_FREE_CONTEXT (LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(55, 69, 100))
 #define HAVE_CH_LAYOUT (LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100))
 
+/* number of a52 frames queued to the encoder thread */
+#define A52_THREAD_SLOTS	4
+
+/* one a52 frame of input samples and its encoded IEC958 burst */
+struct a52_slot {
+	void *inbuf;
+	unsigned char *outbuf;	/* points to the burst to be written out */
+	unsigned char *outbuf1;
+	int burst_bytes;	/* outbuf1 is zero beyond this */
+	int silent;		/* all input samples are zero */
+	int err;		/* encoding failed, nothing to write out */
+#ifdef USE_AVCODEC_FRAME
+	AVFrame *frame;
+#endif
+};
+
 struct a52_ctx {
 	snd_pcm_ioplug_t io;
 	snd_pcm_t *slave;
 	AVCodec *codec;
+	AVCodec *codec_int;	/* encoder for the integer input */
+	AVCodec *codec_flt;	/* float encoder for FLOAT input, if any */
 	AVCodecContext *avctx;
 	snd_pcm_format_t src_format;
 	unsigned int src_sample_bits;
 	unsigned int src_sample_bytes;
 	snd_pcm_format_t format;
 	int av_format;
+	int av_format_int;	/* sample format of codec_int */
 	unsigned int channels;
+	unsigned int enc_channels;	/* channels passed to the encoder */
 	unsigned int rate;
 	unsigned int bitrate;
-	void *inbuf;
+	struct a52_slot slots[A52_THREAD_SLOTS];
+	unsigned int num_slots;
 	unsigned char *outbuf;
-	unsigned char *outbuf1;
-	unsigned char *outbuf2;
 	int outbuf_size;
 	int remain;
 	int filled;
 	unsigned int slave_period_size;
 	unsigned int slave_buffer_size;
+	snd_pcm_uframes_t start_threshold;
+	int slave_mmap;		/* mmap access to the slave is requested */
+	int slave_nonblock;	/* the slave is opened in non-blocking mode */
+	int use_mmap;		/* ... and accepted by the slave */
 	snd_pcm_uframes_t pointer;
 	snd_pcm_uframes_t boundary;
 	snd_pcm_hw_params_t *hw_params;
+	struct a52_dsp dsp;
+	unsigned char *silent_burst;	/* pre-encoded burst of a silent frame */
+	int enc_silent;		/* the last frame passed to the encoder was silent */
+	struct a52_stats *stats;	/* NULL unless enabled */
 #ifdef USE_AVCODEC_PACKET_ALLOC
 	AVPacket *pkt;
 #endif
 #ifdef USE_AVCODEC_FRAME
-	AVFrame *frame;
 	int is_planar;
 #endif
+	/* encoder thread; slots are filled by the application thread,
+	 * encoded by the worker and written out again by the application
+	 * thread.  All three indices only ever increase.
+	 */
+	int low_latency;	/* keep only the minimum number of bursts */
+	int threaded;
+	int thread_running;
+	pthread_t thread;
+	sem_t enc_sem;		/* posted for each submitted slot */
+	sem_t done_sem;		/* posted for each encoded slot */
+	atomic_uint enc_head;	/* slots submitted to the encoder */
+	atomic_uint enc_tail;	/* slots encoded */
+	unsigned int out_idx;	/* slots taken for writing out */
+	atomic_uint enc_drop;	/* slots before this one are not encoded */
+	atomic_int enc_quit;
 };
 
 #ifdef USE_AVCODEC_FRAME
@@ -126,12 +182,13 @@ struct a52_ctx {
 #endif
 
 #if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 91, 0)
-static int do_encode(struct a52_ctx *rec)
+static int do_encode(struct a52_ctx *rec, struct a52_slot *slot,
+		     unsigned char *buf)
 {
 	AVPacket *pkt = rec->pkt;
 	int ret;
 
-	ret = avcodec_send_frame(rec->avctx, rec->frame);
+	ret = avcodec_send_frame(rec->avctx, slot->frame);
 	if (ret < 0)
 		return -EINVAL;
 	ret = avcodec_receive_packet(rec->avctx, pkt);
@@ -140,31 +197,33 @@ static int do_encode(struct a52_ctx *rec)
 
 	if (pkt->size > rec->outbuf_size - 8)
 		return -EINVAL;
-	memcpy(rec->outbuf1 + 8, pkt->data, pkt->size);
+	memcpy(buf + 8, pkt->data, pkt->size);
 
 	return pkt->size;
 }
 #elif LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(53, 34, 0)
-static int do_encode(struct a52_ctx *rec)
+static int do_encode(struct a52_ctx *rec, struct a52_slot *slot,
+		     unsigned char *buf)
 {
 	AVPacket pkt = {
-		.data = rec->outbuf1 + 8,
+		.data = buf + 8,
 		.size = rec->outbuf_size - 8
 	};
 	int ret, got_frame;
 
-	ret = avcodec_encode_audio2(rec->avctx, &pkt, rec->frame, &got_frame);
+	ret = avcodec_encode_audio2(rec->avctx, &pkt, slot->frame, &got_frame);
 	if (ret < 0)
 		return -EINVAL;
 
 	return pkt.size;
 }
 #else
-static int do_encode(struct a52_ctx *rec)
+static int do_encode(struct a52_ctx *rec, struct a52_slot *slot,
+		     unsigned char *buf)
 {
-	int ret = avcodec_encode_audio(rec->avctx, rec->outbuf1 + 8,
+	int ret = avcodec_encode_audio(rec->avctx, buf + 8,
 				       rec->outbuf_size - 8,
-				       rec->inbuf);
+				       slot->inbuf);
 	if (ret < 0)
 		return -EINVAL;
 
@@ -172,16 +231,38 @@ static int do_encode(struct a52_ctx *rec)
 }
 #endif
 
-/* convert the PCM data to A52 stream in IEC958 */
-static int convert_data(struct a52_ctx *rec)
+/* A silent frame after another silent one encodes to the same burst,
+ * the encoder state being all zero already.  The first one still goes
+ * through the encoder to flush the previous samples.
+ */
+static int use_silent_burst(struct a52_ctx *rec, struct a52_slot *slot)
 {
-	unsigned char *buf;
-	int out_bytes = do_encode(rec);
+	if (slot->silent && rec->enc_silent && rec->silent_burst) {
+		if (rec->stats) {
+			rec->stats->silent++;
+			rec->stats->bursts++;
+		}
+		return 1;
+	}
+	rec->enc_silent = slot->silent;
+	return 0;
+}
+
+/* encode the slot to an IEC958 burst at buf; the bytes beyond
+ * *burst_bytes are known to be zero and it's updated accordingly
+ */
+static int encode_burst(struct a52_ctx *rec, struct a52_slot *slot,
+			unsigned char *buf, int *burst_bytes)
+{
+	uint64_t start = 0;
+	int out_bytes, len;
 
+	if (rec->stats)
+		start = a52_stats_now();
+	out_bytes = do_encode(rec, slot, buf);
 	if (out_bytes < 0)
 		return out_bytes;
 
-	buf = rec->outbuf1;
 	buf[0] = 0xf8; /* sync words */
 	buf[1] = 0x72;
 	buf[2] = 0x4e;
@@ -190,42 +271,321 @@ static int convert_data(struct a52_ctx *rec)
 	buf[5] = 0x01; /* data type */
 	buf[6] = ((out_bytes * 8) >> 8) & 0xff;
 	buf[7] = (out_bytes * 8) & 0xff;
+	/* only clear what a longer previous burst left behind */
+	len = out_bytes + 8;
+	if (*burst_bytes > len)
+		memset(buf + len, 0, *burst_bytes - len);
+	len = (len + 1) & ~1;
+	*burst_bytes = len;
 	/* swap bytes for little-endian 16bit */
-	if (rec->format == SND_PCM_FORMAT_S16_LE) {
-		swab(rec->outbuf1, rec->outbuf2, out_bytes + 8);
-		buf = rec->outbuf2;
+	if (rec->format == SND_PCM_FORMAT_S16_LE)
+		rec->dsp.bswap_16(buf, len);
+
+	if (rec->stats)
+		a52_stats_encoded(rec->stats, start);
+	return 0;
+}
+
+/* convert the PCM data to A52 stream in IEC958 */
+static int convert_data(struct a52_ctx *rec, struct a52_slot *slot)
+{
+	int err;
+
+	if (use_silent_burst(rec, slot)) {
+		slot->outbuf = rec->silent_burst;
+		return 0;
 	}
-	rec->outbuf = buf;
-	memset(buf + 8 + out_bytes, 0,
-	       rec->outbuf_size - 8 - out_bytes);
-	rec->remain = rec->outbuf_size / 4;
-	rec->filled = 0;
+	/* the padding of outbuf1 stays zero from the allocation */
+	err = encode_burst(rec, slot, slot->outbuf1, &slot->burst_bytes);
+	if (err < 0)
+		return err;
+	slot->outbuf = slot->outbuf1;
+	return 0;
+}
+
+/*
+ * encoder thread
+ *
+ * The application thread fills the slot at enc_head and submits it,
+ * the worker encodes the slots up to enc_head and advances enc_tail,
+ * and write_out_pending() picks up the encoded bursts from out_idx.
+ */
+static void *a52_encoder_thread(void *arg)
+{
+	struct a52_ctx *rec = arg;
+	struct a52_slot *slot;
+	unsigned int idx;
+	int err;
 
+	for (;;) {
+		while (sem_wait(&rec->enc_sem) < 0 && errno == EINTR)
+			;
+		if (atomic_load(&rec->enc_quit))
+			break;
+		idx = atomic_load_explicit(&rec->enc_tail, memory_order_relaxed);
+		while (idx != atomic_load_explicit(&rec->enc_head,
+						   memory_order_acquire)) {
+			slot = &rec->slots[idx % rec->num_slots];
+			if ((int)(idx - atomic_load_explicit(&rec->enc_drop,
+							     memory_order_relaxed)) < 0) {
+				/* discarded by a52_reprepare() */
+				slot->err = -ECANCELED;
+			} else {
+				err = convert_data(rec, slot);
+				slot->err = err < 0 ? err : 0;
+			}
+			idx++;
+			atomic_store_explicit(&rec->enc_tail, idx,
+					      memory_order_release);
+			sem_post(&rec->done_sem);
+		}
+	}
+	return NULL;
+}
+
+static int a52_thread_start(struct a52_ctx *rec)
+{
+	unsigned int idx = atomic_load(&rec->enc_head);
+
+	atomic_store(&rec->enc_tail, idx);
+	atomic_store(&rec->enc_drop, idx);
+	rec->out_idx = idx;
+	atomic_store(&rec->enc_quit, 0);
+	if (sem_init(&rec->enc_sem, 0, 0) < 0)
+		return -errno;
+	if (sem_init(&rec->done_sem, 0, 0) < 0) {
+		sem_destroy(&rec->enc_sem);
+		return -errno;
+	}
+	if (pthread_create(&rec->thread, NULL, a52_encoder_thread, rec)) {
+		sem_destroy(&rec->done_sem);
+		sem_destroy(&rec->enc_sem);
+		return -ENOMEM;
+	}
+	rec->thread_running = 1;
 	return 0;
 }
 
+static void a52_thread_stop(struct a52_ctx *rec)
+{
+	if (!rec->thread_running)
+		return;
+	atomic_store(&rec->enc_quit, 1);
+	sem_post(&rec->enc_sem);
+	pthread_join(rec->thread, NULL);
+	sem_destroy(&rec->done_sem);
+	sem_destroy(&rec->enc_sem);
+	rec->thread_running = 0;
+}
+
+/* wait until the encoder has finished all submitted slots */
+static void a52_thread_sync(struct a52_ctx *rec)
+{
+	if (!rec->thread_running)
+		return;
+	while (atomic_load_explicit(&rec->enc_tail, memory_order_acquire) !=
+	       atomic_load_explicit(&rec->enc_head, memory_order_relaxed))
+		sem_wait(&rec->done_sem);
+}
+
+/* wait until the encoder thread has finished one more slot; returns 0
+ * at once if it has nothing left to encode
+ */
+static int a52_thread_wait(struct a52_ctx *rec)
+{
+	unsigned int tail = atomic_load_explicit(&rec->enc_tail,
+						 memory_order_acquire);
+
+	if (tail == atomic_load_explicit(&rec->enc_head, memory_order_relaxed))
+		return 0;
+	while (atomic_load_explicit(&rec->enc_tail, memory_order_acquire) == tail)
+		sem_wait(&rec->done_sem);
+	return 1;
+}
+
+/* pass the filled slot to the encoder thread */
+static void a52_thread_submit(struct a52_ctx *rec)
+{
+	atomic_fetch_add_explicit(&rec->enc_head, 1, memory_order_release);
+	sem_post(&rec->enc_sem);
+	rec->filled = 0;
+}
+
+/* number of slots not yet available for filling */
+static unsigned int a52_slots_busy(struct a52_ctx *rec)
+{
+	return atomic_load_explicit(&rec->enc_head, memory_order_relaxed) -
+		rec->out_idx + (rec->remain ? 1 : 0);
+}
+
+/* the slot receiving the input samples */
+static struct a52_slot *a52_fill_slot(struct a52_ctx *rec)
+{
+	unsigned int idx = atomic_load_explicit(&rec->enc_head,
+						memory_order_relaxed);
+
+	return &rec->slots[idx % rec->num_slots];
+}
+
+/* frames accepted from the application but not yet passed to the slave */
+static snd_pcm_sframes_t a52_pending_frames(struct a52_ctx *rec)
+{
+	snd_pcm_sframes_t frames = rec->remain + rec->filled;
+
+	if (rec->threaded)
+		frames += (snd_pcm_sframes_t)(atomic_load(&rec->enc_head) -
+					      rec->out_idx) *
+			rec->avctx->frame_size;
+	return frames;
+}
+
+/* take the next encoded burst from the encoder thread; a slot that
+ * failed to encode is dropped and its error returned
+ */
+static int a52_thread_pop(struct a52_ctx *rec)
+{
+	struct a52_slot *slot;
+
+	if (rec->out_idx == atomic_load_explicit(&rec->enc_tail,
+						 memory_order_acquire))
+		return 0;
+	slot = &rec->slots[rec->out_idx % rec->num_slots];
+	rec->out_idx++;
+	if (slot->err < 0)
+		return slot->err;
+	rec->outbuf = slot->outbuf;
+	rec->remain = rec->avctx->frame_size;
+	return 1;
+}
+
 /* write pending encoded data to the slave pcm */
 static int write_out_pending(snd_pcm_ioplug_t *io, struct a52_ctx *rec)
 {
 	snd_pcm_sframes_t ret;
 	unsigned int ofs;
+	int err;
 
-	while (rec->remain) {
+	for (;;) {
+		if (!rec->remain) {
+			if (!rec->threaded)
+				break;
+			err = a52_thread_pop(rec);
+			if (err <= 0)
+				return err;
+		}
 		ofs = (rec->avctx->frame_size - rec->remain) * 4;
-		ret = snd_pcm_writei(rec->slave, rec->outbuf + ofs, rec->remain);
+		if (rec->use_mmap)
+			ret = snd_pcm_mmap_writei(rec->slave, rec->outbuf + ofs,
+						  rec->remain);
+		else
+			ret = snd_pcm_writei(rec->slave, rec->outbuf + ofs,
+					     rec->remain);
 		if (ret < 0) {
-			if (ret == -EPIPE)
+			if (ret == -EPIPE) {
 				io->state = SND_PCM_STATE_XRUN;
-			if (ret == -EAGAIN)
+				if (rec->stats)
+					rec->stats->xruns++;
+			}
+			if (ret == -EAGAIN) {
+				if (rec->stats)
+					rec->stats->short_writes++;
 				break;
+			}
 			return ret;
 		} else if (! ret)
 			break;
+		if (ret < rec->remain && rec->stats)
+			rec->stats->short_writes++;
 		rec->remain -= ret;
 	}
 	return 0;
 }
 
+/* Encode the slot straight into the mmap buffer of the slave.
+ *
+ * Returns 1 if the burst was committed, or 0 if the slave has no
+ * contiguous room for a whole burst at the moment.
+ */
+static int convert_to_slave(snd_pcm_ioplug_t *io, struct a52_ctx *rec,
+			    struct a52_slot *slot)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames = rec->avctx->frame_size;
+	snd_pcm_sframes_t avail, ret;
+	unsigned char *buf;
+	int err, burst_bytes;
+
+	avail = snd_pcm_avail_update(rec->slave);
+	if (avail < rec->avctx->frame_size)
+		return 0;
+	err = snd_pcm_mmap_begin(rec->slave, &areas, &offset, &frames);
+	if (err < 0)
+		return 0;
+	if (frames < (snd_pcm_uframes_t)rec->avctx->frame_size) {
+		snd_pcm_mmap_commit(rec->slave, offset, 0);
+		return 0;
+	}
+
+	buf = (unsigned char *)areas[0].addr +
+		(areas[0].first + offset * areas[0].step) / 8;
+	if (use_silent_burst(rec, slot)) {
+		memcpy(buf, rec->silent_burst, rec->outbuf_size);
+	} else {
+		/* nothing is known about the previous contents */
+		burst_bytes = rec->outbuf_size;
+		err = encode_burst(rec, slot, buf, &burst_bytes);
+		if (err < 0) {
+			snd_pcm_mmap_commit(rec->slave, offset, 0);
+			return err;
+		}
+	}
+
+	ret = snd_pcm_mmap_commit(rec->slave, offset, rec->avctx->frame_size);
+	if (ret < 0) {
+		if (ret == -EPIPE) {
+			io->state = SND_PCM_STATE_XRUN;
+			if (rec->stats)
+				rec->stats->xruns++;
+		}
+		return ret;
+	}
+	rec->filled = 0;
+
+	/* unlike writei, a commit doesn't start the stream by itself */
+	if (snd_pcm_state(rec->slave) == SND_PCM_STATE_PREPARED) {
+		avail = snd_pcm_avail_update(rec->slave);
+		if (avail >= 0 &&
+		    rec->slave_buffer_size - avail >= rec->start_threshold)
+			snd_pcm_start(rec->slave);
+	}
+	return 1;
+}
+
+/* encode the filled slot, or hand it over to the encoder thread */
+static int submit_data(snd_pcm_ioplug_t *io, struct a52_ctx *rec)
+{
+	struct a52_slot *slot;
+	int err;
+
+	if (rec->threaded) {
+		a52_thread_submit(rec);
+		return 0;
+	}
+	slot = a52_fill_slot(rec);
+	if (rec->use_mmap && !rec->remain) {
+		err = convert_to_slave(io, rec, slot);
+		if (err)
+			return err < 0 ? err : 0;
+	}
+	err = convert_data(rec, slot);
+	if (err < 0)
+		return err;
+	rec->outbuf = slot->outbuf;
+	rec->remain = rec->outbuf_size / 4;
+	rec->filled = 0;
+	return 0;
+}
+
 /*
  * drain callback
  */
@@ -233,35 +593,103 @@ static int write_out_pending(snd_pcm_ioplug_t *io, struct a52_ctx *rec)
 static void clear_remaining_planar_data(snd_pcm_ioplug_t *io)
 {
 	struct a52_ctx *rec = io->private_data;
+	struct a52_slot *slot = a52_fill_slot(rec);
 	unsigned int i;
 
-	for (i = 0; i < io->channels; i++)
-		memset(rec->frame->data[i] + rec->filled * rec->src_sample_bytes, 0,
+	for (i = 0; i < rec->enc_channels; i++)
+		memset(slot->frame->data[i] + rec->filled * rec->src_sample_bytes, 0,
 		       (rec->avctx->frame_size - rec->filled) * rec->src_sample_bytes);
 }
 #else
 #define clear_remaining_planar_data(io) /*NOP*/
 #endif
 
+/* pad the partially filled frame with silence and pass it on */
+static int submit_remaining_data(snd_pcm_ioplug_t *io, struct a52_ctx *rec)
+{
+	if (use_planar(rec))
+		clear_remaining_planar_data(io);
+	else {
+		memset(a52_fill_slot(rec)->inbuf + rec->filled * rec->enc_channels * rec->src_sample_bytes, 0,
+		       (rec->avctx->frame_size - rec->filled) * rec->enc_channels * rec->src_sample_bytes);
+	}
+	return submit_data(io, rec);
+}
+
+/* write out the pending bursts; when only the encoder thread holds up
+ * the rest, wait for it: the slave has room, so its descriptors would
+ * wake up the application at once and it would spin on -EAGAIN
+ */
+static int a52_drain_write_out(snd_pcm_ioplug_t *io, struct a52_ctx *rec)
+{
+	int err;
+
+	do {
+		err = write_out_pending(io, rec);
+		if (err < 0 || rec->remain)
+			return err;
+	} while (rec->threaded && a52_thread_wait(rec));
+	return 0;
+}
+
+/*
+ * Non-blocking drain
+ *
+ * The application calls drain again as long as -EAGAIN is returned,
+ * usually after polling.  The padded last frame is queued once, the
+ * bursts are written out as the slave takes them, and finally the
+ * slave is drained non-blocking, too.  The slave reports the end of
+ * draining through its poll descriptors, which are ours.
+ */
+static int a52_drain_nonblock(snd_pcm_ioplug_t *io, struct a52_ctx *rec)
+{
+	int err;
+
+	if ((err = a52_drain_write_out(io, rec)) < 0)
+		return err;
+	if (rec->filled) {
+		/* the last frame needs a free slot */
+		if (rec->threaded ? a52_slots_busy(rec) >= rec->num_slots :
+		    rec->remain != 0)
+			return -EAGAIN;
+		err = submit_remaining_data(io, rec);
+		if (err < 0)
+			return err;
+		if ((err = a52_drain_write_out(io, rec)) < 0)
+			return err;
+	}
+	/* bursts not taken by the slave yet */
+	if (a52_pending_frames(rec))
+		return -EAGAIN;
+
+	if (snd_pcm_state(rec->slave) == SND_PCM_STATE_SETUP)
+		return 0; /* drained */
+	return snd_pcm_drain(rec->slave);
+}
+
 static int a52_drain(snd_pcm_ioplug_t *io)
 {
 	struct a52_ctx *rec = io->private_data;
 	int err;
 
+	if (io->nonblock) {
+		if (!rec->slave_nonblock)
+			snd_pcm_nonblock(rec->slave, 1);
+		err = a52_drain_nonblock(io, rec);
+		if (!rec->slave_nonblock)
+			snd_pcm_nonblock(rec->slave, 0);
+		return err;
+	}
+
 	if (rec->filled) {
 		if ((err = write_out_pending(io, rec)) < 0)
 			return err;
 		/* remaining data must be converted and sent out */
-		if (use_planar(rec))
-			clear_remaining_planar_data(io);
-		else {
-			memset(rec->inbuf + rec->filled * io->channels * rec->src_sample_bytes, 0,
-			       (rec->avctx->frame_size - rec->filled) * io->channels * rec->src_sample_bytes);
-		}
-		err = convert_data(rec);
+		err = submit_remaining_data(io, rec);
 		if (err < 0)
 			return err;
 	}
+	a52_thread_sync(rec);
 	err = write_out_pending(io, rec);
 	if (err < 0)
 		return err;
@@ -276,9 +704,6 @@ static int check_interleaved(struct a52_ctx *rec,
 {
 	unsigned int ch;
 
-	if (channels > 4) /* we need re-routing for 6 channels */
-		return 0;
-
 	for (ch = 0; ch < channels; ch++) {
 		if (areas[ch].addr != areas[0].addr ||
 		    areas[ch].first != ch * rec->src_sample_bits ||
@@ -288,6 +713,234 @@ static int check_interleaved(struct a52_ctx *rec,
 	return 1;
 }
 
+/* The input channel for each encoder channel, by the number of input
+ * channels.  The input channels beyond the encoder ones follow; they
+ * are folded into the surround channels.
+ */
+static const unsigned int ch_index[9][8] = {
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(52, 26, 0)
+	/* current libavcodec expects SMPTE order */
+	[2] = { 0, 1 },
+	[3] = { 0, 1, 2 },
+	[4] = { 0, 1, 2, 3 },
+	[5] = { 0, 1, 4, 2, 3 },
+	[6] = { 0, 1, 4, 5, 2, 3 },
+	[7] = { 0, 1, 4, 5, 2, 3, 6 },
+	[8] = { 0, 1, 4, 5, 2, 3, 6, 7 },
+#else
+	/* libavcodec older than r18540 expects A52 order */
+	[2] = { 0, 1 },
+	[3] = { 0, 2, 1 },
+	[4] = { 0, 1, 2, 3 },
+	[5] = { 0, 4, 1, 2, 3 },
+	[6] = { 0, 4, 1, 2, 3, 5 },
+	[7] = { 0, 4, 1, 2, 3, 5, 6 },
+	[8] = { 0, 4, 1, 2, 3, 5, 6, 7 },
+#endif
+};
+
+/* the number of encoder channels for the input channels */
+static const unsigned int enc_channels[9] = {
+	[2] = 2, [3] = 3, [4] = 4, [5] = 5, [6] = 6, [7] = 6, [8] = 6,
+};
+
+/* The extra input channels and the input channels they are folded into
+ * at -3dB: the rear center of 6.1 into both surrounds, the sides of 7.1
+ * into the surround of the same side.
+ */
+#define A52_MAX_FOLDS	2
+static const struct a52_fold {
+	unsigned int src;
+	unsigned int dst;
+} ch_folds[9][A52_MAX_FOLDS] = {
+	[7] = { { 6, 2 }, { 6, 3 } },
+	[8] = { { 6, 2 }, { 7, 3 } },
+};
+
+/* frames of the extra channels folded at once */
+#define A52_FOLD_CHUNK	256
+
+/* the encoder channel receiving the given input channel */
+static unsigned int enc_channel_of(unsigned int channels, unsigned int src)
+{
+	unsigned int ch;
+
+	for (ch = 0; ch < enc_channels[channels]; ch++)
+		if (ch_index[channels][ch] == src)
+			break;
+	return ch;
+}
+
+/* whether the input is passed in the encoder order as is */
+static int ch_index_is_identity(unsigned int channels)
+{
+	unsigned int ch;
+
+	if (enc_channels[channels] != channels)
+		return 0;
+	for (ch = 0; ch < channels; ch++)
+		if (ch_index[channels][ch] != ch)
+			return 0;
+	return 1;
+}
+
+/* add the extra channel at -3dB to a plane of the encoder */
+static void fold_plane(struct a52_ctx *rec, void *dst, const void *src,
+		       unsigned int size)
+{
+	if (rec->src_format == SND_PCM_FORMAT_FLOAT)
+		rec->dsp.fold_flt(dst, src, size);
+	else if (rec->src_sample_bytes == 2)
+		rec->dsp.fold_16(dst, src, size);
+	else
+		rec->dsp.fold_32(dst, src, size);
+}
+
+#ifdef USE_AVCODEC_FRAME
+/* copy the samples of a channel area with any step to a plane */
+static void copy_plane(struct a52_ctx *rec, void *dst,
+		       const snd_pcm_channel_area_t *ap,
+		       unsigned int offset, unsigned int size)
+{
+	const char *src = ap->addr + (ap->first + offset * ap->step) / 8;
+	unsigned int src_step = ap->step / 8;
+	unsigned int i;
+
+	if (ap->step == rec->src_sample_bits) {
+		memcpy(dst, src, size * rec->src_sample_bytes);
+	} else if (rec->src_sample_bytes == 2) {
+		short *dst1 = dst;
+		for (i = 0; i < size; i++, src += src_step)
+			dst1[i] = *(const short *)src;
+	} else {
+		int *dst1 = dst;
+		for (i = 0; i < size; i++, src += src_step)
+			dst1[i] = *(const int *)src;
+	}
+}
+
+/* Copy the input PCM directly to the planes of the encoder frame.
+ * The extra channels are split into a small chunk buffer on the stack
+ * and folded from there while still in the cache.
+ */
+static void fill_planar(snd_pcm_ioplug_t *io, struct a52_slot *slot,
+			const snd_pcm_channel_area_t *areas,
+			unsigned int offset, unsigned int size,
+			int interleaved)
+{
+	struct a52_ctx *rec = io->private_data;
+	const unsigned int *map = ch_index[io->channels];
+	const struct a52_fold *folds = ch_folds[io->channels];
+	unsigned int nfolds = io->channels - rec->enc_channels;
+	unsigned int bytes = rec->src_sample_bytes;
+	void *dst[A52_DSP_MAX_CHANNELS];
+	int32_t extra[A52_MAX_FOLDS][A52_FOLD_CHUNK];
+	unsigned int i, n, ch, f;
+
+	for (ch = 0; ch < rec->enc_channels; ch++)
+		dst[ch] = slot->frame->data[ch] + rec->filled * bytes;
+	if (nfolds)
+		nfolds = A52_MAX_FOLDS;
+
+	if (interleaved) {
+		const char *src = areas->addr + offset * io->channels * bytes;
+
+		for (ch = rec->enc_channels; ch < io->channels; ch++)
+			dst[ch] = extra[ch - rec->enc_channels];
+		for (; size; size -= n) {
+			n = size;
+			if (nfolds && n > A52_FOLD_CHUNK)
+				n = A52_FOLD_CHUNK;
+			if (bytes == 2)
+				rec->dsp.deinterleave_16(dst, src, io->channels, map, n);
+			else
+				rec->dsp.deinterleave_32(dst, src, io->channels, map, n);
+			for (f = 0; f < nfolds; f++)
+				fold_plane(rec,
+					   dst[enc_channel_of(io->channels, folds[f].dst)],
+					   extra[folds[f].src - rec->enc_channels], n);
+			for (ch = 0; ch < rec->enc_channels; ch++)
+				dst[ch] = (char *)dst[ch] + n * bytes;
+			src += n * io->channels * bytes;
+		}
+		return;
+	}
+
+	for (ch = 0; ch < rec->enc_channels; ch++)
+		copy_plane(rec, dst[ch], &areas[map[ch]], offset, size);
+
+	for (f = 0; f < nfolds; f++) {
+		const snd_pcm_channel_area_t *ap = &areas[folds[f].src];
+		char *d = dst[enc_channel_of(io->channels, folds[f].dst)];
+
+		if (ap->step == rec->src_sample_bits) {
+			fold_plane(rec, d,
+				   ap->addr + (ap->first + offset * ap->step) / 8,
+				   size);
+			continue;
+		}
+		for (i = 0; i < size; i += n) {
+			n = size - i;
+			if (n > A52_FOLD_CHUNK)
+				n = A52_FOLD_CHUNK;
+			copy_plane(rec, extra[0], ap, offset + i, n);
+			fold_plane(rec, d + i * bytes, extra[0], n);
+		}
+	}
+}
+#else
+#define fill_planar(io, slot, areas, offset, size, interleaved) /* NOP */
+#endif
+
+/* fold the extra channels into the interleaved encoder input; only
+ * used with the old interleaved encoders, so done sample by sample
+ */
+static void fold_interleaved(snd_pcm_ioplug_t *io, void *_dst,
+			     const snd_pcm_channel_area_t *areas,
+			     unsigned int offset, unsigned int size)
+{
+	struct a52_ctx *rec = io->private_data;
+	const struct a52_fold *folds = ch_folds[io->channels];
+	unsigned int bytes = rec->src_sample_bytes;
+	unsigned int dst_step = rec->enc_channels * bytes;
+	unsigned int i, f;
+
+	if (io->channels == rec->enc_channels)
+		return;
+	for (f = 0; f < A52_MAX_FOLDS; f++) {
+		const snd_pcm_channel_area_t *ap = &areas[folds[f].src];
+		const char *src = ap->addr + (ap->first + offset * ap->step) / 8;
+		char *dst = (char *)_dst +
+			enc_channel_of(io->channels, folds[f].dst) * bytes;
+
+		for (i = 0; i < size; i++, src += ap->step / 8, dst += dst_step)
+			fold_plane(rec, dst, src, 1);
+	}
+}
+
+/* check whether the newly filled samples are all zero */
+static int is_silent(snd_pcm_ioplug_t *io, struct a52_slot *slot,
+		     unsigned int size)
+{
+	struct a52_ctx *rec = io->private_data;
+	unsigned int bytes = rec->src_sample_bytes;
+	unsigned int ch;
+
+#ifdef USE_AVCODEC_FRAME
+	if (use_planar(rec)) {
+		for (ch = 0; ch < rec->enc_channels; ch++) {
+			if (!rec->dsp.is_zero(slot->frame->data[ch] + rec->filled * bytes,
+					      size * bytes))
+				return 0;
+		}
+		return 1;
+	}
+#endif
+	ch = rec->enc_channels;
+	return rec->dsp.is_zero(slot->inbuf + rec->filled * ch * bytes,
+				size * ch * bytes);
+}
+
 /* Fill the input PCM to the internal buffer until a52 frames,
  * then covert and write it out.
  *
@@ -300,28 +953,28 @@ static int fill_data(snd_pcm_ioplug_t *io,
 {
 	struct a52_ctx *rec = io->private_data;
 	unsigned int len = rec->avctx->frame_size - rec->filled;
+	struct a52_slot *slot;
 	void *_dst;
 	int err;
-	static unsigned int ch_index[3][6] = {
-		{ 0, 1 },
-		{ 0, 1, 2, 3 },
-#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(52, 26, 0)
-		/* current libavcodec expects SMPTE order */
-		{ 0, 1, 4, 5, 2, 3 },
-#else
-		/* libavcodec older than r18540 expects A52 order */
-		{ 0, 4, 1, 2, 3, 5 },
-#endif
-	};
 
 	if ((err = write_out_pending(io, rec)) < 0)
 		return err;
 
-	/* If there are still frames left in outbuf, we can't
-	 * accept a full a52 frame, because this would overwrite
-	 * the frames in outbuf. This should not happen! The a52_pointer()
-	 * callback should limit the transferred frames correctly. */
-	if (rec->remain && len) {
+	if (rec->threaded) {
+		/* a new a52 frame needs a free slot; either the slave is
+		 * full or the encoder hasn't caught up yet */
+		while (!rec->filled && a52_slots_busy(rec) >= rec->num_slots) {
+			if (rec->remain || io->nonblock)
+				return -EAGAIN;
+			sem_wait(&rec->done_sem);
+			if ((err = write_out_pending(io, rec)) < 0)
+				return err;
+		}
+	} else if (rec->remain && len) {
+		/* If there are still frames left in outbuf, we can't
+		 * accept a full a52 frame, because this would overwrite
+		 * the frames in outbuf. This should not happen! The a52_pointer()
+		 * callback should limit the transferred frames correctly. */
 		SNDERR("fill data issue (remain is %i)", rec->remain);
 		len--;
 	}
@@ -329,8 +982,14 @@ static int fill_data(snd_pcm_ioplug_t *io,
 	if (size > len)
 		size = len;
 
-	_dst = rec->inbuf + rec->filled * io->channels * rec->src_sample_bytes;
-	if (!use_planar(rec) && interleaved) {
+	slot = a52_fill_slot(rec);
+	if (!rec->filled)
+		slot->silent = 1;
+	_dst = slot->inbuf + rec->filled * rec->enc_channels * rec->src_sample_bytes;
+	if (use_planar(rec)) {
+		fill_planar(io, slot, areas, offset, size, interleaved);
+	} else if (interleaved && ch_index_is_identity(io->channels)) {
+		/* no re-routing needed */
 		memcpy(_dst, areas->addr + offset * io->channels * rec->src_sample_bytes,
 		       size * io->channels * rec->src_sample_bytes);
 	} else if (rec->src_sample_bits == 16) {
@@ -338,19 +997,13 @@ static int fill_data(snd_pcm_ioplug_t *io,
 		short *src, *dst = _dst, *dst1;
 
 		/* flatten copy to n-channel interleaved */
-		dst_step = io->channels;
-		for (ch = 0; ch < io->channels; ch++, dst++) {
+		dst_step = rec->enc_channels;
+		for (ch = 0; ch < rec->enc_channels; ch++, dst++) {
 			const snd_pcm_channel_area_t *ap;
-			ap = &areas[ch_index[io->channels / 2 - 1][ch]];
+			ap = &areas[ch_index[io->channels][ch]];
 			src = (short *)(ap->addr +
 					(ap->first + offset * ap->step) / 8);
 
-#ifdef USE_AVCODEC_FRAME
-			if (use_planar(rec) && !interleaved) {
-				memcpy(rec->frame->data[ch] + rec->filled * 2, src, size * 2);
-				continue;
-			}
-#endif
 			dst1 = dst;
 			src_step = ap->step / 16; /* in word */
 			for (i = 0; i < size; i++) {
@@ -364,19 +1017,13 @@ static int fill_data(snd_pcm_ioplug_t *io,
 		int *src, *dst = _dst, *dst1;
 
 		/* flatten copy to n-channel interleaved */
-		dst_step = io->channels;
-		for (ch = 0; ch < io->channels; ch++, dst++) {
+		dst_step = rec->enc_channels;
+		for (ch = 0; ch < rec->enc_channels; ch++, dst++) {
 			const snd_pcm_channel_area_t *ap;
-			ap = &areas[ch_index[io->channels / 2 - 1][ch]];
+			ap = &areas[ch_index[io->channels][ch]];
 			src = (int *)(ap->addr +
 					(ap->first + offset * ap->step) / 8);
 
-#ifdef USE_AVCODEC_FRAME
-			if (use_planar(rec) && !interleaved) {
-				memcpy(rec->frame->data[ch] + rec->filled * 4, src, size * 4);
-				continue;
-			}
-#endif
 			dst1 = dst;
 			src_step = ap->step / 32; /* in word */
 			for (i = 0; i < size; i++) {
@@ -388,9 +1035,13 @@ static int fill_data(snd_pcm_ioplug_t *io,
 	} else {
 		return -EIO;
 	}
+	if (!use_planar(rec))
+		fold_interleaved(io, _dst, areas, offset, size);
+	if (slot->silent)
+		slot->silent = is_silent(io, slot, size);
 	rec->filled += size;
 	if (rec->filled == rec->avctx->frame_size) {
-		err = convert_data(rec);
+		err = submit_data(io, rec);
 		if (err < 0)
 			return err;
 		write_out_pending(io, rec);
@@ -460,7 +1111,7 @@ static snd_pcm_sframes_t a52_pointer(snd_pcm_ioplug_t *io)
 	while (delay < 0)
 		delay += rec->slave_buffer_size;
 
-	avail = rec->pointer - delay - rec->remain - rec->filled;
+	avail = rec->pointer - delay - a52_pending_frames(rec);
 #ifdef SND_PCM_IOPLUG_FLAG_BOUNDARY_WA
 	return avail % rec->boundary;
 #else
@@ -468,6 +1119,40 @@ static snd_pcm_sframes_t a52_pointer(snd_pcm_ioplug_t *io)
 #endif
 }
 
+/*
+ * delay callback
+ *
+ * The frames queued in the slave plus those held back by the plugin,
+ * i.e. the partially filled frame and the bursts not yet written out,
+ * and the lookahead of the encoder itself.
+ */
+static int a52_delay(snd_pcm_ioplug_t *io, snd_pcm_sframes_t *delayp)
+{
+	struct a52_ctx *rec = io->private_data;
+	snd_pcm_sframes_t delay;
+	int err;
+
+	switch (snd_pcm_state(rec->slave)) {
+	case SND_PCM_STATE_XRUN:
+		return -EPIPE;
+	case SND_PCM_STATE_SUSPENDED:
+		return -ESTRPIPE;
+	default:
+		break;
+	}
+
+	err = snd_pcm_delay(rec->slave, &delay);
+	if (err < 0)
+		return err;
+	if (delay < 0)
+		delay = 0;
+	delay += a52_pending_frames(rec);
+	if (rec->avctx && encoder_delay(rec->avctx) > 0)
+		delay += encoder_delay(rec->avctx);
+	*delayp = delay;
+	return 0;
+}
+
 /* set up the fixed parameters of slave PCM hw_parmas */
 static int a52_slave_hw_params_half(struct a52_ctx *rec)
 {
@@ -480,7 +1165,11 @@ static int a52_slave_hw_params_half(struct a52_ctx *rec)
 		SNDERR("Cannot get slave hw_params");
 		goto out;
 	}
-	if ((err = snd_pcm_hw_params_set_access(rec->slave, rec->hw_params,
+	rec->use_mmap = rec->slave_mmap &&
+		snd_pcm_hw_params_set_access(rec->slave, rec->hw_params,
+					     SND_PCM_ACCESS_MMAP_INTERLEAVED) >= 0;
+	if (!rec->use_mmap &&
+	    (err = snd_pcm_hw_params_set_access(rec->slave, rec->hw_params,
 						SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
 		SNDERR("Cannot set slave access RW_INTERLEAVED");
 		goto out;
@@ -506,6 +1195,24 @@ static int a52_slave_hw_params_half(struct a52_ctx *rec)
 	return err;
 }
 
+/* pick the encoder and its sample format for the given input format */
+static void select_codec(struct a52_ctx *rec, snd_pcm_format_t format)
+{
+	if (rec->codec_flt && format == SND_PCM_FORMAT_FLOAT) {
+		rec->codec = rec->codec_flt;
+		rec->av_format = AV_SAMPLE_FMT_FLTP;
+	} else {
+		rec->codec = rec->codec_int;
+		rec->av_format = rec->av_format_int;
+	}
+#ifdef USE_AVCODEC_FRAME
+	rec->is_planar = av_sample_fmt_is_planar(rec->av_format);
+#endif
+	rec->src_format = format;
+	rec->src_sample_bits = snd_pcm_format_physical_width(format);
+	rec->src_sample_bytes = rec->src_sample_bits / 8;
+}
+
 /*
  * hw_params callback
  *
@@ -519,6 +1226,8 @@ static int a52_hw_params(snd_pcm_ioplug_t *io,
 	snd_pcm_uframes_t buffer_size;
 	int err;
 
+	select_codec(rec, io->format);
+
 	if (! rec->hw_params) {
 		err = a52_slave_hw_params_half(rec);
 		if (err < 0)
@@ -540,10 +1249,66 @@ static int a52_hw_params(snd_pcm_ioplug_t *io,
 		SNDERR("Cannot set slave hw_params");
 		return err;
 	}
-	rec->slave_period_size = period_size;
-	rec->slave_buffer_size = buffer_size;
+	rec->slave_period_size = period_size;
+	rec->slave_buffer_size = buffer_size;
+
+	return 0;
+}
+
+/* release the buffers of an encoder slot */
+static void free_slot(struct a52_slot *slot)
+{
+#ifdef USE_AVCODEC_FRAME
+#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 91, 0)
+	if (slot->frame)
+		av_freep(&slot->frame->data[0]);
+#endif
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(54, 28, 0)
+	av_frame_free(&slot->frame);
+#else
+	av_freep(&slot->frame);
+#endif
+#else /* USE_AVCODEC_FRAME */
+	free(slot->inbuf);
+#endif /* USE_AVCODEC_FRAME */
+	slot->inbuf = NULL;
+
+	free(slot->outbuf1);
+	slot->outbuf1 = NULL;
+	slot->outbuf = NULL;
+}
+
+/* release resources */
+static void close_encoder(struct a52_ctx *rec)
+{
+	if (rec->avctx) {
+		#if HAVE_AVCODEC_FREE_CONTEXT
+			avcodec_free_context(&rec->avctx);
+		#else
+			avcodec_close(rec->avctx);
+		#endif
+		av_free(rec->avctx);
+		rec->avctx = NULL;
+	}
+}
 
-	return 0;
+static void a52_free(struct a52_ctx *rec)
+{
+	unsigned int i;
+
+	a52_thread_stop(rec);
+	close_encoder(rec);
+
+	for (i = 0; i < rec->num_slots; i++)
+		free_slot(&rec->slots[i]);
+	rec->num_slots = 0;
+
+#ifdef USE_AVCODEC_PACKET_ALLOC
+	av_packet_free(&rec->pkt);
+#endif
+	free(rec->silent_burst);
+	rec->silent_burst = NULL;
+	rec->outbuf = NULL;
 }
 
 /*
@@ -553,6 +1318,7 @@ static int a52_hw_free(snd_pcm_ioplug_t *io)
 {
 	struct a52_ctx *rec = io->private_data;
 
+	a52_free(rec);
 	free(rec->hw_params);
 	rec->hw_params = NULL;
 	return snd_pcm_hw_free(rec->slave);
@@ -573,6 +1339,11 @@ static void a52_dump(snd_pcm_ioplug_t *io, snd_output_t *out)
 	snd_output_printf(out, "  %-13s: %i\n", "av_frame_size", rec->avctx ? rec->avctx->frame_size : -1);
 	snd_output_printf(out, "  %-13s: %i\n", "remain", rec->remain);
 	snd_output_printf(out, "  %-13s: %i\n", "filled", rec->filled);
+	if (rec->threaded)
+		snd_output_printf(out, "  %-13s: %u\n", "queued",
+				  atomic_load(&rec->enc_head) - rec->out_idx);
+	if (rec->stats)
+		a52_stats_dump(rec->stats, out);
 	snd_output_printf(out, "Slave: ");
 	snd_pcm_dump(rec->slave, out);
 }
@@ -604,6 +1375,7 @@ static int a52_sw_params(snd_pcm_ioplug_t *io, snd_pcm_sw_params_t *params)
 	snd_pcm_sw_params_set_avail_min(rec->slave, sparams, avail_min);
 	snd_pcm_sw_params_set_start_threshold(rec->slave, sparams,
 					      start_threshold);
+	rec->start_threshold = start_threshold;
 
 	return snd_pcm_sw_params(rec->slave, sparams);
 }
@@ -631,43 +1403,6 @@ static int a52_stop(snd_pcm_ioplug_t *io)
 	return snd_pcm_drop(rec->slave);
 }
 
-/* release resources */
-static void a52_free(struct a52_ctx *rec)
-{
-	if (rec->avctx) {
-		#if HAVE_AVCODEC_FREE_CONTEXT
-			avcodec_free_context(&rec->avctx);
-		#else
-			avcodec_close(rec->avctx);
-		#endif
-		av_free(rec->avctx);
-		rec->avctx = NULL;
-	}
-
-#ifdef USE_AVCODEC_FRAME
-#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 91, 0)
-	if (rec->frame)
-		av_freep(&rec->frame->data[0]);
-#endif
-#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(54, 28, 0)
-	av_frame_free(&rec->frame);
-#else
-	av_freep(&rec->frame);
-#endif
-#else /* USE_AVCODEC_FRAME */
-	free(rec->inbuf);
-	rec->inbuf = NULL;
-#endif /* USE_AVCODEC_FRAME */
-
-#ifdef USE_AVCODEC_PACKET_ALLOC
-	av_packet_free(&rec->pkt);
-#endif
-	free(rec->outbuf2);
-	rec->outbuf2 = NULL;
-	free(rec->outbuf1);
-	rec->outbuf1 = NULL;
-}
-
 /*
  * prepare callback
  *
@@ -675,33 +1410,44 @@ static void a52_free(struct a52_ctx *rec)
  */
 
 #if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(52, 3, 0)
-static void set_channel_layout(snd_pcm_ioplug_t *io)
+static void set_channel_layout(AVCodecContext *avctx, unsigned int channels)
 {
-	struct a52_ctx *rec = io->private_data;
 #if HAVE_CH_LAYOUT
-	switch (io->channels) {
+	switch (channels) {
 	case 2:
-		rec->avctx->ch_layout = (AVChannelLayout)AV_CHANNEL_LAYOUT_STEREO;
+		avctx->ch_layout = (AVChannelLayout)AV_CHANNEL_LAYOUT_STEREO;
+		break;
+	case 3:
+		avctx->ch_layout = (AVChannelLayout)AV_CHANNEL_LAYOUT_SURROUND;
 		break;
 	case 4:
-		rec->avctx->ch_layout = (AVChannelLayout)AV_CHANNEL_LAYOUT_QUAD;
+		avctx->ch_layout = (AVChannelLayout)AV_CHANNEL_LAYOUT_QUAD;
+		break;
+	case 5:
+		avctx->ch_layout = (AVChannelLayout)AV_CHANNEL_LAYOUT_5POINT0;
 		break;
 	case 6:
-		rec->avctx->ch_layout = (AVChannelLayout)AV_CHANNEL_LAYOUT_5POINT1;
+		avctx->ch_layout = (AVChannelLayout)AV_CHANNEL_LAYOUT_5POINT1;
 		break;
 	default:
 		break;
 	}
 #else
-	switch (io->channels) {
+	switch (channels) {
 	case 2:
-		rec->avctx->channel_layout = AV_CH_LAYOUT_STEREO;
+		avctx->channel_layout = AV_CH_LAYOUT_STEREO;
+		break;
+	case 3:
+		avctx->channel_layout = AV_CH_LAYOUT_SURROUND;
 		break;
 	case 4:
-		rec->avctx->channel_layout = AV_CH_LAYOUT_QUAD;
+		avctx->channel_layout = AV_CH_LAYOUT_QUAD;
+		break;
+	case 5:
+		avctx->channel_layout = AV_CH_LAYOUT_5POINT0;
 		break;
 	case 6:
-		rec->avctx->channel_layout = AV_CH_LAYOUT_5POINT1;
+		avctx->channel_layout = AV_CH_LAYOUT_5POINT1;
 		break;
 	default:
 		break;
@@ -709,48 +1455,79 @@ static void set_channel_layout(snd_pcm_ioplug_t *io)
 #endif
 }
 #else
-#define set_channel_layout(io) /* NOP */
+#define set_channel_layout(avctx, channels) /* NOP */
 #endif
 
-static int alloc_input_buffer(snd_pcm_ioplug_t *io)
+static int alloc_input_buffer(snd_pcm_ioplug_t *io, struct a52_slot *slot)
 {
 	struct a52_ctx *rec = io->private_data;
 #ifdef USE_AVCODEC_FRAME
-	rec->frame = av_frame_alloc();
-	if (!rec->frame)
+	slot->frame = av_frame_alloc();
+	if (!slot->frame)
 		return -ENOMEM;
-	rec->frame->nb_samples = rec->avctx->frame_size;
+	slot->frame->nb_samples = rec->avctx->frame_size;
 #if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 91, 0)
-	rec->frame->format = rec->avctx->sample_fmt;
+	slot->frame->format = rec->avctx->sample_fmt;
 #if HAVE_CH_LAYOUT
-	av_channel_layout_from_mask(&rec->frame->ch_layout, rec->avctx->ch_layout.u.mask);
+	av_channel_layout_from_mask(&slot->frame->ch_layout, rec->avctx->ch_layout.u.mask);
 #else
-	rec->frame->channels = rec->avctx->channels;
-	rec->frame->channel_layout = rec->avctx->channel_layout;
+	slot->frame->channels = rec->avctx->channels;
+	slot->frame->channel_layout = rec->avctx->channel_layout;
 #endif
-	if (av_frame_get_buffer(rec->frame, 0))
+	if (av_frame_get_buffer(slot->frame, 0))
 		return -ENOMEM;
 #else
-	if (av_samples_alloc(rec->frame->data, rec->frame->linesize,
-			     io->channels, rec->avctx->frame_size,
+	if (av_samples_alloc(slot->frame->data, slot->frame->linesize,
+			     rec->enc_channels, rec->avctx->frame_size,
 			     rec->avctx->sample_fmt, 0) < 0)
 		return -ENOMEM;
 #endif
-	rec->inbuf = rec->frame->data[0];
+	slot->inbuf = slot->frame->data[0];
 #else
-	rec->inbuf = malloc(rec->avctx->frame_size * io->channels * rec->src_sample_bytes);
+	slot->inbuf = malloc(rec->avctx->frame_size * rec->enc_channels * rec->src_sample_bytes);
 #endif
-	if (!rec->inbuf)
+	if (!slot->inbuf)
 		return -ENOMEM;
 	return 0;
 }
 
-static int a52_prepare(snd_pcm_ioplug_t *io)
+static int alloc_slot(snd_pcm_ioplug_t *io, struct a52_slot *slot)
 {
 	struct a52_ctx *rec = io->private_data;
-	int err;
 
-	a52_free(rec);
+	slot->outbuf1 = calloc(1, rec->outbuf_size + AV_INPUT_BUFFER_PADDING_SIZE);
+	if (! slot->outbuf1)
+		return -ENOMEM;
+	slot->burst_bytes = 0;
+
+	return alloc_input_buffer(io, slot);
+}
+
+/* check whether the opened encoder can be reused for the current setup */
+static int encoder_reusable(snd_pcm_ioplug_t *io)
+{
+	struct a52_ctx *rec = io->private_data;
+
+	if (!rec->avctx || !rec->num_slots)
+		return 0;
+#if HAVE_CH_LAYOUT
+	if (rec->avctx->ch_layout.nb_channels != (int)rec->enc_channels)
+		return 0;
+#else
+	if (rec->avctx->channels != (int)rec->enc_channels)
+		return 0;
+#endif
+	return rec->avctx->codec == rec->codec &&
+		rec->avctx->sample_rate == (int)io->rate &&
+		rec->avctx->sample_fmt == rec->av_format &&
+		rec->avctx->bit_rate == rec->bitrate * 1000;
+}
+
+/* allocate and open the encoder context for the current setup */
+static int open_encoder(snd_pcm_ioplug_t *io)
+{
+	struct a52_ctx *rec = io->private_data;
+	int err;
 
 #ifdef USE_AVCODEC_FRAME
 	rec->avctx = avcodec_alloc_context3(rec->codec);
@@ -763,13 +1540,13 @@ static int a52_prepare(snd_pcm_ioplug_t *io)
 	rec->avctx->bit_rate = rec->bitrate * 1000;
 	rec->avctx->sample_rate = io->rate;
 #if HAVE_CH_LAYOUT
-	rec->avctx->ch_layout.nb_channels = io->channels;
+	rec->avctx->ch_layout.nb_channels = rec->enc_channels;
 #else
-	rec->avctx->channels = io->channels;
+	rec->avctx->channels = rec->enc_channels;
 #endif
 	rec->avctx->sample_fmt = rec->av_format;
 
-	set_channel_layout(io);
+	set_channel_layout(rec->avctx, rec->enc_channels);
 
 
 #ifdef USE_AVCODEC_FRAME
@@ -779,6 +1556,106 @@ static int a52_prepare(snd_pcm_ioplug_t *io)
 #endif
 	if (err < 0)
 		return -EINVAL;
+	return 0;
+}
+
+/* pass a frame of zeros through the encoder; the burst is left in
+ * slot->outbuf and not counted in the stats
+ */
+static int encode_silence(struct a52_ctx *rec, struct a52_slot *slot)
+{
+	struct a52_stats *stats;
+	int err;
+
+#ifdef USE_AVCODEC_FRAME
+	if (use_planar(rec)) {
+		unsigned int ch;
+		for (ch = 0; ch < rec->enc_channels; ch++)
+			memset(slot->frame->data[ch], 0,
+			       rec->avctx->frame_size * rec->src_sample_bytes);
+	} else
+#endif
+		memset(slot->inbuf, 0,
+		       rec->avctx->frame_size * rec->enc_channels * rec->src_sample_bytes);
+
+	slot->silent = 1;
+	rec->enc_silent = 0;
+	stats = rec->stats;
+	rec->stats = NULL; /* not sent out */
+	err = convert_data(rec, slot);
+	rec->stats = stats;
+	return err;
+}
+
+/* reset the stream state but keep the encoder and the buffers */
+static int a52_reprepare(struct a52_ctx *rec)
+{
+	unsigned int idx;
+	int err;
+
+	/* the queued bursts are dropped, so the thread needn't encode them */
+	idx = atomic_load(&rec->enc_head);
+	atomic_store(&rec->enc_drop, idx);
+	a52_thread_sync(rec);
+	atomic_store(&rec->enc_tail, idx);
+	rec->out_idx = idx;
+
+	/* neither ac3 nor ac3_fixed can be flushed, but all they carry
+	 * over is the MDCT overlap of the last frame; a silent frame
+	 * clears it
+	 */
+#ifdef AV_CODEC_CAP_ENCODER_FLUSH
+	if (rec->codec->capabilities & AV_CODEC_CAP_ENCODER_FLUSH) {
+		avcodec_flush_buffers(rec->avctx);
+		rec->enc_silent = 0;
+	} else
+#endif
+	{
+		err = encode_silence(rec, a52_fill_slot(rec));
+		if (err < 0)
+			return err;
+	}
+
+	rec->pointer = 0;
+	rec->remain = 0;
+	rec->filled = 0;
+
+	return snd_pcm_prepare(rec->slave);
+}
+
+/* encode a frame of zeros once for the silence shortcut */
+static int encode_silent_burst(snd_pcm_ioplug_t *io)
+{
+	struct a52_ctx *rec = io->private_data;
+	struct a52_slot *slot = &rec->slots[0];
+	int err;
+
+	rec->silent_burst = malloc(rec->outbuf_size);
+	if (!rec->silent_burst)
+		return -ENOMEM;
+
+	err = encode_silence(rec, slot);
+	if (err < 0)
+		return err;
+	memcpy(rec->silent_burst, slot->outbuf, rec->outbuf_size);
+	return 0;
+}
+
+static int a52_prepare(snd_pcm_ioplug_t *io)
+{
+	struct a52_ctx *rec = io->private_data;
+	unsigned int i;
+	int err;
+
+	/* fast path for the XRUN recovery */
+	if (encoder_reusable(io))
+		return a52_reprepare(rec);
+
+	a52_free(rec);
+
+	err = open_encoder(io);
+	if (err < 0)
+		return err;
 
 #ifdef USE_AVCODEC_PACKET_ALLOC
 	rec->pkt = av_packet_alloc();
@@ -787,24 +1664,26 @@ static int a52_prepare(snd_pcm_ioplug_t *io)
 #endif
 
 	rec->outbuf_size = rec->avctx->frame_size * 4;
-	rec->outbuf1 = malloc(rec->outbuf_size + AV_INPUT_BUFFER_PADDING_SIZE);
-	if (! rec->outbuf1)
-		return -ENOMEM;
-	memset(rec->outbuf1 + rec->outbuf_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
-
-	if (rec->format == SND_PCM_FORMAT_S16_LE) {
-		rec->outbuf2 = malloc(rec->outbuf_size);
-		if ( !rec->outbuf2)
+	rec->num_slots = rec->threaded ? A52_THREAD_SLOTS : 1;
+	for (i = 0; i < rec->num_slots; i++) {
+		if (alloc_slot(io, &rec->slots[i]))
 			return -ENOMEM;
 	}
 
-	if (alloc_input_buffer(io))
-		return -ENOMEM;
+	err = encode_silent_burst(io);
+	if (err < 0)
+		return err;
 
 	rec->pointer = 0;
 	rec->remain = 0;
 	rec->filled = 0;
 
+	if (rec->threaded) {
+		err = a52_thread_start(rec);
+		if (err < 0)
+			return err;
+	}
+
 	return snd_pcm_prepare(rec->slave);
 }
 
@@ -840,6 +1719,7 @@ static int a52_close(snd_pcm_ioplug_t *io)
 	snd_pcm_t *slave = rec->slave;
 
 	a52_free(rec);
+	a52_stats_free(rec->stats);
 	free(rec);
 	if (slave)
 		return snd_pcm_close(slave);
@@ -847,14 +1727,26 @@ static int a52_close(snd_pcm_ioplug_t *io)
 }
 			      
 #if SND_PCM_IOPLUG_VERSION >= 0x10002
-static unsigned int chmap4[4] = {
-	SND_CHMAP_FL, SND_CHMAP_FR,
-	SND_CHMAP_RL, SND_CHMAP_RR,
-};
-static unsigned int chmap6[6] = {
-	SND_CHMAP_FL, SND_CHMAP_FR,
-	SND_CHMAP_RL, SND_CHMAP_RR,
-	SND_CHMAP_FC, SND_CHMAP_LFE,
+/* the channel positions of the input, by the number of channels */
+static const unsigned int chmaps[9][8] = {
+	[2] = { SND_CHMAP_FL, SND_CHMAP_FR },
+	[3] = { SND_CHMAP_FL, SND_CHMAP_FR, SND_CHMAP_FC },
+	[4] = { SND_CHMAP_FL, SND_CHMAP_FR,
+		SND_CHMAP_RL, SND_CHMAP_RR },
+	[5] = { SND_CHMAP_FL, SND_CHMAP_FR,
+		SND_CHMAP_RL, SND_CHMAP_RR,
+		SND_CHMAP_FC },
+	[6] = { SND_CHMAP_FL, SND_CHMAP_FR,
+		SND_CHMAP_RL, SND_CHMAP_RR,
+		SND_CHMAP_FC, SND_CHMAP_LFE },
+	[7] = { SND_CHMAP_FL, SND_CHMAP_FR,
+		SND_CHMAP_RL, SND_CHMAP_RR,
+		SND_CHMAP_FC, SND_CHMAP_LFE,
+		SND_CHMAP_RC },
+	[8] = { SND_CHMAP_FL, SND_CHMAP_FR,
+		SND_CHMAP_RL, SND_CHMAP_RR,
+		SND_CHMAP_FC, SND_CHMAP_LFE,
+		SND_CHMAP_SL, SND_CHMAP_SR },
 };
 
 static snd_pcm_chmap_query_t **a52_query_chmaps(snd_pcm_ioplug_t *io ATTRIBUTE_UNUSED)
@@ -862,20 +1754,19 @@ static snd_pcm_chmap_query_t **a52_query_chmaps(snd_pcm_ioplug_t *io ATTRIBUTE_U
 	snd_pcm_chmap_query_t **maps;
 	int i;
 
-	maps = calloc(4, sizeof(void *));
+	maps = calloc(8, sizeof(void *));
 	if (!maps)
 		return NULL;
-	for (i = 0; i < 3; i++) {
+	for (i = 0; i < 7; i++) {
 		snd_pcm_chmap_query_t *p;
-		p = maps[i] = calloc((i + 1) * 2 + 2, sizeof(int));
+		p = maps[i] = calloc(i + 2 + 2, sizeof(int));
 		if (!p) {
 			snd_pcm_free_chmaps(maps);
 			return NULL;
 		}
 		p->type = SND_CHMAP_TYPE_FIXED;
-		p->map.channels = (i + 1) * 2;
-		memcpy(p->map.pos, i < 2 ? chmap4 : chmap6,
-		       (i + 1) * 2 * sizeof(int));
+		p->map.channels = i + 2;
+		memcpy(p->map.pos, chmaps[i + 2], (i + 2) * sizeof(int));
 	}
 	return maps;
 }
@@ -884,14 +1775,13 @@ static snd_pcm_chmap_t *a52_get_chmap(snd_pcm_ioplug_t *io)
 {
 	snd_pcm_chmap_t *map;
 
-	if ((io->channels % 2) || io->channels < 2 || io->channels > 6)
+	if (io->channels < 2 || io->channels > 8)
 		return NULL;
 	map = malloc((io->channels + 1) * sizeof(int));
 	if (!map)
 		return NULL;
 	map->channels = io->channels;
-	memcpy(map->pos, io->channels < 6 ? chmap4 : chmap6,
-	       io->channels * sizeof(int));
+	memcpy(map->pos, chmaps[io->channels], io->channels * sizeof(int));
 	return map;
 }
 #endif /* SND_PCM_IOPLUG_VERSION >= 0x10002 */
@@ -903,6 +1793,7 @@ static snd_pcm_ioplug_callback_t a52_ops = {
 	.start = a52_start,
 	.stop = a52_stop,
 	.pointer = a52_pointer,
+	.delay = a52_delay,
 	.transfer = a52_transfer,
 	.close = a52_close,
 	.hw_params = a52_hw_params,
@@ -940,10 +1831,6 @@ static int a52_set_hw_constraint(struct a52_ctx *rec)
 		SND_PCM_ACCESS_RW_INTERLEAVED,
 		SND_PCM_ACCESS_RW_NONINTERLEAVED
 	};
-	static unsigned int accesses_planar[] = {
-		SND_PCM_ACCESS_MMAP_NONINTERLEAVED,
-		SND_PCM_ACCESS_RW_NONINTERLEAVED
-	};
 	static struct format {
 		int av;
 		snd_pcm_format_t alib;
@@ -957,39 +1844,38 @@ static int a52_set_hw_constraint(struct a52_ctx *rec)
 #endif
 	};
 	int err, dir;
-	unsigned int i, fmt;
+	unsigned int i, fmts[2], nfmts;
 	snd_pcm_uframes_t buffer_max;
-	unsigned int period_bytes, max_periods;
-
-	if (use_planar(rec))
-		err = snd_pcm_ioplug_set_param_list(&rec->io,
-						    SND_PCM_IOPLUG_HW_ACCESS,
-						    ARRAY_SIZE(accesses_planar),
-						    accesses_planar);
-	else
-		err = snd_pcm_ioplug_set_param_list(&rec->io,
-						    SND_PCM_IOPLUG_HW_ACCESS,
-						    ARRAY_SIZE(accesses),
-						    accesses);
+	unsigned int period_bytes[2], nperiod_bytes, bytes;
+	unsigned int min_periods, max_periods;
+
+	/* interleaved input is split into the planes at filling */
+	err = snd_pcm_ioplug_set_param_list(&rec->io,
+					    SND_PCM_IOPLUG_HW_ACCESS,
+					    ARRAY_SIZE(accesses),
+					    accesses);
 	if (err < 0)
 		return err;
 
 	rec->src_format = SND_PCM_FORMAT_UNKNOWN;
 	for (i = 0; i < ARRAY_SIZE(formats); i++)
-		if (formats[i].av == rec->av_format) {
+		if (formats[i].av == rec->av_format_int) {
 			rec->src_format = formats[i].alib;
 			break;
 		}
 	if (rec->src_format == SND_PCM_FORMAT_UNKNOWN) {
-		SNDERR("A/V format '%s' is not supported", av_get_sample_fmt_name(rec->av_format));
+		SNDERR("A/V format '%s' is not supported", av_get_sample_fmt_name(rec->av_format_int));
 		return -EINVAL;
 	}
-	fmt = rec->src_format;
-	rec->src_sample_bits = snd_pcm_format_physical_width(rec->src_format);
-	rec->src_sample_bytes = rec->src_sample_bits / 8;
+	select_codec(rec, rec->src_format);
+	nfmts = 0;
+	fmts[nfmts++] = rec->src_format;
+	/* float input goes to the float encoder without conversion */
+	if (rec->codec_flt && rec->src_format != SND_PCM_FORMAT_FLOAT)
+		fmts[nfmts++] = SND_PCM_FORMAT_FLOAT;
 
 	if ((err = snd_pcm_ioplug_set_param_list(&rec->io, SND_PCM_IOPLUG_HW_FORMAT,
-						 1, &fmt)) < 0 ||
+						 nfmts, fmts)) < 0 ||
 	    (err = snd_pcm_ioplug_set_param_minmax(&rec->io, SND_PCM_IOPLUG_HW_CHANNELS,
 						   rec->channels, rec->channels)) < 0 ||
 	    (err = snd_pcm_ioplug_set_param_minmax(&rec->io, SND_PCM_IOPLUG_HW_RATE,
@@ -1002,19 +1888,276 @@ static int a52_set_hw_constraint(struct a52_ctx *rec)
 	snd_pcm_hw_params_get_buffer_size_max(rec->hw_params, &buffer_max);
 	dir = -1;
 	snd_pcm_hw_params_get_periods_max(rec->hw_params, &max_periods, &dir);
-	period_bytes = A52_FRAME_SIZE * 2 * rec->channels;
+	/* one a52 frame per period in the width of each format; ioplug
+	 * can't tie the period bytes to the format, so with S16 input the
+	 * period of the FLOAT width is accepted as well (two a52 frames)
+	 */
+	nperiod_bytes = 0;
+	for (i = 0; i < nfmts; i++) {
+		bytes = A52_FRAME_SIZE * rec->channels *
+			snd_pcm_format_physical_width(fmts[i]) / 8;
+		if (nperiod_bytes && period_bytes[0] == bytes)
+			continue;
+		if (nperiod_bytes && period_bytes[0] > bytes) {
+			period_bytes[1] = period_bytes[0];
+			period_bytes[0] = bytes;
+		} else
+			period_bytes[nperiod_bytes] = bytes;
+		nperiod_bytes++;
+	}
 	if (buffer_max / A52_FRAME_SIZE < max_periods)
 		max_periods = buffer_max / A52_FRAME_SIZE;
 
-	if ((err = snd_pcm_ioplug_set_param_minmax(&rec->io, SND_PCM_IOPLUG_HW_PERIOD_BYTES,
-						   period_bytes, period_bytes)) < 0 ||
+	/* one burst is played while the next one is filled; the encoder
+	 * thread needs another one in flight
+	 */
+	min_periods = rec->threaded ? 3 : 2;
+	if (rec->low_latency && max_periods > min_periods)
+		max_periods = min_periods;
+	if (max_periods < min_periods)
+		min_periods = max_periods;
+
+	if ((err = snd_pcm_ioplug_set_param_list(&rec->io, SND_PCM_IOPLUG_HW_PERIOD_BYTES,
+						 nperiod_bytes, period_bytes)) < 0 ||
 	    (err = snd_pcm_ioplug_set_param_minmax(&rec->io, SND_PCM_IOPLUG_HW_PERIODS,
-						   2, max_periods)) < 0)
+						   min_periods, max_periods)) < 0)
 		return err;
 
 	return 0;
 }
 
+/*
+ * "avcodec auto": benchmark the available AC3 encoders once and cache
+ * the fastest one for the setup per user
+ */
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 91, 0)
+#define A52_BENCH_FRAMES	16
+#define A52_CACHE_FILE		"alsa-a52-encoder"
+
+static const char *const auto_codecs[] = { "ac3_fixed", "ac3" };
+
+/* fill the frame with full scale noise, the worst case for the encoder */
+static void fill_bench_frame(AVFrame *frame, unsigned int channels)
+{
+	enum AVSampleFormat fmt = frame->format;
+	int planar = av_sample_fmt_is_planar(fmt);
+	unsigned int planes = planar ? channels : 1;
+	unsigned int n = frame->nb_samples * (planar ? 1 : channels);
+	unsigned int seed = 1, p, i;
+
+	for (p = 0; p < planes; p++) {
+		for (i = 0; i < n; i++) {
+			int v;
+
+			seed = seed * 1103515245 + 12345;
+			v = (int)seed;
+			switch (av_get_packed_sample_fmt(fmt)) {
+			case AV_SAMPLE_FMT_S16:
+				((int16_t *)frame->data[p])[i] = v >> 16;
+				break;
+			case AV_SAMPLE_FMT_S32:
+				((int32_t *)frame->data[p])[i] = v;
+				break;
+			case AV_SAMPLE_FMT_FLT:
+				((float *)frame->data[p])[i] = v / 2147483648.0f;
+				break;
+			default:
+				break;
+			}
+		}
+	}
+}
+
+/* the time to encode a few frames in nsecs, or 0 if not usable */
+static uint64_t bench_codec(const AVCodec *codec, unsigned int rate,
+			    unsigned int channels, unsigned int bitrate)
+{
+	AVCodecContext *avctx;
+	AVFrame *frame = NULL;
+	AVPacket *pkt = NULL;
+	uint64_t start, elapsed = 0;
+	int i;
+
+	avctx = avcodec_alloc_context3(codec);
+	if (!avctx)
+		return 0;
+	avctx->bit_rate = bitrate * 1000;
+	avctx->sample_rate = rate;
+	avctx->sample_fmt = codec->sample_fmts[0];
+#if HAVE_CH_LAYOUT
+	avctx->ch_layout.nb_channels = channels;
+#else
+	avctx->channels = channels;
+#endif
+	set_channel_layout(avctx, channels);
+	/* fails also if the bitrate isn't supported */
+	if (avcodec_open2(avctx, codec, NULL) < 0)
+		goto out;
+
+	frame = av_frame_alloc();
+	pkt = av_packet_alloc();
+	if (!frame || !pkt)
+		goto out;
+	frame->nb_samples = avctx->frame_size;
+	frame->format = avctx->sample_fmt;
+#if HAVE_CH_LAYOUT
+	av_channel_layout_copy(&frame->ch_layout, &avctx->ch_layout);
+#else
+	frame->channels = avctx->channels;
+	frame->channel_layout = avctx->channel_layout;
+#endif
+	if (av_frame_get_buffer(frame, 0) < 0)
+		goto out;
+	fill_bench_frame(frame, channels);
+
+	start = a52_stats_now();
+	for (i = 0; i < A52_BENCH_FRAMES; i++) {
+		if (avcodec_send_frame(avctx, frame) < 0)
+			goto out;
+		while (avcodec_receive_packet(avctx, pkt) == 0)
+			av_packet_unref(pkt);
+	}
+	elapsed = a52_stats_now() - start;
+	if (!elapsed)
+		elapsed = 1;
+
+ out:
+	av_packet_free(&pkt);
+	av_frame_free(&frame);
+	avcodec_free_context(&avctx);
+	return elapsed;
+}
+
+/* the cache file; only the default XDG cache directory is created if
+ * missing, an explicit $XDG_CACHE_HOME has to exist
+ */
+static int get_cache_path(char *path, size_t size)
+{
+	const char *dir = getenv("XDG_CACHE_HOME");
+	int len;
+
+	if (dir && *dir) {
+		len = snprintf(path, size, "%s/" A52_CACHE_FILE, dir);
+	} else {
+		dir = getenv("HOME");
+		if (!dir || !*dir)
+			return -ENOENT;
+		/* the default XDG cache directory may not exist yet */
+		len = snprintf(path, size, "%s/.cache", dir);
+		if (len < 0 || (size_t)len >= size)
+			return -ENAMETOOLONG;
+		mkdir(path, 0700);
+		len = snprintf(path, size, "%s/.cache/" A52_CACHE_FILE, dir);
+	}
+	if (len < 0 || (size_t)len >= size)
+		return -ENAMETOOLONG;
+	return 0;
+}
+
+/* the cached choice for the setup, looked up in the cache file;
+ * each line is "<libavcodec version> <rate> <channels> <bitrate> <codec>"
+ */
+static const AVCodec *lookup_cached_codec(const char *path, unsigned int rate,
+					  unsigned int channels,
+					  unsigned int bitrate)
+{
+	const AVCodec *codec = NULL;
+	unsigned int ver, r, c, b;
+	char name[32];
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return NULL;
+	while (fscanf(fp, "%x %u %u %u %31s", &ver, &r, &c, &b, name) == 5) {
+		if (ver == LIBAVCODEC_VERSION_INT && r == rate &&
+		    c == channels && b == bitrate)
+			codec = avcodec_find_encoder_by_name(name);
+	}
+	fclose(fp);
+	return codec;
+}
+
+/* store the choice for the setup; the file is rewritten with only the
+ * entries of this libavcodec version and replaced by a rename, so no
+ * reader ever sees it half written and stale versions don't pile up
+ */
+static void save_cached_codec(const char *path, unsigned int rate,
+			      unsigned int channels, unsigned int bitrate,
+			      const char *codec)
+{
+	char tmp[PATH_MAX], name[32];
+	unsigned int ver, r, c, b;
+	FILE *in, *out;
+	int fd, len;
+
+	len = snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	if (len < 0 || (size_t)len >= sizeof(tmp))
+		return;
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return;
+	out = fdopen(fd, "w");
+	if (!out) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	in = fopen(path, "r");
+	if (in) {
+		while (fscanf(in, "%x %u %u %u %31s", &ver, &r, &c, &b, name) == 5) {
+			if (ver != LIBAVCODEC_VERSION_INT ||
+			    (r == rate && c == channels && b == bitrate))
+				continue;
+			fprintf(out, "%x %u %u %u %s\n", ver, r, c, b, name);
+		}
+		fclose(in);
+	}
+	fprintf(out, "%x %u %u %u %s\n", LIBAVCODEC_VERSION_INT,
+		rate, channels, bitrate, codec);
+	if (fclose(out) || rename(tmp, path))
+		unlink(tmp);
+}
+
+static const AVCodec *select_auto_codec(unsigned int rate,
+					unsigned int channels,
+					unsigned int bitrate)
+{
+	const AVCodec *codec, *best = NULL;
+	uint64_t t, best_time = 0;
+	char path[PATH_MAX];
+	unsigned int i;
+	int cache;
+
+	cache = get_cache_path(path, sizeof(path)) == 0;
+	if (cache) {
+		best = lookup_cached_codec(path, rate, channels, bitrate);
+		if (best)
+			return best;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(auto_codecs); i++) {
+		codec = avcodec_find_encoder_by_name(auto_codecs[i]);
+		if (!codec)
+			continue;
+		t = bench_codec(codec, rate, channels, bitrate);
+		if (t && (!best || t < best_time)) {
+			best = codec;
+			best_time = t;
+		}
+	}
+	if (!best)
+		return NULL;
+
+	if (cache)
+		save_cached_codec(path, rate, channels, bitrate, best->name);
+	return best;
+}
+#else
+/* no benchmark with the old encoding API, the default choice is taken */
+#define select_auto_codec(rate, channels, bitrate)	NULL
+#endif
+
 /*
  * Main entry point
  */
@@ -1029,6 +2172,11 @@ SND_PCM_PLUGIN_DEFINE_FUNC(a52)
 	unsigned int bitrate = 448;
 	unsigned int channels = 6;
 	snd_pcm_format_t format = SND_PCM_FORMAT_S16_LE;
+	int threaded = 0;
+	int slave_mmap = 0;
+	int low_latency = 0;
+	int stats = 0;
+	const char *stats_file = NULL;
 	char devstr[128], tmpcard[16];
 	struct a52_ctx *rec;
 	
@@ -1097,8 +2245,8 @@ SND_PCM_PLUGIN_DEFINE_FUNC(a52)
 				return -EINVAL;
 			}
 			channels = val;
-			if (channels != 2 && channels != 4 && channels != 6) {
-				SNDERR("channels must be 2, 4 or 6");
+			if (channels < 2 || channels > 8) {
+				SNDERR("channels must be between 2 and 8");
 				return -EINVAL;
 			}
 			continue;
@@ -1122,6 +2270,57 @@ SND_PCM_PLUGIN_DEFINE_FUNC(a52)
 			}
 			continue;
 		}
+		if (strcmp(id, "slavemmap") == 0) {
+			err = snd_config_get_bool(n);
+			if (err < 0) {
+				SNDERR("Invalid value for %s", id);
+				return -EINVAL;
+			}
+			slave_mmap = err;
+			continue;
+		}
+		if (strcmp(id, "latency") == 0) {
+			const char *str;
+			err = snd_config_get_string(n, &str);
+			if (err < 0) {
+				SNDERR("invalid type for %s", id);
+				return -EINVAL;
+			}
+			if (strcmp(str, "low") == 0)
+				low_latency = 1;
+			else if (strcmp(str, "normal") == 0)
+				low_latency = 0;
+			else {
+				SNDERR("latency must be low or normal");
+				return -EINVAL;
+			}
+			continue;
+		}
+		if (strcmp(id, "threaded") == 0) {
+			err = snd_config_get_bool(n);
+			if (err < 0) {
+				SNDERR("Invalid value for %s", id);
+				return -EINVAL;
+			}
+			threaded = err;
+			continue;
+		}
+		if (strcmp(id, "stats") == 0) {
+			err = snd_config_get_bool(n);
+			if (err < 0) {
+				SNDERR("Invalid value for %s", id);
+				return -EINVAL;
+			}
+			stats = err;
+			continue;
+		}
+		if (strcmp(id, "stats_file") == 0) {
+			if (snd_config_get_string(n, &stats_file) < 0) {
+				SNDERR("a52 stats_file must be a string");
+				return -EINVAL;
+			}
+			continue;
+		}
 		if (strcmp(id, "avcodec") == 0) {
 			const char *str;
 			err = snd_config_get_string(n, &str);
@@ -1146,7 +2345,20 @@ SND_PCM_PLUGIN_DEFINE_FUNC(a52)
 	rec->rate = rate;
 	rec->bitrate = bitrate;
 	rec->channels = channels;
+	rec->enc_channels = enc_channels[channels];
 	rec->format = format;
+	rec->threaded = threaded;
+	rec->slave_mmap = slave_mmap;
+	rec->low_latency = low_latency;
+	a52_dsp_init(&rec->dsp);
+
+	if (stats || stats_file) {
+		rec->stats = a52_stats_new(stats_file);
+		if (!rec->stats) {
+			err = -ENOMEM;
+			goto error;
+		}
+	}
 
 #ifndef USE_AVCODEC_FRAME
 	avcodec_init();
@@ -1155,9 +2367,15 @@ SND_PCM_PLUGIN_DEFINE_FUNC(a52)
 	avcodec_register_all();
 #endif
 
-	if (avcodec) {
+	if (avcodec && strcmp(avcodec, "auto") == 0) {
+		rec->codec = (AVCodec *)select_auto_codec(rate, rec->enc_channels,
+							  bitrate);
+		/* otherwise treated like the default choice */
+		avcodec = NULL;
+	} else if (avcodec) {
 		rec->codec = avcodec_find_encoder_by_name(avcodec);
-	} else {
+	}
+	if (rec->codec == NULL && !avcodec) {
 		rec->codec = avcodec_find_encoder_by_name("ac3_fixed");
 		if (rec->codec == NULL)
 			rec->codec = avcodec_find_encoder_by_name("ac3");
@@ -1169,6 +2387,17 @@ SND_PCM_PLUGIN_DEFINE_FUNC(a52)
 		err = -EINVAL;
 		goto error;
 	}
+	rec->codec_int = rec->codec;
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(52, 95, 0) && USE_AVCODEC_FRAME
+	/* the float encoder takes FLOAT input as is, unless a codec is given */
+	if (!avcodec) {
+		rec->codec_flt = avcodec_find_encoder_by_name("ac3");
+		if (rec->codec_flt &&
+		    (rec->codec_flt == rec->codec_int ||
+		     rec->codec_flt->sample_fmts[0] != AV_SAMPLE_FMT_FLTP))
+			rec->codec_flt = NULL;
+	}
+#endif
 
 	if (! pcm_string || pcm_string[0] == '\0') {
 		snprintf(devstr, sizeof(devstr),
@@ -1193,6 +2422,8 @@ SND_PCM_PLUGIN_DEFINE_FUNC(a52)
 			goto error;
 	}
 
+	rec->slave_nonblock = !!(mode & SND_PCM_NONBLOCK);
+
 	rec->io.version = SND_PCM_IOPLUG_VERSION;
 	rec->io.name = "A52 Output Plugin";
 	rec->io.mmap_rw = 0;
@@ -1202,10 +2433,9 @@ SND_PCM_PLUGIN_DEFINE_FUNC(a52)
 	rec->io.flags = SND_PCM_IOPLUG_FLAG_BOUNDARY_WA;
 #endif
 #ifdef USE_AVCODEC_FRAME
-	rec->av_format = rec->codec->sample_fmts[0];
-	rec->is_planar = av_sample_fmt_is_planar(rec->av_format);
+	rec->av_format_int = rec->codec_int->sample_fmts[0];
 #else
-	rec->av_format = AV_SAMPLE_FMT_S16;
+	rec->av_format_int = AV_SAMPLE_FMT_S16;
 #endif
 
 	err = snd_pcm_ioplug_create(&rec->io, name, stream, mode);
@@ -1223,6 +2453,7 @@ SND_PCM_PLUGIN_DEFINE_FUNC(a52)
  error:
 	if (rec->slave)
 		snd_pcm_close(rec->slave);
+	a52_stats_free(rec->stats);
 	free(rec);
 	return err;
 }
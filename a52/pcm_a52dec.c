@@ -0,0 +1,907 @@
+/*
+ * A52 Input Plugin
+ *
+ * Decodes AC3 bursts in an IEC958 (IEC61937) capture stream to PCM.
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <alsa/asoundlib.h>
+#include <alsa/pcm_external.h>
+#include <alsa/pcm_plugin.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/avutil.h>
+
+#ifndef ESTRPIPE
+#define ESTRPIPE ESPIPE
+#endif
+
+#ifndef AV_VERSION_INT
+#define AV_VERSION_INT(a, b, c) (((a) << 16) | ((b) << 8) | (c))
+#endif
+#ifndef LIBAVCODEC_VERSION_INT
+#define LIBAVCODEC_VERSION_INT  AV_VERSION_INT(LIBAVCODEC_VERSION_MAJOR, \
+                                               LIBAVCODEC_VERSION_MINOR, \
+                                               LIBAVCODEC_VERSION_MICRO)
+#endif
+
+/* the decoder uses the send/receive API only */
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 91, 0)
+#define HAVE_A52DEC 1
+#include <libavcodec/packet.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/mem.h>
+#include <libavutil/opt.h>
+#endif
+
+#define HAVE_CH_LAYOUT (LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100))
+
+#ifdef HAVE_A52DEC
+
+/* the repetition period of AC3 bursts in frames */
+#define A52_FRAME_SIZE		1536
+/* frames without a sync word until the input is taken as plain PCM */
+#define A52DEC_LOCK_FRAMES	(2 * A52_FRAME_SIZE)
+/* frames read from the slave at once */
+#define A52DEC_READ_FRAMES	A52_FRAME_SIZE
+/* the input keeps a partial burst plus one read */
+#define A52DEC_IN_FRAMES	(2 * A52_FRAME_SIZE + A52DEC_READ_FRAMES)
+/* decoded frames of one read at most: two bursts plus plain frames */
+#define A52DEC_OUT_FRAMES	(4 * A52_FRAME_SIZE)
+
+/* IEC61937 preamble */
+#define IEC61937_PA		0xf872
+#define IEC61937_PB		0x4e1f
+#define IEC61937_AC3		0x01
+
+struct a52dec_ctx {
+	snd_pcm_ioplug_t io;
+	snd_pcm_t *slave;
+	const AVCodec *codec;
+	AVCodecContext *avctx;
+	AVPacket *pkt;
+	AVFrame *frame;
+	snd_pcm_format_t format;	/* slave format, S16_LE or S16_BE */
+	unsigned int channels;
+	unsigned int rate;
+	/* raw IEC958 stream from the slave, two 16bit words per frame */
+	unsigned char *inbuf;
+	unsigned int in_frames;
+	/* decoded S16 PCM not yet passed to the application */
+	int16_t *outbuf;
+	unsigned int out_pos;
+	unsigned int out_len;
+	unsigned int out_limit;	/* never more staged than the buffer */
+	unsigned char *payload;
+	unsigned int covered;	/* frames of the current burst period left */
+	unsigned int nosync;	/* frames without a burst */
+	int passthrough;	/* the input is plain PCM */
+	snd_pcm_uframes_t produced;	/* frames decoded, the hw position */
+	snd_pcm_uframes_t avail_min;
+	snd_pcm_uframes_t boundary;
+};
+
+/* the position of each output channel; rear falls back to side */
+static const uint64_t out_channels[6][2] = {
+	{ AV_CH_FRONT_LEFT, 0 },
+	{ AV_CH_FRONT_RIGHT, 0 },
+	{ AV_CH_BACK_LEFT, AV_CH_SIDE_LEFT },
+	{ AV_CH_BACK_RIGHT, AV_CH_SIDE_RIGHT },
+	{ AV_CH_FRONT_CENTER, 0 },
+	{ AV_CH_LOW_FREQUENCY, 0 },
+};
+
+static unsigned int get_word(struct a52dec_ctx *rec, const unsigned char *p)
+{
+	if (rec->format == SND_PCM_FORMAT_S16_BE)
+		return (p[0] << 8) | p[1];
+	return p[0] | (p[1] << 8);
+}
+
+static int frame_channels(const AVFrame *frame)
+{
+#if HAVE_CH_LAYOUT
+	return frame->ch_layout.nb_channels;
+#else
+	return frame->channels;
+#endif
+}
+
+/* the index of the decoded channel at the given position, or -1 */
+static int frame_channel_index(const AVFrame *frame, uint64_t mask)
+{
+#if HAVE_CH_LAYOUT
+	enum AVChannel chan = 0;
+
+	while (!(mask & 1)) {
+		mask >>= 1;
+		chan++;
+	}
+	return av_channel_layout_index_from_channel(&frame->ch_layout, chan);
+#else
+	if (!(frame->channel_layout & mask))
+		return -1;
+	return av_get_channel_layout_channel_index(frame->channel_layout, mask);
+#endif
+}
+
+/* convert the decoded channel to S16 in the output buffer */
+static void convert_channel(const AVFrame *frame, int src, int16_t *dst,
+			    unsigned int dst_step)
+{
+	int planar = av_sample_fmt_is_planar(frame->format);
+	unsigned int step = planar ? 1 : frame_channels(frame);
+	const uint8_t *data = frame->data[planar ? src : 0];
+	unsigned int ofs = planar ? 0 : src;
+	int i;
+
+	switch (av_get_packed_sample_fmt(frame->format)) {
+	case AV_SAMPLE_FMT_S16: {
+		const int16_t *s = (const int16_t *)data + ofs;
+		for (i = 0; i < frame->nb_samples; i++, s += step, dst += dst_step)
+			*dst = *s;
+		break;
+	}
+	case AV_SAMPLE_FMT_S32: {
+		const int32_t *s = (const int32_t *)data + ofs;
+		for (i = 0; i < frame->nb_samples; i++, s += step, dst += dst_step)
+			*dst = *s >> 16;
+		break;
+	}
+	case AV_SAMPLE_FMT_FLT: {
+		const float *s = (const float *)data + ofs;
+		for (i = 0; i < frame->nb_samples; i++, s += step, dst += dst_step) {
+			float v = *s * 32768.0f;
+			if (v >= 32767.0f)
+				*dst = 32767;
+			else if (v <= -32768.0f)
+				*dst = -32768;
+			else
+				*dst = (int16_t)(v < 0 ? v - 0.5f : v + 0.5f);
+		}
+		break;
+	}
+	default:
+		for (i = 0; i < frame->nb_samples; i++, dst += dst_step)
+			*dst = 0;
+		break;
+	}
+}
+
+/* append the given number of silent frames to the output */
+static void output_silence(struct a52dec_ctx *rec, unsigned int frames)
+{
+	memset(rec->outbuf + rec->out_len * rec->channels, 0,
+	       frames * rec->channels * sizeof(int16_t));
+	rec->out_len += frames;
+}
+
+/* decode the AC3 frame in the payload and append it to the output;
+ * a burst period is replaced with silence if it can't be decoded
+ */
+static void decode_burst(struct a52dec_ctx *rec, unsigned int bytes)
+{
+	int16_t *dst = rec->outbuf + rec->out_len * rec->channels;
+	unsigned int ch;
+	int idx;
+
+	rec->pkt->data = rec->payload;
+	rec->pkt->size = bytes;
+	if (avcodec_send_packet(rec->avctx, rec->pkt) < 0 ||
+	    avcodec_receive_frame(rec->avctx, rec->frame) < 0 ||
+	    rec->frame->nb_samples > A52_FRAME_SIZE) {
+		output_silence(rec, A52_FRAME_SIZE);
+		return;
+	}
+
+	for (ch = 0; ch < rec->channels; ch++) {
+		idx = frame_channel_index(rec->frame, out_channels[ch][0]);
+		if (idx < 0 && out_channels[ch][1])
+			idx = frame_channel_index(rec->frame, out_channels[ch][1]);
+		/* unknown layout, take the channels in order */
+		if (idx < 0 && ch < 2 && (int)ch < frame_channels(rec->frame))
+			idx = ch;
+		if (idx < 0) {
+			unsigned int i;
+			for (i = 0; i < (unsigned int)rec->frame->nb_samples; i++)
+				dst[i * rec->channels + ch] = 0;
+		} else {
+			convert_channel(rec->frame, idx, dst + ch, rec->channels);
+		}
+	}
+	rec->out_len += rec->frame->nb_samples;
+	if (rec->frame->nb_samples < A52_FRAME_SIZE)
+		output_silence(rec, A52_FRAME_SIZE - rec->frame->nb_samples);
+	av_frame_unref(rec->frame);
+}
+
+/* pass a frame of the input as plain stereo PCM */
+static void output_pcm(struct a52dec_ctx *rec, const unsigned char *p)
+{
+	int16_t *dst = rec->outbuf + rec->out_len * rec->channels;
+
+	memset(dst, 0, rec->channels * sizeof(int16_t));
+	dst[0] = (int16_t)get_word(rec, p);
+	dst[1] = (int16_t)get_word(rec, p + 2);
+	rec->out_len++;
+}
+
+/*
+ * Parse the input frames.
+ *
+ * Each burst period yields A52_FRAME_SIZE output frames when its payload
+ * is complete; the remaining frames of the period are dropped.  Input
+ * outside of bursts gives silence until no burst was seen for a while,
+ * then it's passed as PCM.  So the output stays in step with the input.
+ */
+static void parse_input(struct a52dec_ctx *rec)
+{
+	unsigned char *p = rec->inbuf;
+	unsigned int pos = 0, len, bytes, i;
+	unsigned int out_len = rec->out_len;
+
+	while (pos < rec->in_frames) {
+		/* keep room for a whole decoded burst */
+		if (rec->out_len + A52_FRAME_SIZE > rec->out_limit)
+			break;
+		p = rec->inbuf + pos * 4;
+		if (get_word(rec, p) == IEC61937_PA &&
+		    get_word(rec, p + 2) == IEC61937_PB) {
+			if (pos + 2 > rec->in_frames)
+				break; /* wait for the rest of the header */
+			bytes = (get_word(rec, p + 6) + 7) / 8;
+			/* the header and the payload words, in frames */
+			len = 2 + (bytes + 3) / 4;
+			if (len > A52_FRAME_SIZE) {
+				/* bogus length, not a burst */
+				goto no_burst;
+			}
+			if (pos + len > rec->in_frames)
+				break; /* wait for the rest of the payload */
+			if ((get_word(rec, p + 4) & 0x1f) == IEC61937_AC3) {
+				/* payload words are big-endian byte pairs */
+				for (i = 0; i < bytes; i += 2) {
+					unsigned int w = get_word(rec, p + 8 + i);
+					rec->payload[i] = w >> 8;
+					rec->payload[i + 1] = w & 0xff;
+				}
+				decode_burst(rec, bytes);
+				rec->covered = A52_FRAME_SIZE - len;
+			} else {
+				/* pause or other data bursts */
+				output_silence(rec, len);
+			}
+			rec->nosync = 0;
+			rec->passthrough = 0;
+			pos += len;
+			continue;
+		}
+	no_burst:
+		if (rec->covered) {
+			rec->covered--;
+		} else if (rec->passthrough) {
+			output_pcm(rec, p);
+		} else {
+			output_silence(rec, 1);
+			if (++rec->nosync >= A52DEC_LOCK_FRAMES)
+				rec->passthrough = 1;
+		}
+		pos++;
+	}
+
+	rec->in_frames -= pos;
+	memmove(rec->inbuf, rec->inbuf + pos * 4, rec->in_frames * 4);
+	rec->produced = (rec->produced + rec->out_len - out_len) % rec->boundary;
+}
+
+/*
+ * Decode what the slave has available, without blocking: the staged
+ * frames move to the front, the rest of the input is parsed and more
+ * is read until the slave is empty or the output is full.  Only whole
+ * bursts give output, so a partial one stays in the input until its
+ * end arrives.  Returns the number of staged frames or a negative error.
+ */
+static snd_pcm_sframes_t decode_available(snd_pcm_ioplug_t *io,
+					  struct a52dec_ctx *rec)
+{
+	snd_pcm_sframes_t ret, avail;
+	unsigned int frames;
+
+	if (rec->out_pos) {
+		rec->out_len -= rec->out_pos;
+		memmove(rec->outbuf, rec->outbuf + rec->out_pos * rec->channels,
+			rec->out_len * rec->channels * sizeof(int16_t));
+		rec->out_pos = 0;
+	}
+
+	for (;;) {
+		parse_input(rec);
+		if (rec->out_len + A52_FRAME_SIZE > rec->out_limit)
+			break;
+		avail = snd_pcm_avail(rec->slave);
+		if (avail < 0) {
+			if (avail == -EPIPE)
+				io->state = SND_PCM_STATE_XRUN;
+			return avail;
+		}
+		frames = A52DEC_IN_FRAMES - rec->in_frames;
+		if (frames > A52DEC_READ_FRAMES)
+			frames = A52DEC_READ_FRAMES;
+		if (frames > avail)
+			frames = avail;
+		if (!frames)
+			break;
+		ret = snd_pcm_readi(rec->slave,
+				    rec->inbuf + rec->in_frames * 4, frames);
+		if (ret < 0) {
+			if (ret == -EPIPE)
+				io->state = SND_PCM_STATE_XRUN;
+			return ret;
+		}
+		if (!ret)
+			break;
+		rec->in_frames += ret;
+	}
+	return rec->out_len;
+}
+
+/*
+ * transfer callback
+ *
+ * Copy the decoded frames, reading more from the slave as needed.
+ * A burst decodes to A52_FRAME_SIZE frames at once while the
+ * application may ask for any fewer, so the output is staged in outbuf
+ * and copied from there rather than decoded into the areas directly.
+ */
+static snd_pcm_sframes_t a52dec_transfer(snd_pcm_ioplug_t *io,
+					 const snd_pcm_channel_area_t *areas,
+					 snd_pcm_uframes_t offset,
+					 snd_pcm_uframes_t size)
+{
+	struct a52dec_ctx *rec = io->private_data;
+	snd_pcm_channel_area_t src_areas[6];
+	snd_pcm_sframes_t result = 0, err;
+	unsigned int ch, n;
+
+	for (ch = 0; ch < rec->channels; ch++) {
+		src_areas[ch].addr = rec->outbuf;
+		src_areas[ch].first = ch * 16;
+		src_areas[ch].step = rec->channels * 16;
+	}
+
+	while (size > 0) {
+		if (rec->out_pos == rec->out_len) {
+			err = decode_available(io, rec);
+			if (err < 0)
+				return result > 0 ? result : err;
+			if (!err) {
+				if (result || io->nonblock)
+					break;
+				/* blocking: wait for the rest of the burst */
+				err = snd_pcm_wait(rec->slave, -1);
+				if (err < 0)
+					return err;
+				continue;
+			}
+		}
+		n = rec->out_len - rec->out_pos;
+		if (n > size)
+			n = size;
+		snd_pcm_areas_copy(areas, offset, src_areas, rec->out_pos,
+				   rec->channels, n, SND_PCM_FORMAT_S16);
+		rec->out_pos += n;
+		offset += n;
+		size -= n;
+		result += n;
+	}
+	return result > 0 ? result : -EAGAIN;
+}
+
+/*
+ * pointer callback
+ *
+ * The position counts the decoded frames only; whatever the slave has
+ * available is decoded first, so a burst counts once it is complete
+ */
+static snd_pcm_sframes_t a52dec_pointer(snd_pcm_ioplug_t *io)
+{
+	struct a52dec_ctx *rec = io->private_data;
+	snd_pcm_sframes_t err;
+
+	switch (snd_pcm_state(rec->slave)) {
+	case SND_PCM_STATE_RUNNING:
+		break;
+	case SND_PCM_STATE_XRUN:
+		return -EPIPE;
+	case SND_PCM_STATE_SUSPENDED:
+		return -ESTRPIPE;
+	default:
+		return 0;
+	}
+
+	err = decode_available(io, rec);
+	if (err < 0)
+		return err;
+#ifdef SND_PCM_IOPLUG_FLAG_BOUNDARY_WA
+	return rec->produced;
+#else
+	return rec->produced % io->buffer_size;
+#endif
+}
+
+static int a52dec_start(snd_pcm_ioplug_t *io)
+{
+	struct a52dec_ctx *rec = io->private_data;
+
+	if (snd_pcm_state(rec->slave) == SND_PCM_STATE_RUNNING)
+		return 0;
+	return snd_pcm_start(rec->slave);
+}
+
+static int a52dec_stop(snd_pcm_ioplug_t *io)
+{
+	struct a52dec_ctx *rec = io->private_data;
+
+	return snd_pcm_drop(rec->slave);
+}
+
+/*
+ * hw_params callback
+ *
+ * Set up slave PCM according to the current parameters
+ */
+static int a52dec_hw_params(snd_pcm_ioplug_t *io,
+			    snd_pcm_hw_params_t *params ATTRIBUTE_UNUSED)
+{
+	struct a52dec_ctx *rec = io->private_data;
+	snd_pcm_hw_params_t *hw_params;
+	snd_pcm_uframes_t period_size = io->period_size;
+	snd_pcm_uframes_t buffer_size = io->buffer_size;
+	int err;
+
+	snd_pcm_hw_params_alloca(&hw_params);
+	if ((err = snd_pcm_hw_params_any(rec->slave, hw_params)) < 0) {
+		SNDERR("Cannot get slave hw_params");
+		return err;
+	}
+	if ((err = snd_pcm_hw_params_set_access(rec->slave, hw_params,
+						SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
+		SNDERR("Cannot set slave access RW_INTERLEAVED");
+		return err;
+	}
+	if ((err = snd_pcm_hw_params_set_channels(rec->slave, hw_params, 2)) < 0) {
+		SNDERR("Cannot set slave channels 2");
+		return err;
+	}
+	if ((err = snd_pcm_hw_params_set_format(rec->slave, hw_params,
+						rec->format)) < 0) {
+		SNDERR("Cannot set slave format");
+		return err;
+	}
+	if ((err = snd_pcm_hw_params_set_rate(rec->slave, hw_params, rec->rate, 0)) < 0) {
+		SNDERR("Cannot set slave rate %d", rec->rate);
+		return err;
+	}
+	if ((err = snd_pcm_hw_params_set_period_size_near(rec->slave, hw_params,
+							  &period_size, NULL)) < 0) {
+		SNDERR("Cannot set slave period size %ld", period_size);
+		return err;
+	}
+	if ((err = snd_pcm_hw_params_set_buffer_size_near(rec->slave, hw_params,
+							  &buffer_size)) < 0) {
+		SNDERR("Cannot set slave buffer size %ld", buffer_size);
+		return err;
+	}
+	if ((err = snd_pcm_hw_params(rec->slave, hw_params)) < 0) {
+		SNDERR("Cannot set slave hw_params");
+		return err;
+	}
+	return 0;
+}
+
+static int a52dec_hw_free(snd_pcm_ioplug_t *io)
+{
+	struct a52dec_ctx *rec = io->private_data;
+
+	return snd_pcm_hw_free(rec->slave);
+}
+
+/*
+ * sw_params callback
+ *
+ * Set up slave PCM sw_params
+ */
+static int a52dec_sw_params(snd_pcm_ioplug_t *io, snd_pcm_sw_params_t *params)
+{
+	struct a52dec_ctx *rec = io->private_data;
+	snd_pcm_sw_params_t *sparams;
+	snd_pcm_uframes_t avail_min, start_threshold;
+
+	snd_pcm_sw_params_get_avail_min(params, &avail_min);
+	snd_pcm_sw_params_get_start_threshold(params, &start_threshold);
+	snd_pcm_sw_params_get_boundary(params, &rec->boundary);
+	rec->avail_min = avail_min;
+
+	snd_pcm_sw_params_alloca(&sparams);
+	snd_pcm_sw_params_current(rec->slave, sparams);
+	snd_pcm_sw_params_set_avail_min(rec->slave, sparams, avail_min);
+	snd_pcm_sw_params_set_start_threshold(rec->slave, sparams,
+					      start_threshold);
+	return snd_pcm_sw_params(rec->slave, sparams);
+}
+
+/*
+ * prepare callback
+ *
+ * Reset the parser and the decoder
+ */
+static int a52dec_prepare(snd_pcm_ioplug_t *io)
+{
+	struct a52dec_ctx *rec = io->private_data;
+
+	avcodec_flush_buffers(rec->avctx);
+	rec->in_frames = 0;
+	rec->out_pos = rec->out_len = 0;
+	rec->covered = 0;
+	rec->nosync = 0;
+	rec->passthrough = 0;
+	rec->produced = 0;
+	rec->out_limit = io->buffer_size < A52DEC_OUT_FRAMES ?
+		io->buffer_size : A52DEC_OUT_FRAMES;
+	return snd_pcm_prepare(rec->slave);
+}
+
+static void a52dec_dump(snd_pcm_ioplug_t *io, snd_output_t *out)
+{
+	struct a52dec_ctx *rec = io->private_data;
+
+	snd_output_printf(out, "%s\n", io->name);
+	snd_output_printf(out, "Its setup is:\n");
+	snd_pcm_dump_setup(io->pcm, out);
+	snd_output_printf(out, "  %-13s: %s\n", "input",
+			  rec->passthrough ? "PCM" : "AC3");
+	snd_output_printf(out, "Slave: ");
+	snd_pcm_dump(rec->slave, out);
+}
+
+/*
+ * poll-related callbacks - just pass to slave PCM
+ */
+static int a52dec_poll_descriptors_count(snd_pcm_ioplug_t *io)
+{
+	struct a52dec_ctx *rec = io->private_data;
+	return snd_pcm_poll_descriptors_count(rec->slave);
+}
+
+static int a52dec_poll_descriptors(snd_pcm_ioplug_t *io, struct pollfd *pfd,
+				   unsigned int space)
+{
+	struct a52dec_ctx *rec = io->private_data;
+	return snd_pcm_poll_descriptors(rec->slave, pfd, space);
+}
+
+/* the slave may have frames while no burst is complete yet */
+static int a52dec_poll_revents(snd_pcm_ioplug_t *io, struct pollfd *pfd,
+			       unsigned int nfds, unsigned short *revents)
+{
+	struct a52dec_ctx *rec = io->private_data;
+	snd_pcm_sframes_t staged;
+	int err;
+
+	err = snd_pcm_poll_descriptors_revents(rec->slave, pfd, nfds, revents);
+	if (err < 0 || !(*revents & POLLIN))
+		return err;
+	staged = decode_available(io, rec);
+	if (staged >= 0 && (snd_pcm_uframes_t)staged < rec->avail_min)
+		*revents &= ~POLLIN;
+	return 0;
+}
+
+static void a52dec_free(struct a52dec_ctx *rec)
+{
+	av_packet_free(&rec->pkt);
+	av_frame_free(&rec->frame);
+	avcodec_free_context(&rec->avctx);
+	av_freep(&rec->payload);
+	free(rec->inbuf);
+	free(rec->outbuf);
+}
+
+static int a52dec_close(snd_pcm_ioplug_t *io)
+{
+	struct a52dec_ctx *rec = io->private_data;
+	snd_pcm_t *slave = rec->slave;
+
+	a52dec_free(rec);
+	free(rec);
+	if (slave)
+		return snd_pcm_close(slave);
+	return 0;
+}
+
+#if SND_PCM_IOPLUG_VERSION >= 0x10002
+static const unsigned int chmap6[6] = {
+	SND_CHMAP_FL, SND_CHMAP_FR,
+	SND_CHMAP_RL, SND_CHMAP_RR,
+	SND_CHMAP_FC, SND_CHMAP_LFE,
+};
+
+static snd_pcm_chmap_t *a52dec_get_chmap(snd_pcm_ioplug_t *io)
+{
+	snd_pcm_chmap_t *map;
+
+	map = malloc((io->channels + 1) * sizeof(int));
+	if (!map)
+		return NULL;
+	map->channels = io->channels;
+	memcpy(map->pos, chmap6, io->channels * sizeof(int));
+	return map;
+}
+#endif /* SND_PCM_IOPLUG_VERSION >= 0x10002 */
+
+static snd_pcm_ioplug_callback_t a52dec_ops = {
+	.start = a52dec_start,
+	.stop = a52dec_stop,
+	.pointer = a52dec_pointer,
+	.transfer = a52dec_transfer,
+	.close = a52dec_close,
+	.hw_params = a52dec_hw_params,
+	.hw_free = a52dec_hw_free,
+	.dump = a52dec_dump,
+	.sw_params = a52dec_sw_params,
+	.prepare = a52dec_prepare,
+	.poll_descriptors_count = a52dec_poll_descriptors_count,
+	.poll_descriptors = a52dec_poll_descriptors,
+	.poll_revents = a52dec_poll_revents,
+#if SND_PCM_IOPLUG_VERSION >= 0x10002
+	.get_chmap = a52dec_get_chmap,
+#endif /* SND_PCM_IOPLUG_VERSION >= 0x10002 */
+};
+
+/*
+ * set up h/w constraints
+ *
+ * the period size is fixed to the AC3 frame size
+ */
+static int a52dec_set_hw_constraint(struct a52dec_ctx *rec)
+{
+	static const unsigned int accesses[] = {
+		SND_PCM_ACCESS_MMAP_INTERLEAVED,
+		SND_PCM_ACCESS_MMAP_NONINTERLEAVED,
+		SND_PCM_ACCESS_RW_INTERLEAVED,
+		SND_PCM_ACCESS_RW_NONINTERLEAVED
+	};
+	unsigned int format = SND_PCM_FORMAT_S16;
+	unsigned int period_bytes = A52_FRAME_SIZE * 2 * rec->channels;
+	int err;
+
+	if ((err = snd_pcm_ioplug_set_param_list(&rec->io, SND_PCM_IOPLUG_HW_ACCESS,
+						 4, accesses)) < 0 ||
+	    (err = snd_pcm_ioplug_set_param_list(&rec->io, SND_PCM_IOPLUG_HW_FORMAT,
+						 1, &format)) < 0 ||
+	    (err = snd_pcm_ioplug_set_param_minmax(&rec->io, SND_PCM_IOPLUG_HW_CHANNELS,
+						   rec->channels, rec->channels)) < 0 ||
+	    (err = snd_pcm_ioplug_set_param_minmax(&rec->io, SND_PCM_IOPLUG_HW_RATE,
+						   rec->rate, rec->rate)) < 0 ||
+	    (err = snd_pcm_ioplug_set_param_minmax(&rec->io, SND_PCM_IOPLUG_HW_PERIOD_BYTES,
+						   period_bytes, period_bytes)) < 0 ||
+	    (err = snd_pcm_ioplug_set_param_minmax(&rec->io, SND_PCM_IOPLUG_HW_PERIODS,
+						   2, 64)) < 0)
+		return err;
+	return 0;
+}
+
+static int a52dec_open_decoder(struct a52dec_ctx *rec)
+{
+	rec->codec = avcodec_find_decoder(AV_CODEC_ID_AC3);
+	if (!rec->codec) {
+		SNDERR("Cannot find AC3 decoder");
+		return -EINVAL;
+	}
+	rec->avctx = avcodec_alloc_context3(rec->codec);
+	if (!rec->avctx)
+		return -ENOMEM;
+	/* let the decoder mix down to stereo */
+	if (rec->channels == 2) {
+#if HAVE_CH_LAYOUT
+		av_opt_set(rec->avctx, "downmix", "stereo",
+			   AV_OPT_SEARCH_CHILDREN);
+#else
+		rec->avctx->request_channel_layout = AV_CH_LAYOUT_STEREO;
+#endif
+	}
+	if (avcodec_open2(rec->avctx, rec->codec, NULL) < 0) {
+		SNDERR("Cannot open AC3 decoder");
+		return -EINVAL;
+	}
+
+	rec->pkt = av_packet_alloc();
+	rec->frame = av_frame_alloc();
+	rec->payload = av_mallocz(A52_FRAME_SIZE * 4 + AV_INPUT_BUFFER_PADDING_SIZE);
+	rec->inbuf = malloc(A52DEC_IN_FRAMES * 4);
+	rec->outbuf = malloc(A52DEC_OUT_FRAMES * rec->channels * sizeof(int16_t));
+	if (!rec->pkt || !rec->frame || !rec->payload ||
+	    !rec->inbuf || !rec->outbuf)
+		return -ENOMEM;
+	return 0;
+}
+
+/*
+ * Main entry point
+ */
+SND_PCM_PLUGIN_DEFINE_FUNC(a52dec)
+{
+	snd_config_iterator_t i, next;
+	int err;
+	const char *card = NULL;
+	const char *pcm_string = NULL;
+	unsigned int rate = 48000;
+	unsigned int channels = 6;
+	snd_pcm_format_t format = SND_PCM_FORMAT_S16_LE;
+	char devstr[128], tmpcard[16];
+	struct a52dec_ctx *rec;
+
+	if (stream != SND_PCM_STREAM_CAPTURE) {
+		SNDERR("a52dec is only for capture");
+		return -EINVAL;
+	}
+
+	snd_config_for_each(i, next, conf) {
+		snd_config_t *n = snd_config_iterator_entry(i);
+		const char *id;
+		if (snd_config_get_id(n, &id) < 0)
+			continue;
+		if (strcmp(id, "comment") == 0 || strcmp(id, "type") == 0 || strcmp(id, "hint") == 0)
+			continue;
+		if (strcmp(id, "card") == 0) {
+			if (snd_config_get_string(n, &card) < 0) {
+				long val;
+				err = snd_config_get_integer(n, &val);
+				if (err < 0) {
+					SNDERR("Invalid type for %s", id);
+					return -EINVAL;
+				}
+				snprintf(tmpcard, sizeof(tmpcard), "%ld", val);
+				card = tmpcard;
+			}
+			continue;
+		}
+		if (strcmp(id, "slavepcm") == 0) {
+			if (snd_config_get_string(n, &pcm_string) < 0) {
+				SNDERR("a52dec slavepcm must be a string");
+				return -EINVAL;
+			}
+			continue;
+		}
+		if (strcmp(id, "rate") == 0) {
+			long val;
+			if (snd_config_get_integer(n, &val) < 0) {
+				SNDERR("Invalid type for %s", id);
+				return -EINVAL;
+			}
+			rate = val;
+			if (rate != 32000 && rate != 44100 && rate != 48000) {
+				SNDERR("rate must be 32000, 44100 or 48000");
+				return -EINVAL;
+			}
+			continue;
+		}
+		if (strcmp(id, "channels") == 0) {
+			long val;
+			if (snd_config_get_integer(n, &val) < 0) {
+				SNDERR("Invalid type for %s", id);
+				return -EINVAL;
+			}
+			channels = val;
+			if (channels != 2 && channels != 4 && channels != 6) {
+				SNDERR("channels must be 2, 4 or 6");
+				return -EINVAL;
+			}
+			continue;
+		}
+		if (strcmp(id, "format") == 0) {
+			const char *str;
+			err = snd_config_get_string(n, &str);
+			if (err < 0) {
+				SNDERR("invalid type for %s", id);
+				return -EINVAL;
+			}
+			format = snd_pcm_format_value(str);
+			if (format != SND_PCM_FORMAT_S16_LE &&
+			    format != SND_PCM_FORMAT_S16_BE) {
+				SNDERR("Only S16_LE/BE formats are allowed");
+				return -EINVAL;
+			}
+			continue;
+		}
+		SNDERR("Unknown field %s", id);
+		return -EINVAL;
+	}
+
+	rec = calloc(1, sizeof(*rec));
+	if (! rec) {
+		SNDERR("cannot allocate");
+		return -ENOMEM;
+	}
+
+	rec->rate = rate;
+	rec->channels = channels;
+	rec->format = format;
+
+	err = a52dec_open_decoder(rec);
+	if (err < 0)
+		goto error;
+
+	if (! pcm_string || pcm_string[0] == '\0') {
+		if (card)
+			snprintf(devstr, sizeof(devstr), "iec958:CARD=%s", card);
+		else
+			snprintf(devstr, sizeof(devstr), "iec958");
+		err = snd_pcm_open(&rec->slave, devstr, stream, mode);
+		if (err < 0)
+			goto error;
+		/* in case the slave doesn't support S16 format */
+		err = snd_pcm_linear_open(&rec->slave, NULL, SND_PCM_FORMAT_S16,
+					  rec->slave, 1);
+		if (err < 0)
+			goto error;
+	} else {
+		err = snd_pcm_open(&rec->slave, pcm_string, stream, mode);
+		if (err < 0)
+			goto error;
+	}
+
+	rec->io.version = SND_PCM_IOPLUG_VERSION;
+	rec->io.name = "A52 Input Plugin";
+	rec->io.mmap_rw = 0;
+	rec->io.callback = &a52dec_ops;
+	rec->io.private_data = rec;
+#ifdef SND_PCM_IOPLUG_FLAG_BOUNDARY_WA
+	rec->io.flags = SND_PCM_IOPLUG_FLAG_BOUNDARY_WA;
+#endif
+
+	err = snd_pcm_ioplug_create(&rec->io, name, stream, mode);
+	if (err < 0)
+		goto error;
+
+	if ((err = a52dec_set_hw_constraint(rec)) < 0) {
+		snd_pcm_ioplug_delete(&rec->io);
+		return err;
+	}
+
+	*pcmp = rec->io.pcm;
+	return 0;
+
+ error:
+	if (rec->slave)
+		snd_pcm_close(rec->slave);
+	a52dec_free(rec);
+	free(rec);
+	return err;
+}
+
+#else /* HAVE_A52DEC */
+
+SND_PCM_PLUGIN_DEFINE_FUNC(a52dec)
+{
+	SNDERR("a52dec requires libavcodec 58.91 or later");
+	return -ENXIO;
+}
+
+#endif /* HAVE_A52DEC */
+
+SND_PCM_PLUGIN_SYMBOL(a52dec);
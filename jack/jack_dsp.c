@@ -0,0 +1,890 @@
+/*
+ * JACK plugin - sample conversion kernels
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include "jack_dsp.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define JACK_DSP_X86	1
+#include <immintrin.h>
+#define TARGET(x)	__attribute__((target(x)))
+#endif
+
+/*
+ * Integer full scale and the largest float which still converts into
+ * range for each format
+ */
+#define S16_SCALE	32768.0f
+#define S16_MAX		(32767.0f / 32768.0f)
+#define S24_SCALE	8388608.0f
+#define S24_MAX		(8388607.0f / 8388608.0f)
+#define S32_SCALE	2147483648.0f
+#define S32_MAX		0x1.fffffep-1f
+
+/*
+ * generic C versions
+ */
+static inline int32_t float_to_int(float f, float scale, float max)
+{
+	/* same order as the vector min/max, so NaN ends up at max */
+	if (!(f < max))
+		f = max;
+	if (f < -1.0f)
+		f = -1.0f;
+	/* ties to even, like the vector conversions */
+	return (int32_t)lrintf(f * scale);
+}
+
+static void s16_to_float_c(float *dst, const void *src, unsigned int samples)
+{
+	const int16_t *s = src;
+	unsigned int i;
+
+	for (i = 0; i < samples; i++)
+		dst[i] = s[i] * (1.0f / S16_SCALE);
+}
+
+static void s24_to_float_c(float *dst, const void *src, unsigned int samples)
+{
+	const int32_t *s = src;
+	unsigned int i;
+
+	for (i = 0; i < samples; i++)
+		dst[i] = (int32_t)((uint32_t)s[i] << 8) * (1.0f / S32_SCALE);
+}
+
+static void s32_to_float_c(float *dst, const void *src, unsigned int samples)
+{
+	const int32_t *s = src;
+	unsigned int i;
+
+	for (i = 0; i < samples; i++)
+		dst[i] = s[i] * (1.0f / S32_SCALE);
+}
+
+static void float_to_s16_c(void *dst, const float *src, unsigned int samples)
+{
+	int16_t *d = dst;
+	unsigned int i;
+
+	for (i = 0; i < samples; i++)
+		d[i] = (int16_t)float_to_int(src[i], S16_SCALE, S16_MAX);
+}
+
+static void float_to_s24_c(void *dst, const float *src, unsigned int samples)
+{
+	int32_t *d = dst;
+	unsigned int i;
+
+	for (i = 0; i < samples; i++)
+		d[i] = float_to_int(src[i], S24_SCALE, S24_MAX);
+}
+
+static void float_to_s32_c(void *dst, const float *src, unsigned int samples)
+{
+	int32_t *d = dst;
+	unsigned int i;
+
+	for (i = 0; i < samples; i++)
+		d[i] = float_to_int(src[i], S32_SCALE, S32_MAX);
+}
+
+/*
+ * The (de)interleave helpers work on the frames from start up to
+ * frames, so that the vector versions can hand over their tails.
+ */
+static inline void deinterleave_part(float *const *dst, const float *src,
+				     unsigned int channels,
+				     unsigned int start, unsigned int frames)
+{
+	unsigned int ch, i;
+
+	for (ch = 0; ch < channels; ch++) {
+		const float *s = src + start * channels + ch;
+		float *d = dst[ch];
+
+		for (i = start; i < frames; i++, s += channels)
+			d[i] = *s;
+	}
+}
+
+static inline void interleave_part(float *dst, const float *const *src,
+				   unsigned int channels,
+				   unsigned int start, unsigned int frames)
+{
+	unsigned int ch, i;
+
+	for (ch = 0; ch < channels; ch++) {
+		const float *s = src[ch];
+		float *d = dst + start * channels + ch;
+
+		for (i = start; i < frames; i++, d += channels)
+			*d = s[i];
+	}
+}
+
+static void deinterleave_c(float *const *dst, const float *src,
+			   unsigned int channels, unsigned int frames)
+{
+	deinterleave_part(dst, src, channels, 0, frames);
+}
+
+static void interleave_c(float *dst, const float *const *src,
+			 unsigned int channels, unsigned int frames)
+{
+	interleave_part(dst, src, channels, 0, frames);
+}
+
+static void deinterleave_1(float *const *dst, const float *src,
+			   unsigned int channels, unsigned int frames)
+{
+	memcpy(dst[0], src, frames * sizeof(float));
+}
+
+static void interleave_1(float *dst, const float *const *src,
+			 unsigned int channels, unsigned int frames)
+{
+	memcpy(dst, src[0], frames * sizeof(float));
+}
+
+#ifdef JACK_DSP_X86
+/*
+ * The vector versions convert four (SSE2) or eight (AVX2) samples at
+ * once and leave the rest to the C versions.  Rounding is to nearest
+ * even, as set in MXCSR by default.
+ */
+TARGET("sse2")
+static void s16_to_float_sse2(float *dst, const void *src, unsigned int samples)
+{
+	const int16_t *s = src;
+	const __m128 gain = _mm_set1_ps(1.0f / S16_SCALE);
+	unsigned int i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), gain));
+		_mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), gain));
+	}
+	s16_to_float_c(dst + i, s + i, samples - i);
+}
+
+TARGET("sse2")
+static void s24_to_float_sse2(float *dst, const void *src, unsigned int samples)
+{
+	const int32_t *s = src;
+	const __m128 gain = _mm_set1_ps(1.0f / S32_SCALE);
+	unsigned int i;
+
+	for (i = 0; i + 4 <= samples; i += 4) {
+		__m128i v = _mm_slli_epi32(_mm_loadu_si128((const __m128i *)(s + i)), 8);
+
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(v), gain));
+	}
+	s24_to_float_c(dst + i, s + i, samples - i);
+}
+
+TARGET("sse2")
+static void s32_to_float_sse2(float *dst, const void *src, unsigned int samples)
+{
+	const int32_t *s = src;
+	const __m128 gain = _mm_set1_ps(1.0f / S32_SCALE);
+	unsigned int i;
+
+	for (i = 0; i + 4 <= samples; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(v), gain));
+	}
+	s32_to_float_c(dst + i, s + i, samples - i);
+}
+
+TARGET("sse2")
+static inline __m128i cvt_clip_sse2(const float *src, __m128 scale, __m128 max)
+{
+	__m128 v = _mm_min_ps(_mm_loadu_ps(src), max);
+
+	v = _mm_max_ps(v, _mm_set1_ps(-1.0f));
+	return _mm_cvtps_epi32(_mm_mul_ps(v, scale));
+}
+
+TARGET("sse2")
+static void float_to_s16_sse2(void *dst, const float *src, unsigned int samples)
+{
+	int16_t *d = dst;
+	const __m128 scale = _mm_set1_ps(S16_SCALE);
+	const __m128 max = _mm_set1_ps(S16_MAX);
+	unsigned int i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		__m128i lo = cvt_clip_sse2(src + i, scale, max);
+		__m128i hi = cvt_clip_sse2(src + i + 4, scale, max);
+
+		_mm_storeu_si128((__m128i *)(d + i), _mm_packs_epi32(lo, hi));
+	}
+	float_to_s16_c(d + i, src + i, samples - i);
+}
+
+TARGET("sse2")
+static void float_to_s24_sse2(void *dst, const float *src, unsigned int samples)
+{
+	int32_t *d = dst;
+	const __m128 scale = _mm_set1_ps(S24_SCALE);
+	const __m128 max = _mm_set1_ps(S24_MAX);
+	unsigned int i;
+
+	for (i = 0; i + 4 <= samples; i += 4)
+		_mm_storeu_si128((__m128i *)(d + i),
+				 cvt_clip_sse2(src + i, scale, max));
+	float_to_s24_c(d + i, src + i, samples - i);
+}
+
+TARGET("sse2")
+static void float_to_s32_sse2(void *dst, const float *src, unsigned int samples)
+{
+	int32_t *d = dst;
+	const __m128 scale = _mm_set1_ps(S32_SCALE);
+	const __m128 max = _mm_set1_ps(S32_MAX);
+	unsigned int i;
+
+	for (i = 0; i + 4 <= samples; i += 4)
+		_mm_storeu_si128((__m128i *)(d + i),
+				 cvt_clip_sse2(src + i, scale, max));
+	float_to_s32_c(d + i, src + i, samples - i);
+}
+
+TARGET("avx2")
+static void s16_to_float_avx2(float *dst, const void *src, unsigned int samples)
+{
+	const int16_t *s = src;
+	const __m256 gain = _mm256_set1_ps(1.0f / S16_SCALE);
+	unsigned int i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		__m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(s + i)));
+
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), gain));
+	}
+	s16_to_float_c(dst + i, s + i, samples - i);
+}
+
+TARGET("avx2")
+static void s24_to_float_avx2(float *dst, const void *src, unsigned int samples)
+{
+	const int32_t *s = src;
+	const __m256 gain = _mm256_set1_ps(1.0f / S32_SCALE);
+	unsigned int i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		__m256i v = _mm256_slli_epi32(_mm256_loadu_si256((const __m256i *)(s + i)), 8);
+
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), gain));
+	}
+	s24_to_float_c(dst + i, s + i, samples - i);
+}
+
+TARGET("avx2")
+static void s32_to_float_avx2(float *dst, const void *src, unsigned int samples)
+{
+	const int32_t *s = src;
+	const __m256 gain = _mm256_set1_ps(1.0f / S32_SCALE);
+	unsigned int i;
+
+	for (i = 0; i + 8 <= samples; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), gain));
+	}
+	s32_to_float_c(dst + i, s + i, samples - i);
+}
+
+TARGET("avx2")
+static inline __m256i cvt_clip_avx2(const float *src, __m256 scale, __m256 max)
+{
+	__m256 v = _mm256_min_ps(_mm256_loadu_ps(src), max);
+
+	v = _mm256_max_ps(v, _mm256_set1_ps(-1.0f));
+	return _mm256_cvtps_epi32(_mm256_mul_ps(v, scale));
+}
+
+TARGET("avx2")
+static void float_to_s16_avx2(void *dst, const float *src, unsigned int samples)
+{
+	int16_t *d = dst;
+	const __m256 scale = _mm256_set1_ps(S16_SCALE);
+	const __m256 max = _mm256_set1_ps(S16_MAX);
+	unsigned int i;
+
+	for (i = 0; i + 16 <= samples; i += 16) {
+		__m256i lo = cvt_clip_avx2(src + i, scale, max);
+		__m256i hi = cvt_clip_avx2(src + i + 8, scale, max);
+		/* packs works per 128bit lane; put the quarters back in order */
+		__m256i v = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi),
+						     _MM_SHUFFLE(3, 1, 2, 0));
+
+		_mm256_storeu_si256((__m256i *)(d + i), v);
+	}
+	float_to_s16_sse2(d + i, src + i, samples - i);
+}
+
+TARGET("avx2")
+static void float_to_s24_avx2(void *dst, const float *src, unsigned int samples)
+{
+	int32_t *d = dst;
+	const __m256 scale = _mm256_set1_ps(S24_SCALE);
+	const __m256 max = _mm256_set1_ps(S24_MAX);
+	unsigned int i;
+
+	for (i = 0; i + 8 <= samples; i += 8)
+		_mm256_storeu_si256((__m256i *)(d + i),
+				    cvt_clip_avx2(src + i, scale, max));
+	float_to_s24_c(d + i, src + i, samples - i);
+}
+
+TARGET("avx2")
+static void float_to_s32_avx2(void *dst, const float *src, unsigned int samples)
+{
+	int32_t *d = dst;
+	const __m256 scale = _mm256_set1_ps(S32_SCALE);
+	const __m256 max = _mm256_set1_ps(S32_MAX);
+	unsigned int i;
+
+	for (i = 0; i + 8 <= samples; i += 8)
+		_mm256_storeu_si256((__m256i *)(d + i),
+				    cvt_clip_avx2(src + i, scale, max));
+	float_to_s32_c(d + i, src + i, samples - i);
+}
+
+/*
+ * Float (de)interleave: blocks of frames are transposed in registers,
+ * 4x4 with SSE and 8x8 with AVX.  Transposing is its own inverse, so
+ * interleaving uses the same tiles with loads and stores swapped.
+ */
+TARGET("sse2")
+static inline void deinterleave_4x4(float *const *dst, const float *p,
+				    unsigned int channels, unsigned int ch,
+				    unsigned int i)
+{
+	__m128 r0 = _mm_loadu_ps(p + ch);
+	__m128 r1 = _mm_loadu_ps(p + channels + ch);
+	__m128 r2 = _mm_loadu_ps(p + 2 * channels + ch);
+	__m128 r3 = _mm_loadu_ps(p + 3 * channels + ch);
+
+	_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+	_mm_storeu_ps(dst[ch] + i, r0);
+	_mm_storeu_ps(dst[ch + 1] + i, r1);
+	_mm_storeu_ps(dst[ch + 2] + i, r2);
+	_mm_storeu_ps(dst[ch + 3] + i, r3);
+}
+
+TARGET("sse2")
+static inline void interleave_4x4(float *p, const float *const *src,
+				  unsigned int channels, unsigned int ch,
+				  unsigned int i)
+{
+	__m128 r0 = _mm_loadu_ps(src[ch] + i);
+	__m128 r1 = _mm_loadu_ps(src[ch + 1] + i);
+	__m128 r2 = _mm_loadu_ps(src[ch + 2] + i);
+	__m128 r3 = _mm_loadu_ps(src[ch + 3] + i);
+
+	_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+	_mm_storeu_ps(p + ch, r0);
+	_mm_storeu_ps(p + channels + ch, r1);
+	_mm_storeu_ps(p + 2 * channels + ch, r2);
+	_mm_storeu_ps(p + 3 * channels + ch, r3);
+}
+
+TARGET("sse2")
+static void deinterleave_2_sse2(float *const *dst, const float *src,
+				unsigned int channels, unsigned int frames)
+{
+	float *l = dst[0], *r = dst[1];
+	unsigned int i;
+
+	for (i = 0; i + 4 <= frames; i += 4) {
+		__m128 a = _mm_loadu_ps(src + 2 * i);
+		__m128 b = _mm_loadu_ps(src + 2 * i + 4);
+
+		_mm_storeu_ps(l + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+		_mm_storeu_ps(r + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+	}
+	deinterleave_part(dst, src, 2, i, frames);
+}
+
+TARGET("sse2")
+static void interleave_2_sse2(float *dst, const float *const *src,
+			      unsigned int channels, unsigned int frames)
+{
+	const float *l = src[0], *r = src[1];
+	unsigned int i;
+
+	for (i = 0; i + 4 <= frames; i += 4) {
+		__m128 a = _mm_loadu_ps(l + i);
+		__m128 b = _mm_loadu_ps(r + i);
+
+		_mm_storeu_ps(dst + 2 * i, _mm_unpacklo_ps(a, b));
+		_mm_storeu_ps(dst + 2 * i + 4, _mm_unpackhi_ps(a, b));
+	}
+	interleave_part(dst, src, 2, i, frames);
+}
+
+/* inlined with a constant channel count for the 8 channel versions */
+TARGET("sse2")
+static inline void deinterleave_tiles_sse2(float *const *dst, const float *src,
+					   unsigned int channels,
+					   unsigned int frames)
+{
+	unsigned int ch, i, n = frames & ~3U;
+
+	for (i = 0; i < n; i += 4) {
+		const float *p = src + i * channels;
+
+		for (ch = 0; ch + 4 <= channels; ch += 4)
+			deinterleave_4x4(dst, p, channels, ch, i);
+		for (; ch < channels; ch++) {
+			float *d = dst[ch] + i;
+
+			d[0] = p[ch];
+			d[1] = p[channels + ch];
+			d[2] = p[2 * channels + ch];
+			d[3] = p[3 * channels + ch];
+		}
+	}
+	deinterleave_part(dst, src, channels, n, frames);
+}
+
+TARGET("sse2")
+static inline void interleave_tiles_sse2(float *dst, const float *const *src,
+					 unsigned int channels,
+					 unsigned int frames)
+{
+	unsigned int ch, i, n = frames & ~3U;
+
+	for (i = 0; i < n; i += 4) {
+		float *p = dst + i * channels;
+
+		for (ch = 0; ch + 4 <= channels; ch += 4)
+			interleave_4x4(p, src, channels, ch, i);
+		for (; ch < channels; ch++) {
+			const float *s = src[ch] + i;
+
+			p[ch] = s[0];
+			p[channels + ch] = s[1];
+			p[2 * channels + ch] = s[2];
+			p[3 * channels + ch] = s[3];
+		}
+	}
+	interleave_part(dst, src, channels, n, frames);
+}
+
+TARGET("sse2")
+static void deinterleave_8_sse2(float *const *dst, const float *src,
+				unsigned int channels, unsigned int frames)
+{
+	deinterleave_tiles_sse2(dst, src, 8, frames);
+}
+
+TARGET("sse2")
+static void interleave_8_sse2(float *dst, const float *const *src,
+			      unsigned int channels, unsigned int frames)
+{
+	interleave_tiles_sse2(dst, src, 8, frames);
+}
+
+TARGET("sse2")
+static void deinterleave_n_sse2(float *const *dst, const float *src,
+				unsigned int channels, unsigned int frames)
+{
+	deinterleave_tiles_sse2(dst, src, channels, frames);
+}
+
+TARGET("sse2")
+static void interleave_n_sse2(float *dst, const float *const *src,
+			      unsigned int channels, unsigned int frames)
+{
+	interleave_tiles_sse2(dst, src, channels, frames);
+}
+
+TARGET("avx")
+static inline void transpose_8x8(__m256 *r)
+{
+	__m256 t0 = _mm256_unpacklo_ps(r[0], r[1]);
+	__m256 t1 = _mm256_unpackhi_ps(r[0], r[1]);
+	__m256 t2 = _mm256_unpacklo_ps(r[2], r[3]);
+	__m256 t3 = _mm256_unpackhi_ps(r[2], r[3]);
+	__m256 t4 = _mm256_unpacklo_ps(r[4], r[5]);
+	__m256 t5 = _mm256_unpackhi_ps(r[4], r[5]);
+	__m256 t6 = _mm256_unpacklo_ps(r[6], r[7]);
+	__m256 t7 = _mm256_unpackhi_ps(r[6], r[7]);
+	__m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+	__m256 s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+	__m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+	__m256 s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+	__m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+	__m256 s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+	__m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+	__m256 s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+	r[0] = _mm256_permute2f128_ps(s0, s4, 0x20);
+	r[1] = _mm256_permute2f128_ps(s1, s5, 0x20);
+	r[2] = _mm256_permute2f128_ps(s2, s6, 0x20);
+	r[3] = _mm256_permute2f128_ps(s3, s7, 0x20);
+	r[4] = _mm256_permute2f128_ps(s0, s4, 0x31);
+	r[5] = _mm256_permute2f128_ps(s1, s5, 0x31);
+	r[6] = _mm256_permute2f128_ps(s2, s6, 0x31);
+	r[7] = _mm256_permute2f128_ps(s3, s7, 0x31);
+}
+
+/* 8 frames of the channels ch..ch+7 */
+TARGET("avx")
+static inline void deinterleave_8x8(float *const *dst, const float *p,
+				    unsigned int channels, unsigned int ch,
+				    unsigned int i)
+{
+	/* spelled out, so that r stays in registers at -O2 */
+	__m256 r[8] = {
+		_mm256_loadu_ps(p + ch),
+		_mm256_loadu_ps(p + channels + ch),
+		_mm256_loadu_ps(p + 2 * channels + ch),
+		_mm256_loadu_ps(p + 3 * channels + ch),
+		_mm256_loadu_ps(p + 4 * channels + ch),
+		_mm256_loadu_ps(p + 5 * channels + ch),
+		_mm256_loadu_ps(p + 6 * channels + ch),
+		_mm256_loadu_ps(p + 7 * channels + ch),
+	};
+
+	transpose_8x8(r);
+	_mm256_storeu_ps(dst[ch] + i, r[0]);
+	_mm256_storeu_ps(dst[ch + 1] + i, r[1]);
+	_mm256_storeu_ps(dst[ch + 2] + i, r[2]);
+	_mm256_storeu_ps(dst[ch + 3] + i, r[3]);
+	_mm256_storeu_ps(dst[ch + 4] + i, r[4]);
+	_mm256_storeu_ps(dst[ch + 5] + i, r[5]);
+	_mm256_storeu_ps(dst[ch + 6] + i, r[6]);
+	_mm256_storeu_ps(dst[ch + 7] + i, r[7]);
+}
+
+TARGET("avx")
+static inline void interleave_8x8(float *p, const float *const *src,
+				  unsigned int channels, unsigned int ch,
+				  unsigned int i)
+{
+	__m256 r[8] = {
+		_mm256_loadu_ps(src[ch] + i),
+		_mm256_loadu_ps(src[ch + 1] + i),
+		_mm256_loadu_ps(src[ch + 2] + i),
+		_mm256_loadu_ps(src[ch + 3] + i),
+		_mm256_loadu_ps(src[ch + 4] + i),
+		_mm256_loadu_ps(src[ch + 5] + i),
+		_mm256_loadu_ps(src[ch + 6] + i),
+		_mm256_loadu_ps(src[ch + 7] + i),
+	};
+
+	transpose_8x8(r);
+	_mm256_storeu_ps(p + ch, r[0]);
+	_mm256_storeu_ps(p + channels + ch, r[1]);
+	_mm256_storeu_ps(p + 2 * channels + ch, r[2]);
+	_mm256_storeu_ps(p + 3 * channels + ch, r[3]);
+	_mm256_storeu_ps(p + 4 * channels + ch, r[4]);
+	_mm256_storeu_ps(p + 5 * channels + ch, r[5]);
+	_mm256_storeu_ps(p + 6 * channels + ch, r[6]);
+	_mm256_storeu_ps(p + 7 * channels + ch, r[7]);
+}
+
+/* the channels from ch on which don't fill a whole 8x8 tile */
+TARGET("avx")
+static inline void deinterleave_rest_8(float *const *dst, const float *p,
+				       unsigned int channels, unsigned int ch,
+				       unsigned int i)
+{
+	unsigned int k;
+
+	if (ch + 4 <= channels) {
+		deinterleave_4x4(dst, p, channels, ch, i);
+		deinterleave_4x4(dst, p + 4 * channels, channels, ch, i + 4);
+		ch += 4;
+	}
+	for (; ch < channels; ch++)
+		for (k = 0; k < 8; k++)
+			dst[ch][i + k] = p[k * channels + ch];
+}
+
+TARGET("avx")
+static inline void interleave_rest_8(float *p, const float *const *src,
+				     unsigned int channels, unsigned int ch,
+				     unsigned int i)
+{
+	unsigned int k;
+
+	if (ch + 4 <= channels) {
+		interleave_4x4(p, src, channels, ch, i);
+		interleave_4x4(p + 4 * channels, src, channels, ch, i + 4);
+		ch += 4;
+	}
+	for (; ch < channels; ch++)
+		for (k = 0; k < 8; k++)
+			p[k * channels + ch] = src[ch][i + k];
+}
+
+TARGET("avx")
+static void deinterleave_2_avx(float *const *dst, const float *src,
+			       unsigned int channels, unsigned int frames)
+{
+	float *l = dst[0], *r = dst[1];
+	unsigned int i;
+
+	for (i = 0; i + 8 <= frames; i += 8) {
+		__m256 a = _mm256_loadu_ps(src + 2 * i);
+		__m256 b = _mm256_loadu_ps(src + 2 * i + 8);
+		/* frames 0 1 4 5 and 2 3 6 7, so each lane holds four frames */
+		__m256 lo = _mm256_permute2f128_ps(a, b, 0x20);
+		__m256 hi = _mm256_permute2f128_ps(a, b, 0x31);
+
+		_mm256_storeu_ps(l + i, _mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)));
+		_mm256_storeu_ps(r + i, _mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)));
+	}
+	deinterleave_part(dst, src, 2, i, frames);
+}
+
+TARGET("avx")
+static void interleave_2_avx(float *dst, const float *const *src,
+			     unsigned int channels, unsigned int frames)
+{
+	const float *l = src[0], *r = src[1];
+	unsigned int i;
+
+	for (i = 0; i + 8 <= frames; i += 8) {
+		__m256 a = _mm256_loadu_ps(l + i);
+		__m256 b = _mm256_loadu_ps(r + i);
+		__m256 lo = _mm256_unpacklo_ps(a, b);
+		__m256 hi = _mm256_unpackhi_ps(a, b);
+
+		_mm256_storeu_ps(dst + 2 * i, _mm256_permute2f128_ps(lo, hi, 0x20));
+		_mm256_storeu_ps(dst + 2 * i + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+	}
+	interleave_part(dst, src, 2, i, frames);
+}
+
+/* frame major: all channels of 8 frames, then the next 8 frames */
+TARGET("avx")
+static inline void deinterleave_tiles_avx(float *const *dst, const float *src,
+					  unsigned int channels,
+					  unsigned int frames)
+{
+	unsigned int ch, i, n = frames & ~7U;
+
+	for (i = 0; i < n; i += 8) {
+		const float *p = src + i * channels;
+
+		for (ch = 0; ch + 8 <= channels; ch += 8)
+			deinterleave_8x8(dst, p, channels, ch, i);
+		deinterleave_rest_8(dst, p, channels, ch, i);
+	}
+	deinterleave_part(dst, src, channels, n, frames);
+}
+
+TARGET("avx")
+static inline void interleave_tiles_avx(float *dst, const float *const *src,
+					unsigned int channels,
+					unsigned int frames)
+{
+	unsigned int ch, i, n = frames & ~7U;
+
+	for (i = 0; i < n; i += 8) {
+		float *p = dst + i * channels;
+
+		for (ch = 0; ch + 8 <= channels; ch += 8)
+			interleave_8x8(p, src, channels, ch, i);
+		interleave_rest_8(p, src, channels, ch, i);
+	}
+	interleave_part(dst, src, channels, n, frames);
+}
+
+TARGET("avx")
+static void deinterleave_8_avx(float *const *dst, const float *src,
+			       unsigned int channels, unsigned int frames)
+{
+	deinterleave_tiles_avx(dst, src, 8, frames);
+}
+
+TARGET("avx")
+static void interleave_8_avx(float *dst, const float *const *src,
+			     unsigned int channels, unsigned int frames)
+{
+	interleave_tiles_avx(dst, src, 8, frames);
+}
+
+TARGET("avx")
+static void deinterleave_n_avx(float *const *dst, const float *src,
+			       unsigned int channels, unsigned int frames)
+{
+	deinterleave_tiles_avx(dst, src, channels, frames);
+}
+
+TARGET("avx")
+static void interleave_n_avx(float *dst, const float *const *src,
+			     unsigned int channels, unsigned int frames)
+{
+	interleave_tiles_avx(dst, src, channels, frames);
+}
+
+/*
+ * For wide frames, walking all channels of each 8 frames touches a
+ * cache line in every plane per tile and only fills half of it.  The
+ * blocked versions go channel major over JACK_DSP_BLOCK frames instead,
+ * so the lines of a plane are completed while they are still hot, and
+ * the rows of the block stay in L1 across the channel groups.
+ */
+#define JACK_DSP_BLOCK	64
+
+TARGET("avx")
+static void deinterleave_wide_avx(float *const *dst, const float *src,
+				  unsigned int channels, unsigned int frames)
+{
+	unsigned int ch, i, b, end, n = frames & ~7U;
+
+	for (b = 0; b < n; b = end) {
+		end = b + JACK_DSP_BLOCK;
+		if (end > n)
+			end = n;
+		for (ch = 0; ch + 8 <= channels; ch += 8)
+			for (i = b; i < end; i += 8)
+				deinterleave_8x8(dst, src + i * channels,
+						 channels, ch, i);
+		for (i = b; i < end; i += 8)
+			deinterleave_rest_8(dst, src + i * channels,
+					    channels, ch, i);
+	}
+	deinterleave_part(dst, src, channels, n, frames);
+}
+
+TARGET("avx")
+static void interleave_wide_avx(float *dst, const float *const *src,
+				unsigned int channels, unsigned int frames)
+{
+	unsigned int ch, i, b, end, n = frames & ~7U;
+
+	for (b = 0; b < n; b = end) {
+		end = b + JACK_DSP_BLOCK;
+		if (end > n)
+			end = n;
+		for (ch = 0; ch + 8 <= channels; ch += 8)
+			for (i = b; i < end; i += 8)
+				interleave_8x8(dst + i * channels, src,
+					       channels, ch, i);
+		for (i = b; i < end; i += 8)
+			interleave_rest_8(dst + i * channels, src,
+					  channels, ch, i);
+	}
+	interleave_part(dst, src, channels, n, frames);
+}
+#endif /* JACK_DSP_X86 */
+
+void jack_dsp_init(struct jack_dsp *dsp)
+{
+	dsp->s16_to_float = s16_to_float_c;
+	dsp->s24_to_float = s24_to_float_c;
+	dsp->s32_to_float = s32_to_float_c;
+	dsp->float_to_s16 = float_to_s16_c;
+	dsp->float_to_s24 = float_to_s24_c;
+	dsp->float_to_s32 = float_to_s32_c;
+	dsp->deinterleave_1 = deinterleave_1;
+	dsp->deinterleave_2 = deinterleave_c;
+	dsp->deinterleave_8 = deinterleave_c;
+	dsp->deinterleave_n = deinterleave_c;
+	dsp->deinterleave_wide = deinterleave_c;
+	dsp->interleave_1 = interleave_1;
+	dsp->interleave_2 = interleave_c;
+	dsp->interleave_8 = interleave_c;
+	dsp->interleave_n = interleave_c;
+	dsp->interleave_wide = interleave_c;
+
+#ifdef JACK_DSP_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		dsp->s16_to_float = s16_to_float_sse2;
+		dsp->s24_to_float = s24_to_float_sse2;
+		dsp->s32_to_float = s32_to_float_sse2;
+		dsp->float_to_s16 = float_to_s16_sse2;
+		dsp->float_to_s24 = float_to_s24_sse2;
+		dsp->float_to_s32 = float_to_s32_sse2;
+		dsp->deinterleave_2 = deinterleave_2_sse2;
+		dsp->deinterleave_8 = deinterleave_8_sse2;
+		dsp->deinterleave_n = deinterleave_n_sse2;
+		dsp->deinterleave_wide = deinterleave_n_sse2;
+		dsp->interleave_2 = interleave_2_sse2;
+		dsp->interleave_8 = interleave_8_sse2;
+		dsp->interleave_n = interleave_n_sse2;
+		dsp->interleave_wide = interleave_n_sse2;
+	}
+	if (__builtin_cpu_supports("avx")) {
+		dsp->deinterleave_2 = deinterleave_2_avx;
+		dsp->deinterleave_8 = deinterleave_8_avx;
+		dsp->deinterleave_n = deinterleave_n_avx;
+		dsp->deinterleave_wide = deinterleave_wide_avx;
+		dsp->interleave_2 = interleave_2_avx;
+		dsp->interleave_8 = interleave_8_avx;
+		dsp->interleave_n = interleave_n_avx;
+		dsp->interleave_wide = interleave_wide_avx;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		dsp->s16_to_float = s16_to_float_avx2;
+		dsp->s24_to_float = s24_to_float_avx2;
+		dsp->s32_to_float = s32_to_float_avx2;
+		dsp->float_to_s16 = float_to_s16_avx2;
+		dsp->float_to_s24 = float_to_s24_avx2;
+		dsp->float_to_s32 = float_to_s32_avx2;
+	}
+#endif
+}
+
+jack_deinterleave_t jack_dsp_deinterleave(const struct jack_dsp *dsp,
+					  unsigned int channels)
+{
+	switch (channels) {
+	case 1:
+		return dsp->deinterleave_1;
+	case 2:
+		return dsp->deinterleave_2;
+	case 8:
+		return dsp->deinterleave_8;
+	}
+	if (channels >= JACK_DSP_WIDE_CHANNELS)
+		return dsp->deinterleave_wide;
+	return dsp->deinterleave_n;
+}
+
+jack_interleave_t jack_dsp_interleave(const struct jack_dsp *dsp,
+				      unsigned int channels)
+{
+	switch (channels) {
+	case 1:
+		return dsp->interleave_1;
+	case 2:
+		return dsp->interleave_2;
+	case 8:
+		return dsp->interleave_8;
+	}
+	if (channels >= JACK_DSP_WIDE_CHANNELS)
+		return dsp->interleave_wide;
+	return dsp->interleave_n;
+}
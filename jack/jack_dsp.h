@@ -0,0 +1,78 @@
+/*
+ * JACK plugin - sample conversion kernels
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __JACK_DSP_H
+#define __JACK_DSP_H
+
+/*
+ * Convert the given number of native endian integer samples to float
+ * in [-1, 1).  S24 samples sit in the low three bytes of 32bit words;
+ * the top byte is ignored.
+ */
+typedef void (*jack_to_float_t)(float *dst, const void *src,
+				unsigned int samples);
+
+/* the reverse, clipping to the range of the integer format */
+typedef void (*jack_from_float_t)(void *dst, const float *src,
+				  unsigned int samples);
+
+/*
+ * Split interleaved frames of the given number of channels into the
+ * planes dst[0..channels-1].
+ */
+typedef void (*jack_deinterleave_t)(float *const *dst, const float *src,
+				    unsigned int channels,
+				    unsigned int frames);
+
+/* the reverse, merging planes into interleaved frames */
+typedef void (*jack_interleave_t)(float *dst, const float *const *src,
+				  unsigned int channels, unsigned int frames);
+
+/* channel counts from which the cache blocked (de)interleave is used */
+#define JACK_DSP_WIDE_CHANNELS	16
+
+struct jack_dsp {
+	jack_to_float_t s16_to_float;
+	jack_to_float_t s24_to_float;
+	jack_to_float_t s32_to_float;
+	jack_from_float_t float_to_s16;
+	jack_from_float_t float_to_s24;
+	jack_from_float_t float_to_s32;
+	/* for 1, 2 and 8 channels, any number, and wide frames */
+	jack_deinterleave_t deinterleave_1;
+	jack_deinterleave_t deinterleave_2;
+	jack_deinterleave_t deinterleave_8;
+	jack_deinterleave_t deinterleave_n;
+	jack_deinterleave_t deinterleave_wide;
+	jack_interleave_t interleave_1;
+	jack_interleave_t interleave_2;
+	jack_interleave_t interleave_8;
+	jack_interleave_t interleave_n;
+	jack_interleave_t interleave_wide;
+};
+
+/* pick the fastest implementations for the running CPU */
+void jack_dsp_init(struct jack_dsp *dsp);
+
+/* the (de)interleave kernel to use for the given number of channels */
+jack_deinterleave_t jack_dsp_deinterleave(const struct jack_dsp *dsp,
+					  unsigned int channels);
+jack_interleave_t jack_dsp_interleave(const struct jack_dsp *dsp,
+				      unsigned int channels);
+
+#endif /* __JACK_DSP_H */
@@ -0,0 +1,261 @@
+/*
+ * JACK plugin - polyphase resampler
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jack_resample.h"
+
+/*
+ * The filter bank has PHASES + 1 rows of taps for fractional positions
+ * 0, 1/PHASES, ..., 1; coefficients in between are interpolated
+ * linearly, which allows any ratio.  Downsampling lowers the cutoff and
+ * widens the filter accordingly.
+ */
+#define PHASES		128
+#define BASE_TAPS	64
+#define MAX_TAPS	256
+#define KAISER_BETA	8.6	/* about 90dB stopband */
+#define CUTOFF		0.91	/* of the lower Nyquist frequency */
+
+struct jack_resampler {
+	unsigned int channels;
+	unsigned int taps;
+	unsigned int cap;	/* frames per channel buffer */
+	unsigned int fill;	/* frames in the buffers */
+	double nominal;		/* input frames per output frame */
+	double step;		/* nominal, trimmed */
+	double pos;		/* of the next output frame in the buffers */
+	float *coefs;		/* (PHASES + 1) * taps */
+	float *kern;		/* taps for the current output frame */
+	float *mem;
+	float **buf;
+	float **in;		/* buf + fill */
+};
+
+static double bessel_i0(double x)
+{
+	double sum = 1.0, term = 1.0;
+	unsigned int k;
+
+	for (k = 1; k < 32; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+static void design(struct jack_resampler *r, double cutoff)
+{
+	const double half = r->taps / 2;
+	const double norm = bessel_i0(KAISER_BETA);
+	unsigned int p, k;
+
+	for (p = 0; p <= PHASES; p++) {
+		float *h = r->coefs + p * r->taps;
+		double sum = 0;
+
+		/* the output frame sits between taps half - 1 and half */
+		for (k = 0; k < r->taps; k++) {
+			double d = k - (half - 1) - (double)p / PHASES;
+			double x = d / half, v = cutoff;
+
+			if (d != 0)
+				v = sin(M_PI * cutoff * d) / (M_PI * d);
+			v *= x * x < 1 ?
+				bessel_i0(KAISER_BETA * sqrt(1 - x * x)) / norm : 0;
+			h[k] = v;
+			sum += v;
+		}
+		/* unity gain at DC for every phase */
+		for (k = 0; k < r->taps; k++)
+			h[k] /= sum;
+	}
+}
+
+struct jack_resampler *jack_resampler_new(unsigned int channels,
+					  unsigned int in_rate,
+					  unsigned int out_rate,
+					  unsigned int max_in)
+{
+	struct jack_resampler *r;
+	double ratio = (double)in_rate / out_rate;
+	unsigned int ch, taps;
+
+	taps = BASE_TAPS * (ratio > 1 ? (unsigned int)ceil(ratio) : 1);
+	if (taps > MAX_TAPS)
+		taps = MAX_TAPS;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	r->channels = channels;
+	r->taps = taps;
+	r->cap = taps + max_in + 1;
+	r->nominal = ratio;
+	r->coefs = malloc((PHASES + 1) * taps * sizeof(float));
+	r->kern = malloc(taps * sizeof(float));
+	r->mem = malloc((size_t)channels * r->cap * sizeof(float));
+	r->buf = calloc(channels, sizeof(float *));
+	r->in = calloc(channels, sizeof(float *));
+	if (!r->coefs || !r->kern || !r->mem || !r->buf || !r->in) {
+		jack_resampler_free(r);
+		return NULL;
+	}
+	for (ch = 0; ch < channels; ch++)
+		r->buf[ch] = r->mem + ch * r->cap;
+	design(r, ratio > 1 ? CUTOFF / ratio : CUTOFF);
+	jack_resampler_reset(r);
+	return r;
+}
+
+void jack_resampler_free(struct jack_resampler *r)
+{
+	if (!r)
+		return;
+	free(r->coefs);
+	free(r->kern);
+	free(r->mem);
+	free(r->buf);
+	free(r->in);
+	free(r);
+}
+
+void jack_resampler_reset(struct jack_resampler *r)
+{
+	unsigned int ch;
+
+	/* the first input frame ends up in the middle of the filter */
+	r->fill = r->taps / 2 - 1;
+	for (ch = 0; ch < r->channels; ch++)
+		memset(r->buf[ch], 0, r->fill * sizeof(float));
+	r->pos = 0;
+	r->step = r->nominal;
+}
+
+void jack_resampler_adjust(struct jack_resampler *r, double adjust)
+{
+	r->step = r->nominal * adjust;
+}
+
+/*
+ * Both walk the positions the same way jack_resampler_read() does, so
+ * they agree with it to the last bit.
+ */
+unsigned int jack_resampler_input_for(const struct jack_resampler *r,
+				      unsigned int out)
+{
+	double pos = r->pos;
+	unsigned int need;
+
+	if (!out)
+		return 0;
+	while (--out)
+		pos += r->step;
+	need = (unsigned int)pos + r->taps;
+	return need > r->fill ? need - r->fill : 0;
+}
+
+unsigned int jack_resampler_output_for(const struct jack_resampler *r,
+				       unsigned int in)
+{
+	const unsigned int fill = r->fill + in;
+	double pos = r->pos;
+	unsigned int n = 0;
+
+	while ((unsigned int)pos + r->taps <= fill) {
+		pos += r->step;
+		n++;
+	}
+	return n;
+}
+
+float *const *jack_resampler_in(struct jack_resampler *r)
+{
+	unsigned int ch;
+
+	for (ch = 0; ch < r->channels; ch++)
+		r->in[ch] = r->buf[ch] + r->fill;
+	return r->in;
+}
+
+void jack_resampler_commit(struct jack_resampler *r, unsigned int frames)
+{
+	r->fill += frames;
+}
+
+static inline float dot(const float *x, const float *h, unsigned int taps)
+{
+	float a0 = 0, a1 = 0, a2 = 0, a3 = 0;
+	unsigned int k;
+
+	/* four sums, so that the compiler may keep them in one vector */
+	for (k = 0; k < taps; k += 4) {
+		a0 += x[k] * h[k];
+		a1 += x[k + 1] * h[k + 1];
+		a2 += x[k + 2] * h[k + 2];
+		a3 += x[k + 3] * h[k + 3];
+	}
+	return (a0 + a1) + (a2 + a3);
+}
+
+void jack_resampler_read(struct jack_resampler *r, float *const *out,
+			 unsigned int frames)
+{
+	const unsigned int taps = r->taps;
+	unsigned int n, k, ch, used;
+
+	for (n = 0; n < frames; n++) {
+		const unsigned int i = (unsigned int)r->pos;
+		const double phase = (r->pos - i) * PHASES;
+		const unsigned int p = (unsigned int)phase;
+		const float a = phase - p;
+		const float *h0 = r->coefs + p * taps;
+		const float *h1 = h0 + taps;
+
+		for (k = 0; k < taps; k++)
+			r->kern[k] = h0[k] + a * (h1[k] - h0[k]);
+		for (ch = 0; ch < r->channels; ch++)
+			out[ch][n] = dot(r->buf[ch] + i, r->kern, taps);
+		r->pos += r->step;
+	}
+
+	/* drop what no later output frame looks at */
+	used = (unsigned int)r->pos;
+	if (used > r->fill)
+		used = r->fill;
+	if (used) {
+		for (ch = 0; ch < r->channels; ch++)
+			memmove(r->buf[ch], r->buf[ch] + used,
+				(r->fill - used) * sizeof(float));
+		r->fill -= used;
+		r->pos -= used;
+	}
+}
+
+unsigned int jack_resampler_tail(const struct jack_resampler *r)
+{
+	return r->taps / 2 + 1;
+}
+
+double jack_resampler_delay(const struct jack_resampler *r)
+{
+	double delay = r->fill - (r->pos + r->taps / 2 - 1);
+
+	return delay > 0 ? delay : 0;
+}
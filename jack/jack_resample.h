@@ -0,0 +1,67 @@
+/*
+ * JACK plugin - polyphase resampler
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __JACK_RESAMPLE_H
+#define __JACK_RESAMPLE_H
+
+/*
+ * Windowed sinc resampler for planar float samples with a ratio that
+ * can be trimmed while running.  Input is written into the resampler's
+ * own buffer, output is read out on demand; nothing but the creation
+ * allocates, so all other calls are realtime safe.
+ */
+struct jack_resampler;
+
+/* max_in is the largest number of frames written at once */
+struct jack_resampler *jack_resampler_new(unsigned int channels,
+					  unsigned int in_rate,
+					  unsigned int out_rate,
+					  unsigned int max_in);
+void jack_resampler_free(struct jack_resampler *r);
+
+/* back to the initial state, with the nominal ratio */
+void jack_resampler_reset(struct jack_resampler *r);
+
+/* run at the nominal ratio times adjust, which is close to 1 */
+void jack_resampler_adjust(struct jack_resampler *r, double adjust);
+
+/* input frames to write before out frames can be read */
+unsigned int jack_resampler_input_for(const struct jack_resampler *r,
+				      unsigned int out);
+/* output frames that can be read after writing in more frames */
+unsigned int jack_resampler_output_for(const struct jack_resampler *r,
+				       unsigned int in);
+
+/*
+ * Planes to write the next frames to, followed by committing them;
+ * at most max_in frames at a time.
+ */
+float *const *jack_resampler_in(struct jack_resampler *r);
+void jack_resampler_commit(struct jack_resampler *r, unsigned int frames);
+
+/* read out frames; they must be available (see above) */
+void jack_resampler_read(struct jack_resampler *r, float *const *out,
+			 unsigned int frames);
+
+/* input frames of silence that carry all written frames to the output */
+unsigned int jack_resampler_tail(const struct jack_resampler *r);
+
+/* input frames written but not yet fully turned into output */
+double jack_resampler_delay(const struct jack_resampler *r);
+
+#endif /* __JACK_RESAMPLE_H */
@@ -0,0 +1,110 @@
+/*
+ * JACK plugin - runtime statistics
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include "jack_stats.h"
+
+/* callback durations in the ring, in usecs */
+struct jack_stats_times {
+	unsigned int count;
+	double min, p50, p99, max;
+};
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* the last min(cycles, RING) durations; they may be overwritten meanwhile */
+static void jack_stats_times(const struct jack_stats *stats,
+			     struct jack_stats_times *t)
+{
+	unsigned long long cycles =
+		atomic_load_explicit(&stats->cycles, memory_order_acquire);
+	unsigned int i, n;
+	uint32_t *ns;
+
+	n = cycles < JACK_STATS_RING ? cycles : JACK_STATS_RING;
+	ns = n ? malloc(n * sizeof(*ns)) : NULL;
+	if (!ns)
+		n = 0;
+	t->count = n;
+	if (!n) {
+		t->min = t->p50 = t->p99 = t->max = 0;
+		return;
+	}
+	for (i = 0; i < n; i++)
+		ns[i] = atomic_load_explicit(&stats->ns[(cycles - 1 - i) %
+							JACK_STATS_RING],
+					     memory_order_relaxed);
+	qsort(ns, n, sizeof(ns[0]), cmp_u32);
+	t->min = ns[0] / 1000.0;
+	t->p50 = ns[n / 2] / 1000.0;
+	t->p99 = ns[n - 1 - n / 100] / 1000.0;
+	t->max = ns[n - 1] / 1000.0;
+	free(ns);
+}
+
+static void jack_stats_read(const struct jack_stats *stats,
+			    struct jack_stats_snap *snap)
+{
+	snap->cycles = atomic_load(&stats->cycles);
+	snap->starved = atomic_load(&stats->starved);
+	snap->fifo_late = atomic_load(&stats->fifo_late);
+	snap->not_running = atomic_load(&stats->not_running);
+}
+
+void jack_stats_dump(const struct jack_stats *stats, snd_output_t *out)
+{
+	struct jack_stats_snap snap;
+	struct jack_stats_times t;
+
+	jack_stats_read(stats, &snap);
+	jack_stats_times(stats, &t);
+	snd_output_printf(out, "  %-13s: %llu\n", "cycles", snap.cycles);
+	snd_output_printf(out, "  %-13s: %llu\n", "starved", snap.starved);
+	snd_output_printf(out, "  %-13s: %llu\n", "fifo_late",
+			  snap.fifo_late);
+	snd_output_printf(out, "  %-13s: %llu\n", "not_running",
+			  snap.not_running);
+	snd_output_printf(out, "  %-13s: %llu\n", "cb_max_us",
+			  atomic_load(&stats->max_ns) / 1000);
+	snd_output_printf(out, "  callback time of the last %u cycles:\n",
+			  t.count);
+	snd_output_printf(out, "    min %.1f us, median %.1f us, 99%% %.1f us, max %.1f us\n",
+			  t.min, t.p50, t.p99, t.max);
+}
+
+void jack_stats_summary(const struct jack_stats *stats,
+			struct jack_stats_snap *prev, const char *name,
+			FILE *fp)
+{
+	struct jack_stats_snap snap;
+	struct jack_stats_times t;
+
+	jack_stats_read(stats, &snap);
+	jack_stats_times(stats, &t);
+	fprintf(fp, "%s: %llu cycles, callback median %.1f us, 99%% %.1f us, max %.1f us; under-filled: %llu starved, %llu fifo late, %llu not running\n",
+		name, snap.cycles - prev->cycles, t.p50, t.p99, t.max,
+		snap.starved - prev->starved,
+		snap.fifo_late - prev->fifo_late,
+		snap.not_running - prev->not_running);
+	*prev = snap;
+}
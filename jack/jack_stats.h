@@ -0,0 +1,93 @@
+/*
+ * JACK plugin - runtime statistics
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __JACK_STATS_H
+#define __JACK_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <alsa/asoundlib.h>
+
+/* process callback durations kept, a power of two */
+#define JACK_STATS_RING		1024
+
+/*
+ * Written only by the JACK thread, without locks or retries, so the
+ * recording is wait-free.  A reader sees consistent values per field
+ * but not necessarily a consistent set of them.
+ */
+struct jack_stats {
+	atomic_ullong cycles;		/* timed process callbacks */
+	atomic_ullong max_ns;
+	/* under-filled cycles by cause */
+	atomic_ullong starved;		/* application behind */
+	atomic_ullong fifo_late;	/* FIFO thread behind */
+	atomic_ullong not_running;	/* stopped, reconfigured or xrun */
+	_Atomic uint32_t ns[JACK_STATS_RING];	/* by cycles % RING */
+};
+
+/* counters as of some time, for the differences in summaries */
+struct jack_stats_snap {
+	unsigned long long cycles;
+	unsigned long long starved;
+	unsigned long long fifo_late;
+	unsigned long long not_running;
+};
+
+void jack_stats_dump(const struct jack_stats *stats, snd_output_t *out);
+/* one line about what happened since *prev, which is updated */
+void jack_stats_summary(const struct jack_stats *stats,
+			struct jack_stats_snap *prev, const char *name,
+			FILE *fp);
+
+static inline uint64_t jack_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* account a process callback started at the given time */
+static inline void jack_stats_cycle(struct jack_stats *stats, uint64_t start)
+{
+	uint64_t ns = jack_stats_now() - start;
+	unsigned long long n =
+		atomic_load_explicit(&stats->cycles, memory_order_relaxed);
+
+	if (ns > UINT32_MAX)
+		ns = UINT32_MAX;
+	atomic_store_explicit(&stats->ns[n % JACK_STATS_RING], ns,
+			      memory_order_relaxed);
+	if (ns > atomic_load_explicit(&stats->max_ns, memory_order_relaxed))
+		atomic_store_explicit(&stats->max_ns, ns,
+				      memory_order_relaxed);
+	atomic_store_explicit(&stats->cycles, n + 1, memory_order_release);
+}
+
+static inline void jack_stats_inc(atomic_ullong *counter)
+{
+	atomic_store_explicit(counter,
+			      atomic_load_explicit(counter,
+						   memory_order_relaxed) + 1,
+			      memory_order_relaxed);
+}
+
+#endif /* __JACK_STATS_H */
@@ -22,17 +22,43 @@
 
 #define _GNU_SOURCE
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <errno.h>
+#include <sched.h>
+#include <unistd.h>
 #include <sys/shm.h>
 #include <sys/types.h>
-#include <sys/socket.h>
+#include <sys/eventfd.h>
 #include <jack/jack.h>
 #include <alsa/asoundlib.h>
 #include <alsa/pcm_external.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include "jack_dsp.h"
+#include "jack_resample.h"
+#include "jack_stats.h"
 
 #define MAX_PERIODS_MULTIPLE 64
 
+/* frames converted per step through the scratch buffer */
+#define JACK_CONV_FRAMES 256
+
+/* application rates accepted with resampling */
+#define JACK_RESAMPLE_MIN_RATE	8000
+#define JACK_RESAMPLE_MAX_RATE	192000
+
+/*
+ * Ratio control for resampling: the fill of the application side is
+ * smoothed over RC_TAU seconds and held where it settled after
+ * RC_SETTLE seconds by a PI controller working on the deviation in
+ * seconds.  The ratio is never trimmed by more than RC_MAX.
+ */
+#define RC_TAU		0.5
+#define RC_SETTLE	1.0
+#define RC_KP		0.1
+#define RC_KI		0.0025
+#define RC_MAX		0.005
+
 typedef struct snd_pcm_jack_port_list {
 	struct snd_pcm_jack_port_list *next;
 	/* will always be allocated with size of the string.
@@ -41,29 +67,127 @@ typedef struct snd_pcm_jack_port_list {
 	char name[0];
 } snd_pcm_jack_port_list_t;
 
+/*
+ * All jack PCMs of a process with the same client name share one JACK
+ * client.  Its process callback runs the streams in the array, which is
+ * replaced as a whole under lock and freed once the callback is done
+ * with it.
+ */
+typedef struct snd_pcm_jack_client {
+	struct snd_pcm_jack_client *next;
+	char *name;
+	jack_client_t *client;
+	unsigned int refs;		/* under snd_pcm_jack_clients_lock */
+	int activated;			/* ditto */
+	pthread_mutex_t lock;		/* for replacing streams */
+	/* port numbers taken, per stream direction, under lock */
+	unsigned char *port_used[2];
+	unsigned int port_slots[2];
+	_Atomic(snd_pcm_ioplug_t **) streams;	/* NULL terminated */
+	atomic_uint cycle;		/* odd while the process callback runs */
+
+	/* connects ports without blocking prepare, under helper_lock */
+	pthread_t helper;
+	pthread_mutex_t helper_lock;
+	pthread_cond_t helper_cond;
+	snd_pcm_ioplug_t *connect_queue;
+	snd_pcm_ioplug_t *connecting;	/* taken off the queue */
+	int helper_quit;
+} snd_pcm_jack_client_t;
+
 typedef struct {
 	snd_pcm_ioplug_t io;
 
-	int fd;
-	int activated;		/* jack is activated? */
-	pthread_mutex_t running_mutex;
-	int running;		/* jack is running? */
+	snd_pcm_jack_client_t *shared;
+	int activated;		/* served by the process callback? */
+	snd_pcm_ioplug_t *connect_next;	/* in shared->connect_queue */
+	int connect_queued;
 
 	snd_pcm_jack_port_list_t **port_names;
 	unsigned int num_ports;
 	snd_pcm_uframes_t boundary;
-	snd_pcm_uframes_t hw_ptr;
-	unsigned int sample_bits;
-	snd_pcm_uframes_t min_avail;
 	int use_period_alignment;
 
-	snd_pcm_channel_area_t *areas;
+	float **port_bufs;		/* of the current process cycle */
+
+	/* integer formats are converted to and from float in the callback */
+	struct jack_dsp dsp;
+	jack_to_float_t to_float;	/* NULL for FLOAT */
+	jack_from_float_t from_float;
+	jack_deinterleave_t deinterleave;	/* for the channel count */
+	jack_interleave_t interleave;
+	int interleaved;
+	const snd_pcm_channel_area_t *ring;	/* mmap buffer or rw_areas */
+	/* with RW access the plugin keeps the ring, transfer copies it */
+	char *rw_mem;
+	size_t rw_bytes;
+	snd_pcm_channel_area_t *rw_areas;	/* interleaved in rw_mem */
+	float **bufs;
+	float *scratch;
+
+	/*
+	 * Decoupling FIFO for extra_latency: the JACK thread only moves
+	 * frames between the ports and the FIFO, and a helper thread
+	 * between the FIFO and the ALSA ring, taking over the role of
+	 * the JACK thread towards alsa-lib.  Head and tail count frames.
+	 */
+	snd_pcm_uframes_t extra_latency;
+	snd_pcm_uframes_t fifo_size;	/* frames per channel, 0 if unused */
+	float *fifo_mem;
+	float **fifo;			/* channel planes in fifo_mem */
+	_Atomic unsigned long fifo_head;	/* moved by the producer */
+	_Atomic unsigned long fifo_tail;	/* moved by the consumer */
+	pthread_t fifo_thread;
+	int fifo_thread_started;
+	pthread_mutex_t fifo_mutex;	/* held while the FIFO is serviced */
+	sem_t fifo_sem;			/* JACK thread -> FIFO thread */
+	atomic_bool fifo_kicked;	/* fifo_sem is posted */
+	atomic_bool fifo_quit;
+
+	/* resampling between the application and the JACK rate */
+	int resample;			/* allowed by the config */
+	unsigned int jack_rate;
+	struct jack_resampler *resampler;	/* NULL at the JACK rate */
+	unsigned int resampler_rate;	/* io->rate it was made for */
+	float **rs_planes;		/* into the port buffers */
+	float *rs_mem;			/* capture output */
+	float **rs_out;			/* planes in rs_mem */
+	atomic_uint rs_delay;		/* in the resampler, app frames */
+	atomic_int rs_flush;		/* silence still to push, -1 if not begun */
+	/* ratio control, JACK thread only */
+	double rc_fill;
+	double rc_target;
+	double rc_integral;
+	unsigned int rc_settle;		/* cycles until rc_target is set */
 
 	jack_port_t **ports;
+	int *port_nums;			/* in the port names, -1 if none */
 	jack_client_t *client;
 
+	/* ALSA thread -> JACK thread */
+	atomic_bool running;		/* jack is running? */
+	_Atomic snd_pcm_uframes_t appl_ptr;	/* snapshot of io->appl_ptr */
+	_Atomic snd_pcm_uframes_t min_avail;
+	atomic_bool waiter;		/* poll_fd was drained, wake us up */
+	atomic_bool draining;		/* play out what is left, then go quiet */
+
 	/* JACK thread -> ALSA thread */
-	bool xrun_detected;
+	_Atomic snd_pcm_uframes_t hw_ptr;
+	atomic_bool xrun_detected;
+	atomic_uint cycle;		/* odd while the process callback runs */
+
+	/* for the delay: where the graph is and when frames last moved */
+	atomic_uint graph_latency;	/* of the connected ports, in frames */
+	atomic_uint cycle_frames;	/* nframes of that cycle, 0 if none */
+	atomic_uint cycle_start;	/* frame time of that cycle */
+
+	struct jack_stats stats;	/* recorded by the JACK thread */
+	unsigned int stats_interval;	/* secs between summaries, 0 if none */
+	pthread_t stats_thread;
+	int stats_thread_started;
+	pthread_mutex_t stats_lock;	/* for stats_quit */
+	pthread_cond_t stats_cond;
+	int stats_quit;
 } snd_pcm_jack_t;
 
 /* snd_pcm_ioplug_avail() was introduced after alsa-lib 1.1.6 */
@@ -99,53 +223,558 @@ static int snd_pcm_jack_port_list_add(snd_pcm_jack_t *jack,
 	return 0;
 }
 
+/*
+ * The JACK thread never looks at io->appl_ptr directly; the ALSA thread
+ * publishes a copy whenever it has moved the pointer and the ring data
+ * behind it is complete.
+ */
+static void snd_pcm_jack_sync_appl(snd_pcm_jack_t *jack,
+				   snd_pcm_uframes_t appl_ptr)
+{
+	atomic_store_explicit(&jack->appl_ptr, appl_ptr, memory_order_release);
+}
+
+static bool snd_pcm_jack_rw_access(snd_pcm_ioplug_t *io)
+{
+	return io->access == SND_PCM_ACCESS_RW_INTERLEAVED ||
+	       io->access == SND_PCM_ACCESS_RW_NONINTERLEAVED;
+}
+
+static snd_pcm_uframes_t snd_pcm_jack_hw_ptr(snd_pcm_jack_t *jack)
+{
+	return atomic_load_explicit(&jack->hw_ptr, memory_order_acquire);
+}
+
+/*
+ * Wait until a process cycle that may still have seen the old running
+ * state is over.  Called from the ALSA thread after clearing running;
+ * the sequentially consistent accesses on both sides make sure that
+ * either the callback sees running cleared or we see its cycle count odd.
+ */
+static void snd_pcm_jack_sync_cycle(snd_pcm_jack_t *jack)
+{
+	unsigned int cycle = atomic_load(&jack->cycle);
+
+	if (!(cycle & 1))
+		return;
+	while (atomic_load(&jack->cycle) == cycle)
+		sched_yield();
+}
+
+/* frames in the FIFO */
+static snd_pcm_uframes_t snd_pcm_jack_fifo_fill(snd_pcm_jack_t *jack)
+{
+	return atomic_load_explicit(&jack->fifo_head, memory_order_acquire) -
+		atomic_load_explicit(&jack->fifo_tail, memory_order_acquire);
+}
+
+/* there are frames to move from or room in the ring */
+static bool snd_pcm_jack_ring_ready(snd_pcm_ioplug_t *io)
+{
+	snd_pcm_jack_t *jack = io->private_data;
+	snd_pcm_uframes_t hw_ptr = snd_pcm_jack_hw_ptr(jack);
+	snd_pcm_uframes_t appl_ptr =
+		atomic_load_explicit(&jack->appl_ptr, memory_order_acquire);
+
+	if (io->stream == SND_PCM_STREAM_PLAYBACK)
+		return snd_pcm_ioplug_hw_avail(io, hw_ptr, appl_ptr) > 0;
+	return snd_pcm_ioplug_avail(io, hw_ptr, appl_ptr) < io->buffer_size;
+}
+
+/*
+ * The FIFO is down to half on playback, or up to half on capture, and
+ * the FIFO thread could do something about it.
+ */
+static bool snd_pcm_jack_fifo_wants_service(snd_pcm_ioplug_t *io)
+{
+	snd_pcm_jack_t *jack = io->private_data;
+	snd_pcm_uframes_t fill = snd_pcm_jack_fifo_fill(jack);
+
+	if (io->stream == SND_PCM_STREAM_PLAYBACK ?
+	    fill > jack->fifo_size / 2 : fill < jack->fifo_size / 2)
+		return false;
+	return snd_pcm_jack_ring_ready(io);
+}
+
+/* make poll_fd readable */
+static void pcm_poll_wakeup(snd_pcm_ioplug_t *io)
+{
+	static const uint64_t val = 1;
+
+	write(io->poll_fd, &val, sizeof(val));
+}
+
+/*
+ * poll_fd is an eventfd which stays readable while the PCM is ready.
+ * Once the application finds it blocked, the fd is drained and the
+ * waiter flag is armed; the JACK thread then signals the fd exactly
+ * once when enough frames are available again.
+ */
 static int pcm_poll_block_check(snd_pcm_ioplug_t *io)
 {
-	static char buf[32];
-	snd_pcm_uframes_t avail;
+	uint64_t val;
+	snd_pcm_uframes_t avail, min_avail;
 	snd_pcm_jack_t *jack = io->private_data;
 
+	/* let the application find the xrun */
+	if (atomic_load_explicit(&jack->xrun_detected, memory_order_relaxed))
+		return 0;
+
 	if (io->state == SND_PCM_STATE_RUNNING ||
 	    io->state == SND_PCM_STATE_DRAINING ||
 	    (io->state == SND_PCM_STATE_PREPARED && io->stream == SND_PCM_STREAM_CAPTURE)) {
-		avail = snd_pcm_ioplug_avail(io, jack->hw_ptr, io->appl_ptr);
-		if (avail < jack->min_avail) {
-			while (read(io->poll_fd, &buf, sizeof(buf)) == sizeof(buf))
-				;
-			return 1;
+		min_avail = atomic_load_explicit(&jack->min_avail,
+						 memory_order_relaxed);
+		avail = snd_pcm_ioplug_avail(io, snd_pcm_jack_hw_ptr(jack),
+					     io->appl_ptr);
+		if (avail < min_avail) {
+			read(io->poll_fd, &val, sizeof(val));
+			atomic_store_explicit(&jack->waiter, true,
+					      memory_order_relaxed);
+			/* pairs with the fence in pcm_poll_unblock_check():
+			 * either we see the new hw_ptr here, or the JACK
+			 * thread sees the waiter flag
+			 */
+			atomic_thread_fence(memory_order_seq_cst);
+			avail = snd_pcm_ioplug_avail(io, snd_pcm_jack_hw_ptr(jack),
+						     io->appl_ptr);
+			if (avail < min_avail &&
+			    !atomic_load_explicit(&jack->xrun_detected,
+						  memory_order_relaxed))
+				return 1;
+			if (atomic_exchange(&jack->waiter, false))
+				pcm_poll_wakeup(io);
 		}
 	}
 
 	return 0;
 }
 
+/*
+ * Called from the JACK thread (or the FIFO thread), so only the
+ * published pointers are used.  Nothing is written unless the
+ * application has armed a wait.
+ */
 static int pcm_poll_unblock_check(snd_pcm_ioplug_t *io)
 {
-	static char buf[1];
 	snd_pcm_uframes_t avail;
 	snd_pcm_jack_t *jack = io->private_data;
 
-	avail = snd_pcm_ioplug_avail(io, jack->hw_ptr, io->appl_ptr);
-	/* In draining state poll_fd is used to wait
-	 * till all pending frames are played.
-	 * Therefore it has to be guarantee that a poll event is also generated
-	 * if the buffer contains less than min_avail frames
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!atomic_load_explicit(&jack->waiter, memory_order_relaxed))
+		return 0;
+
+	avail = snd_pcm_ioplug_avail(io,
+				     atomic_load_explicit(&jack->hw_ptr,
+							  memory_order_acquire),
+				     atomic_load_explicit(&jack->appl_ptr,
+							  memory_order_acquire));
+	/* In draining state poll_fd is used to wait till all pending
+	 * frames are played.  No extra check of the state is needed for
+	 * that: avail only grows while draining and reaches the buffer
+	 * size, which is never below min_avail, once everything is played.
 	 */
-	if (avail >= jack->min_avail || io->state == SND_PCM_STATE_DRAINING) {
-		write(jack->fd, &buf, 1);
+	if (avail >= atomic_load_explicit(&jack->min_avail,
+					  memory_order_relaxed) ||
+	    atomic_load_explicit(&jack->xrun_detected, memory_order_relaxed)) {
+		if (atomic_exchange(&jack->waiter, false))
+			pcm_poll_wakeup(io);
 		return 1;
 	}
 
 	return 0;
 }
 
+static int snd_pcm_jack_process_cb(jack_nframes_t nframes,
+				   snd_pcm_ioplug_t *io);
+static void snd_pcm_jack_latency_cb(jack_latency_callback_mode_t mode,
+				    snd_pcm_ioplug_t *io);
+
+static pthread_mutex_t snd_pcm_jack_clients_lock = PTHREAD_MUTEX_INITIALIZER;
+static snd_pcm_jack_client_t *snd_pcm_jack_clients;
+
+static int snd_pcm_jack_client_process(jack_nframes_t nframes,
+				       snd_pcm_jack_client_t *shared)
+{
+	snd_pcm_ioplug_t **io;
+
+	/* sequentially consistent, pairs with snd_pcm_jack_client_update() */
+	atomic_fetch_add(&shared->cycle, 1);
+	io = atomic_load(&shared->streams);
+	for (; io && *io; io++)
+		snd_pcm_jack_process_cb(nframes, *io);
+	atomic_fetch_add_explicit(&shared->cycle, 1, memory_order_release);
+	return 0;
+}
+
+static void snd_pcm_jack_client_latency(jack_latency_callback_mode_t mode,
+					snd_pcm_jack_client_t *shared)
+{
+	snd_pcm_ioplug_t **io;
+
+	pthread_mutex_lock(&shared->lock);
+	io = atomic_load_explicit(&shared->streams, memory_order_relaxed);
+	for (; io && *io; io++)
+		snd_pcm_jack_latency_cb(mode, *io);
+	pthread_mutex_unlock(&shared->lock);
+}
+
+/* make the configured connections that are missing */
+static void snd_pcm_jack_connect_ports(snd_pcm_jack_t *jack)
+{
+	snd_pcm_ioplug_t *io = &jack->io;
+	unsigned int i;
+
+	for (i = 0; i < io->channels && i < jack->num_ports; i++) {
+		const char * const own_port = jack_port_name(jack->ports[i]);
+		snd_pcm_jack_port_list_t *port_elem;
+
+		for (port_elem = jack->port_names[i]; port_elem != NULL;
+		     port_elem = port_elem->next) {
+			const char *src, *dst;
+
+			if (jack_port_connected_to(jack->ports[i],
+						   port_elem->name))
+				continue;
+			if (io->stream == SND_PCM_STREAM_PLAYBACK) {
+				src = own_port;
+				dst = port_elem->name;
+			} else {
+				src = port_elem->name;
+				dst = own_port;
+			}
+			if (jack_connect(jack->client, src, dst))
+				fprintf(stderr, "cannot connect %s to %s\n",
+					src, dst);
+		}
+	}
+}
+
+/* serves the connect requests of the streams on a client */
+static void *snd_pcm_jack_client_helper(void *arg)
+{
+	snd_pcm_jack_client_t *shared = arg;
+	snd_pcm_jack_t *jack;
+
+	pthread_mutex_lock(&shared->helper_lock);
+	for (;;) {
+		while (!shared->connect_queue && !shared->helper_quit)
+			pthread_cond_wait(&shared->helper_cond,
+					  &shared->helper_lock);
+		if (shared->helper_quit)
+			break;
+
+		shared->connecting = shared->connect_queue;
+		jack = shared->connecting->private_data;
+		shared->connect_queue = jack->connect_next;
+		jack->connect_queued = 0;
+		pthread_mutex_unlock(&shared->helper_lock);
+
+		snd_pcm_jack_connect_ports(jack);
+
+		pthread_mutex_lock(&shared->helper_lock);
+		shared->connecting = NULL;
+		pthread_cond_broadcast(&shared->helper_cond);
+	}
+	pthread_mutex_unlock(&shared->helper_lock);
+	return NULL;
+}
+
+/* have the ports of io connected */
+static void snd_pcm_jack_client_connect(snd_pcm_jack_client_t *shared,
+					snd_pcm_ioplug_t *io)
+{
+	snd_pcm_jack_t *jack = io->private_data;
+
+	pthread_mutex_lock(&shared->helper_lock);
+	if (!jack->connect_queued) {
+		jack->connect_next = shared->connect_queue;
+		shared->connect_queue = io;
+		jack->connect_queued = 1;
+		pthread_cond_broadcast(&shared->helper_cond);
+	}
+	pthread_mutex_unlock(&shared->helper_lock);
+}
+
+/* drop a pending request for io and wait for one in progress */
+static void snd_pcm_jack_client_cancel(snd_pcm_jack_client_t *shared,
+				       snd_pcm_ioplug_t *io)
+{
+	snd_pcm_jack_t *jack = io->private_data;
+	snd_pcm_ioplug_t **p;
+
+	pthread_mutex_lock(&shared->helper_lock);
+	if (jack->connect_queued) {
+		for (p = &shared->connect_queue; *p != io;
+		     p = &((snd_pcm_jack_t *)(*p)->private_data)->connect_next)
+			;
+		*p = jack->connect_next;
+		jack->connect_queued = 0;
+	}
+	while (shared->connecting == io)
+		pthread_cond_wait(&shared->helper_cond, &shared->helper_lock);
+	pthread_mutex_unlock(&shared->helper_lock);
+}
+
+/* look up the client of that name, opening it on first use */
+static snd_pcm_jack_client_t *snd_pcm_jack_client_get(const char *name)
+{
+	snd_pcm_jack_client_t *shared;
+
+	pthread_mutex_lock(&snd_pcm_jack_clients_lock);
+	for (shared = snd_pcm_jack_clients; shared; shared = shared->next)
+		if (!strcmp(shared->name, name))
+			goto found;
+
+	shared = calloc(1, sizeof(*shared));
+	if (!shared)
+		goto unlock;
+	shared->name = strdup(name);
+	shared->client = jack_client_open(name, JackNoStartServer, NULL);
+	if (!shared->name || !shared->client) {
+		free(shared->name);
+		free(shared);
+		shared = NULL;
+		goto unlock;
+	}
+	pthread_mutex_init(&shared->lock, NULL);
+	pthread_mutex_init(&shared->helper_lock, NULL);
+	pthread_cond_init(&shared->helper_cond, NULL);
+	if (pthread_create(&shared->helper, NULL, snd_pcm_jack_client_helper,
+			   shared)) {
+		jack_client_close(shared->client);
+		pthread_cond_destroy(&shared->helper_cond);
+		pthread_mutex_destroy(&shared->helper_lock);
+		pthread_mutex_destroy(&shared->lock);
+		free(shared->name);
+		free(shared);
+		shared = NULL;
+		goto unlock;
+	}
+	jack_set_process_callback(shared->client,
+				  (JackProcessCallback)snd_pcm_jack_client_process,
+				  shared);
+	jack_set_latency_callback(shared->client,
+				  (JackLatencyCallback)snd_pcm_jack_client_latency,
+				  shared);
+	shared->next = snd_pcm_jack_clients;
+	snd_pcm_jack_clients = shared;
+ found:
+	shared->refs++;
+ unlock:
+	pthread_mutex_unlock(&snd_pcm_jack_clients_lock);
+	return shared;
+}
+
+/* drop a reference, closing the client with the last one */
+static void snd_pcm_jack_client_put(snd_pcm_jack_client_t *shared)
+{
+	snd_pcm_jack_client_t **p;
+
+	pthread_mutex_lock(&snd_pcm_jack_clients_lock);
+	if (--shared->refs) {
+		pthread_mutex_unlock(&snd_pcm_jack_clients_lock);
+		return;
+	}
+	for (p = &snd_pcm_jack_clients; *p != shared; p = &(*p)->next)
+		;
+	*p = shared->next;
+	pthread_mutex_unlock(&snd_pcm_jack_clients_lock);
+
+	pthread_mutex_lock(&shared->helper_lock);
+	shared->helper_quit = 1;
+	pthread_cond_broadcast(&shared->helper_cond);
+	pthread_mutex_unlock(&shared->helper_lock);
+	pthread_join(shared->helper, NULL);
+
+	jack_client_close(shared->client);
+	pthread_cond_destroy(&shared->helper_cond);
+	pthread_mutex_destroy(&shared->helper_lock);
+	pthread_mutex_destroy(&shared->lock);
+	free(atomic_load(&shared->streams));
+	free(shared->port_used[0]);
+	free(shared->port_used[1]);
+	free(shared->name);
+	free(shared);
+}
+
+/*
+ * Take the lowest port number free in the direction, so a stream
+ * opened again after another one closed gets the same port names.
+ */
+static int snd_pcm_jack_port_num_get(snd_pcm_jack_client_t *shared,
+				     snd_pcm_stream_t stream)
+{
+	unsigned char *used;
+	unsigned int i, n;
+
+	pthread_mutex_lock(&shared->lock);
+	used = shared->port_used[stream];
+	n = shared->port_slots[stream];
+	for (i = 0; i < n && used[i]; i++)
+		;
+	if (i == n) {
+		used = realloc(used, n + 16);
+		if (!used) {
+			pthread_mutex_unlock(&shared->lock);
+			return -ENOMEM;
+		}
+		memset(used + n, 0, 16);
+		shared->port_used[stream] = used;
+		shared->port_slots[stream] = n + 16;
+	}
+	used[i] = 1;
+	pthread_mutex_unlock(&shared->lock);
+	return i;
+}
+
+static void snd_pcm_jack_port_num_put(snd_pcm_jack_client_t *shared,
+				      snd_pcm_stream_t stream, int num)
+{
+	pthread_mutex_lock(&shared->lock);
+	shared->port_used[stream][num] = 0;
+	pthread_mutex_unlock(&shared->lock);
+}
+
+/* activate the client unless some other stream has done so already */
+static int snd_pcm_jack_client_activate(snd_pcm_jack_client_t *shared)
+{
+	int err = 0;
+
+	pthread_mutex_lock(&snd_pcm_jack_clients_lock);
+	if (!shared->activated) {
+		if (jack_activate(shared->client))
+			err = -EIO;
+		else
+			shared->activated = 1;
+	}
+	pthread_mutex_unlock(&snd_pcm_jack_clients_lock);
+	return err;
+}
+
+/*
+ * Publish a new stream array with io added or removed, then wait for
+ * the process callback to let go of the old one.
+ */
+static int snd_pcm_jack_client_update(snd_pcm_jack_client_t *shared,
+				      snd_pcm_ioplug_t *io, bool add)
+{
+	snd_pcm_ioplug_t **old, **streams;
+	unsigned int i, n = 0, cycle;
+	bool found = false;
+
+	pthread_mutex_lock(&shared->lock);
+	old = atomic_load_explicit(&shared->streams, memory_order_relaxed);
+	for (; old && old[n]; n++)
+		found |= old[n] == io;
+	if (found == add) {
+		pthread_mutex_unlock(&shared->lock);
+		return 0;
+	}
+	streams = calloc(n + 2, sizeof(*streams));
+	if (!streams) {
+		pthread_mutex_unlock(&shared->lock);
+		return -ENOMEM;
+	}
+	for (i = 0, n = 0; old && old[i]; i++)
+		if (old[i] != io)
+			streams[n++] = old[i];
+	if (add)
+		streams[n] = io;
+	/*
+	 * Sequentially consistent like the accesses in the callback, so
+	 * that either it picks up the new array or we see its cycle odd;
+	 * a release store could be reordered after the load of the cycle.
+	 */
+	atomic_store(&shared->streams, streams);
+	pthread_mutex_unlock(&shared->lock);
+
+	cycle = atomic_load(&shared->cycle);
+	if (cycle & 1)
+		while (atomic_load(&shared->cycle) == cycle)
+			sched_yield();
+	free(old);
+	return 0;
+}
+
+static int snd_pcm_jack_client_add(snd_pcm_jack_client_t *shared,
+				   snd_pcm_ioplug_t *io)
+{
+	return snd_pcm_jack_client_update(shared, io, true);
+}
+
+static void snd_pcm_jack_client_remove(snd_pcm_jack_client_t *shared,
+				       snd_pcm_ioplug_t *io)
+{
+	snd_pcm_jack_client_update(shared, io, false);
+}
+
+/* writes a summary to stderr every stats_interval seconds */
+static void *snd_pcm_jack_stats_thread(void *arg)
+{
+	snd_pcm_jack_t *jack = arg;
+	struct jack_stats_snap prev = { 0 };
+	struct timespec ts;
+	char name[64];
+
+	snprintf(name, sizeof(name), "%s %s", jack->shared->name,
+		 jack->io.stream == SND_PCM_STREAM_PLAYBACK ?
+		 "playback" : "capture");
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	pthread_mutex_lock(&jack->stats_lock);
+	for (;;) {
+		ts.tv_sec += jack->stats_interval;
+		while (!jack->stats_quit &&
+		       pthread_cond_timedwait(&jack->stats_cond,
+					      &jack->stats_lock, &ts) != ETIMEDOUT)
+			;
+		if (jack->stats_quit)
+			break;
+		jack_stats_summary(&jack->stats, &prev, name, stderr);
+	}
+	pthread_mutex_unlock(&jack->stats_lock);
+	return NULL;
+}
+
 static void snd_pcm_jack_free(snd_pcm_jack_t *jack)
 {
 	if (jack == NULL)
 		return;
 
-	if (jack->client)
-		jack_client_close(jack->client);
+	if (jack->stats_thread_started) {
+		pthread_mutex_lock(&jack->stats_lock);
+		jack->stats_quit = 1;
+		pthread_cond_signal(&jack->stats_cond);
+		pthread_mutex_unlock(&jack->stats_lock);
+		pthread_join(jack->stats_thread, NULL);
+	}
+	pthread_cond_destroy(&jack->stats_cond);
+	pthread_mutex_destroy(&jack->stats_lock);
+	if (jack->shared) {
+		snd_pcm_jack_client_cancel(jack->shared, &jack->io);
+		snd_pcm_jack_client_remove(jack->shared, &jack->io);
+		if (jack->ports) {
+			unsigned int i;
+
+			for (i = 0; i < jack->io.channels; i++) {
+				if (jack->ports[i])
+					jack_port_unregister(jack->client,
+							     jack->ports[i]);
+				if (jack->port_nums[i] >= 0)
+					snd_pcm_jack_port_num_put(jack->shared,
+								  jack->io.stream,
+								  jack->port_nums[i]);
+			}
+		}
+		snd_pcm_jack_client_put(jack->shared);
+	}
+	if (jack->fifo_thread_started) {
+		atomic_store(&jack->fifo_quit, true);
+		sem_post(&jack->fifo_sem);
+		pthread_join(jack->fifo_thread, NULL);
+	}
+	sem_destroy(&jack->fifo_sem);
+	pthread_mutex_destroy(&jack->fifo_mutex);
 	if (jack->port_names) {
 		unsigned int i;
 
@@ -163,13 +792,21 @@ static void snd_pcm_jack_free(snd_pcm_jack_t *jack)
 		free(jack->port_names);
 		jack->port_names = NULL;
 	}
-	pthread_mutex_destroy (&jack->running_mutex);
-	if (jack->fd >= 0)
-		close(jack->fd);
 	if (jack->io.poll_fd >= 0)
 		close(jack->io.poll_fd);
-	free(jack->areas);
+	jack_resampler_free(jack->resampler);
+	free(jack->rs_planes);
+	free(jack->rs_mem);
+	free(jack->rs_out);
+	free(jack->port_bufs);
+	free(jack->fifo_mem);
+	free(jack->fifo);
+	free(jack->bufs);
+	free(jack->scratch);
+	free(jack->rw_mem);
+	free(jack->rw_areas);
 	free(jack->ports);
+	free(jack->port_nums);
 	free(jack);
 }
 
@@ -180,12 +817,278 @@ static int snd_pcm_jack_close(snd_pcm_ioplug_t *io)
 	return 0;
 }
 
+/*
+ * Move frames between the ALSA ring at offset and the float planes
+ * (the port buffers or the FIFO) at plane_ofs.  The range must not wrap
+ * around the end of either.
+ */
+static void snd_pcm_jack_copy(snd_pcm_ioplug_t *io, float *const *planes,
+			      snd_pcm_uframes_t offset,
+			      snd_pcm_uframes_t plane_ofs,
+			      snd_pcm_uframes_t frames)
+{
+	snd_pcm_jack_t *jack = io->private_data;
+	const snd_pcm_channel_area_t *ring = jack->ring;
+	const bool playback = io->stream == SND_PCM_STREAM_PLAYBACK;
+	unsigned int ch;
+	char *buf;
+
+	if (!jack->interleaved) {
+		for (ch = 0; ch < io->channels; ch++) {
+			float *port = planes[ch] + plane_ofs;
+
+			buf = (char *)ring[ch].addr +
+				(ring[ch].first + offset * ring[ch].step) / 8;
+			if (!jack->to_float) {
+				if (playback)
+					memcpy(port, buf, frames * sizeof(float));
+				else
+					memcpy(buf, port, frames * sizeof(float));
+			} else if (playback)
+				jack->to_float(port, buf, frames);
+			else
+				jack->from_float(buf, port, frames);
+		}
+		return;
+	}
+
+	buf = (char *)ring[0].addr + (ring[0].first + offset * ring[0].step) / 8;
+	for (ch = 0; ch < io->channels; ch++)
+		jack->bufs[ch] = planes[ch] + plane_ofs;
+
+	/* FLOAT is split or merged directly between ring and ports */
+	if (!jack->to_float) {
+		if (playback)
+			jack->deinterleave(jack->bufs, (const float *)buf,
+					   io->channels, frames);
+		else
+			jack->interleave((float *)buf,
+					 (const float *const *)jack->bufs,
+					 io->channels, frames);
+		return;
+	}
+
+	/* the others are converted in chunks via the scratch buffer */
+	while (frames > 0) {
+		unsigned int n = frames;
+
+		if (n > JACK_CONV_FRAMES)
+			n = JACK_CONV_FRAMES;
+		if (playback) {
+			jack->to_float(jack->scratch, buf, n * io->channels);
+			jack->deinterleave(jack->bufs, jack->scratch,
+					   io->channels, n);
+		} else {
+			jack->interleave(jack->scratch,
+					 (const float *const *)jack->bufs,
+					 io->channels, n);
+			jack->from_float(buf, jack->scratch, n * io->channels);
+		}
+		buf += n * ring[0].step / 8;
+		for (ch = 0; ch < io->channels; ch++)
+			jack->bufs[ch] += n;
+		frames -= n;
+	}
+}
+
+/* copy between the FIFO planes at pos and the given buffers */
+static void snd_pcm_jack_fifo_copy(snd_pcm_jack_t *jack, unsigned int channels,
+				   unsigned long pos, float *const *bufs,
+				   snd_pcm_uframes_t frames, bool to_fifo)
+{
+	const snd_pcm_uframes_t ofs = pos % jack->fifo_size;
+	snd_pcm_uframes_t cont = jack->fifo_size - ofs;
+	unsigned int ch;
+
+	if (cont > frames)
+		cont = frames;
+	for (ch = 0; ch < channels; ch++) {
+		float *f = jack->fifo[ch];
+
+		if (to_fifo) {
+			memcpy(f + ofs, bufs[ch], cont * sizeof(float));
+			memcpy(f, bufs[ch] + cont, (frames - cont) * sizeof(float));
+		} else {
+			memcpy(bufs[ch], f + ofs, cont * sizeof(float));
+			memcpy(bufs[ch] + cont, f, (frames - cont) * sizeof(float));
+		}
+	}
+}
+
+/* frames the JACK thread can take from or put into the FIFO */
+static snd_pcm_uframes_t snd_pcm_jack_fifo_avail(snd_pcm_ioplug_t *io)
+{
+	snd_pcm_jack_t *jack = io->private_data;
+	snd_pcm_uframes_t fill = snd_pcm_jack_fifo_fill(jack);
+
+	return io->stream == SND_PCM_STREAM_PLAYBACK ?
+		fill : jack->fifo_size - fill;
+}
+
+/*
+ * JACK side of the FIFO: take frames for the planes on playback, or
+ * store them on capture.  They must be available.
+ */
+static void snd_pcm_jack_fifo_move(snd_pcm_ioplug_t *io, float *const *planes,
+				   snd_pcm_uframes_t frames)
+{
+	snd_pcm_jack_t *jack = io->private_data;
+	unsigned long pos;
+
+	if (io->stream == SND_PCM_STREAM_PLAYBACK) {
+		pos = atomic_load_explicit(&jack->fifo_tail, memory_order_relaxed);
+		snd_pcm_jack_fifo_copy(jack, io->channels, pos, planes, frames,
+				       false);
+		atomic_store_explicit(&jack->fifo_tail, pos + frames,
+				      memory_order_release);
+	} else {
+		pos = atomic_load_explicit(&jack->fifo_head, memory_order_relaxed);
+		snd_pcm_jack_fifo_copy(jack, io->channels, pos, planes, frames,
+				       true);
+		atomic_store_explicit(&jack->fifo_head, pos + frames,
+				      memory_order_release);
+	}
+}
+
+/* frames the JACK thread can take from or put into the application side */
+static snd_pcm_uframes_t snd_pcm_jack_rt_avail(snd_pcm_ioplug_t *io)
+{
+	snd_pcm_jack_t *jack = io->private_data;
+
+	if (jack->fifo_size)
+		return snd_pcm_jack_fifo_avail(io);
+	return snd_pcm_ioplug_hw_avail(io,
+				       atomic_load_explicit(&jack->hw_ptr,
+							    memory_order_relaxed),
+				       atomic_load_explicit(&jack->appl_ptr,
+							    memory_order_acquire));
+}
+
+/*
+ * Move frames between the planes and the FIFO, or straight from or to
+ * the ring, advancing hw_ptr.  They must be available.
+ */
+static void snd_pcm_jack_rt_move(snd_pcm_ioplug_t *io, float *const *planes,
+				 snd_pcm_uframes_t frames)
+{
+	snd_pcm_jack_t *jack = io->private_data;
+	snd_pcm_uframes_t hw_ptr, offset, cont;
+
+	if (jack->fifo_size) {
+		snd_pcm_jack_fifo_move(io, planes, frames);
+		return;
+	}
+	if (!frames)
+		return;
+
+	hw_ptr = atomic_load_explicit(&jack->hw_ptr, memory_order_relaxed);
+	offset = hw_ptr % io->buffer_size;
+	cont = io->buffer_size - offset;
+	if (cont > frames)
+		cont = frames;
+	snd_pcm_jack_copy(io, planes, offset, 0, cont);
+	if (cont < frames)
+		snd_pcm_jack_copy(io, planes, 0, cont, frames - cont);
+
+	hw_ptr += frames;
+	if (hw_ptr >= jack->boundary)
+		hw_ptr -= jack->boundary;
+	atomic_store_explicit(&jack->hw_ptr, hw_ptr, memory_order_release);
+}
+
+/*
+ * ALSA side of the FIFO: move what fits between the ring and the
+ * FIFO, advancing hw_ptr by that, just like the process callback does
+ * without the FIFO.  Called with fifo_mutex held.
+ */
+static void snd_pcm_jack_fifo_pump(snd_pcm_ioplug_t *io)
+{
+	snd_pcm_jack_t *jack = io->private_data;
+	snd_pcm_uframes_t hw_ptr =
+		atomic_load_explicit(&jack->hw_ptr, memory_order_relaxed);
+	snd_pcm_uframes_t appl_ptr =
+		atomic_load_explicit(&jack->appl_ptr, memory_order_acquire);
+	unsigned long pos;
+	snd_pcm_uframes_t n, avail;
+
+	if (io->stream == SND_PCM_STREAM_PLAYBACK) {
+		pos = atomic_load_explicit(&jack->fifo_head, memory_order_relaxed);
+		n = jack->fifo_size - (pos -
+			atomic_load_explicit(&jack->fifo_tail, memory_order_acquire));
+		avail = snd_pcm_ioplug_hw_avail(io, hw_ptr, appl_ptr);
+	} else {
+		pos = atomic_load_explicit(&jack->fifo_tail, memory_order_relaxed);
+		n = atomic_load_explicit(&jack->fifo_head, memory_order_acquire) - pos;
+		avail = snd_pcm_ioplug_avail(io, hw_ptr, appl_ptr);
+	}
+	if (n > avail)
+		n = avail;
+
+	while (n > 0) {
+		const snd_pcm_uframes_t offset = hw_ptr % io->buffer_size;
+		const snd_pcm_uframes_t fifo_ofs = pos % jack->fifo_size;
+		snd_pcm_uframes_t cont = n;
+
+		if (cont > io->buffer_size - offset)
+			cont = io->buffer_size - offset;
+		if (cont > jack->fifo_size - fifo_ofs)
+			cont = jack->fifo_size - fifo_ofs;
+		snd_pcm_jack_copy(io, jack->fifo, offset, fifo_ofs, cont);
+
+		hw_ptr += cont;
+		if (hw_ptr >= jack->boundary)
+			hw_ptr -= jack->boundary;
+		pos += cont;
+		n -= cont;
+	}
+
+	if (io->stream == SND_PCM_STREAM_PLAYBACK)
+		atomic_store_explicit(&jack->fifo_head, pos, memory_order_release);
+	else
+		atomic_store_explicit(&jack->fifo_tail, pos, memory_order_release);
+	atomic_store_explicit(&jack->hw_ptr, hw_ptr, memory_order_release);
+}
+
+/* services the FIFO whenever the process callback asks for it */
+static void *snd_pcm_jack_fifo_thread(void *arg)
+{
+	snd_pcm_ioplug_t *io = arg;
+	snd_pcm_jack_t *jack = io->private_data;
+
+	for (;;) {
+		while (sem_wait(&jack->fifo_sem) < 0 && errno == EINTR)
+			;
+		if (atomic_load(&jack->fifo_quit))
+			break;
+		atomic_store(&jack->fifo_kicked, false);
+
+		pthread_mutex_lock(&jack->fifo_mutex);
+		if (atomic_load(&jack->running) &&
+		    !atomic_load(&jack->xrun_detected)) {
+			snd_pcm_jack_fifo_pump(io);
+			pcm_poll_unblock_check(io);
+		}
+		pthread_mutex_unlock(&jack->fifo_mutex);
+	}
+	return NULL;
+}
+
+/* stop servicing the FIFO; the process callback must be stopped already */
+static void snd_pcm_jack_fifo_sync(snd_pcm_jack_t *jack)
+{
+	if (jack->fifo_thread_started) {
+		pthread_mutex_lock(&jack->fifo_mutex);
+		pthread_mutex_unlock(&jack->fifo_mutex);
+	}
+}
+
 static int snd_pcm_jack_poll_revents(snd_pcm_ioplug_t *io,
 				     struct pollfd *pfds, unsigned int nfds,
 				     unsigned short *revents)
 {
 	assert(pfds && nfds == 1 && revents);
 
+	snd_pcm_jack_sync_appl(io->private_data, io->appl_ptr);
 	*revents = pfds[0].revents & ~(POLLIN | POLLOUT);
 	if (pfds[0].revents & POLLIN && !pcm_poll_block_check(io))
 		*revents |= (io->stream == SND_PCM_STREAM_PLAYBACK) ? POLLOUT : POLLIN;
@@ -196,74 +1099,348 @@ static snd_pcm_sframes_t snd_pcm_jack_pointer(snd_pcm_ioplug_t *io)
 {
 	snd_pcm_jack_t *jack = io->private_data;
 
-	if (jack->xrun_detected)
+	/* MMAP capture commits without a callback, publish the reads here */
+	snd_pcm_jack_sync_appl(jack, io->appl_ptr);
+
+	if (atomic_load_explicit(&jack->xrun_detected, memory_order_acquire))
 		return -EPIPE;
 
 #ifdef SND_PCM_IOPLUG_FLAG_BOUNDARY_WA
-	return jack->hw_ptr;
+	return snd_pcm_jack_hw_ptr(jack);
 #else
-	return jack->hw_ptr % io->buffer_size;
+	return snd_pcm_jack_hw_ptr(jack) % io->buffer_size;
 #endif
 }
 
-static int
-snd_pcm_jack_process_cb(jack_nframes_t nframes, snd_pcm_ioplug_t *io)
+/*
+ * alsa-lib moves appl_ptr forward by the result right after this, so
+ * the new pointer is published here, once the ring holds the data.
+ * With RW access the frames are copied between the application buffer
+ * and our ring.  With MMAP access the data is already in place: a
+ * playback commit only needs the publishing, and the call capture makes
+ * from avail_update to fill the mmap buffer consumes nothing.
+ */
+static snd_pcm_sframes_t snd_pcm_jack_transfer(snd_pcm_ioplug_t *io,
+					       const snd_pcm_channel_area_t *areas,
+					       snd_pcm_uframes_t offset,
+					       snd_pcm_uframes_t size)
 {
 	snd_pcm_jack_t *jack = io->private_data;
-	snd_pcm_uframes_t xfer = 0;
-	unsigned int channel;
+	snd_pcm_uframes_t appl_ptr = io->appl_ptr + size;
+	snd_pcm_uframes_t pos, done, n;
+
+	if (snd_pcm_jack_rw_access(io)) {
+		pos = io->appl_ptr % io->buffer_size;
+		for (done = 0; done < size; done += n, pos = 0) {
+			n = size - done;
+			if (n > io->buffer_size - pos)
+				n = io->buffer_size - pos;
+			if (io->stream == SND_PCM_STREAM_PLAYBACK)
+				snd_pcm_areas_copy(jack->rw_areas, pos,
+						   areas, offset + done,
+						   io->channels, n, io->format);
+			else
+				snd_pcm_areas_copy(areas, offset + done,
+						   jack->rw_areas, pos,
+						   io->channels, n, io->format);
+		}
+	} else if (io->stream == SND_PCM_STREAM_CAPTURE)
+		return size;
+
+	if (appl_ptr >= jack->boundary)
+		appl_ptr -= jack->boundary;
+	snd_pcm_jack_sync_appl(jack, appl_ptr);
+	return size;
+}
+
+/*
+ * The frames in the ALSA buffer and the FIFO, plus the latency of the
+ * connected ports.  That latency counts from the start of the cycle in
+ * which the process callback last moved frames, so the time since then
+ * is taken off on playback (and added on capture) to get below the
+ * granularity of a JACK period.
+ */
+static int snd_pcm_jack_delay(snd_pcm_ioplug_t *io, snd_pcm_sframes_t *delayp)
+{
+	snd_pcm_jack_t *jack = io->private_data;
+	snd_pcm_uframes_t hw_ptr, fill = 0;
+	jack_nframes_t nframes, start, latency, elapsed, pending;
+	unsigned int cycle, rs_delay;
+
+	if (atomic_load_explicit(&jack->xrun_detected, memory_order_acquire))
+		return -EPIPE;
+
+	/* the FIFO thread moves hw_ptr and the FIFO together */
+	if (jack->fifo_thread_started)
+		pthread_mutex_lock(&jack->fifo_mutex);
+	/* read what one process cycle left behind */
+	do {
+		snd_pcm_jack_sync_cycle(jack);
+		cycle = atomic_load_explicit(&jack->cycle, memory_order_acquire);
+		hw_ptr = atomic_load_explicit(&jack->hw_ptr, memory_order_relaxed);
+		if (jack->fifo_size)
+			fill = snd_pcm_jack_fifo_fill(jack);
+		nframes = atomic_load_explicit(&jack->cycle_frames,
+					       memory_order_relaxed);
+		start = atomic_load_explicit(&jack->cycle_start,
+					     memory_order_relaxed);
+		rs_delay = atomic_load_explicit(&jack->rs_delay,
+						memory_order_relaxed);
+		atomic_thread_fence(memory_order_acquire);
+	} while (atomic_load_explicit(&jack->cycle, memory_order_relaxed) != cycle);
+	if (jack->fifo_thread_started)
+		pthread_mutex_unlock(&jack->fifo_mutex);
 
-	if (pthread_mutex_trylock (&jack->running_mutex) == EBUSY) {
-		/* Note that locking should only ever fail if
-		 * snd_pcm_jack_start or snd_pcm_jack_stop is called at the
-		 * same time, in which case dropping the current buffer is not
-		 * an issue. */
+	if (io->stream == SND_PCM_STREAM_PLAYBACK)
+		*delayp = snd_pcm_ioplug_hw_avail(io, hw_ptr, io->appl_ptr);
+	else
+		*delayp = snd_pcm_ioplug_avail(io, hw_ptr, io->appl_ptr);
+	*delayp += fill;
+
+	if (!nframes)
 		return 0;
+	latency = atomic_load_explicit(&jack->graph_latency,
+				       memory_order_relaxed);
+	elapsed = jack_frame_time(jack->client) - start;
+	if (elapsed > nframes)
+		elapsed = nframes;
+	pending = 0;
+	if (io->stream == SND_PCM_STREAM_PLAYBACK)
+		pending = latency + nframes - elapsed;
+	else if (latency + elapsed > nframes)
+		pending = latency + elapsed - nframes;
+	/* JACK frames so far */
+	if (jack->resampler)
+		*delayp += rs_delay +
+			(snd_pcm_uframes_t)pending * io->rate / jack->jack_rate;
+	else
+		*delayp += pending;
+	return 0;
+}
+
+/*
+ * Trim the resampling ratio, so that the frames waiting on the
+ * application side (ring and FIFO) stay where they settled: more of
+ * them means the application runs fast, so more input is used per
+ * output frame.
+ */
+static void snd_pcm_jack_rate_control(snd_pcm_ioplug_t *io,
+				      jack_nframes_t nframes)
+{
+	snd_pcm_jack_t *jack = io->private_data;
+	snd_pcm_uframes_t hw_ptr = snd_pcm_jack_hw_ptr(jack);
+	snd_pcm_uframes_t appl_ptr =
+		atomic_load_explicit(&jack->appl_ptr, memory_order_acquire);
+	const double dt = (double)nframes / jack->jack_rate;
+	double fill, err, adjust;
+
+	if (io->stream == SND_PCM_STREAM_PLAYBACK)
+		fill = snd_pcm_ioplug_hw_avail(io, hw_ptr, appl_ptr);
+	else
+		fill = snd_pcm_ioplug_avail(io, hw_ptr, appl_ptr);
+	if (jack->fifo_size)
+		fill += snd_pcm_jack_fifo_fill(jack);
+	if (jack->rc_fill < 0)
+		jack->rc_fill = fill;
+	else
+		jack->rc_fill += (fill - jack->rc_fill) *
+			(dt < RC_TAU ? dt / RC_TAU : 1);
+
+	if (jack->rc_settle) {
+		if (!--jack->rc_settle)
+			jack->rc_target = jack->rc_fill;
+		return;
 	}
-	if (!jack->running) {
-		pthread_mutex_unlock (&jack->running_mutex);
-		return 0;
+
+	err = (jack->rc_fill - jack->rc_target) / io->rate;
+	jack->rc_integral += err * dt;
+	/* no windup beyond what the clamp lets through */
+	if (jack->rc_integral > RC_MAX / RC_KI)
+		jack->rc_integral = RC_MAX / RC_KI;
+	else if (jack->rc_integral < -RC_MAX / RC_KI)
+		jack->rc_integral = -RC_MAX / RC_KI;
+	adjust = RC_KP * err + RC_KI * jack->rc_integral;
+	if (adjust > RC_MAX)
+		adjust = RC_MAX;
+	else if (adjust < -RC_MAX)
+		adjust = -RC_MAX;
+	jack_resampler_adjust(jack->resampler, 1 + adjust);
+}
+
+/*
+ * Draining and nothing left to move but what the resampler holds; the
+ * FIFO thread could still have frames of the ring to pass on.
+ */
+static bool snd_pcm_jack_drained(snd_pcm_ioplug_t *io)
+{
+	snd_pcm_jack_t *jack = io->private_data;
+
+	return atomic_load_explicit(&jack->draining, memory_order_relaxed) &&
+		!snd_pcm_jack_ring_ready(io) &&
+		(!jack->fifo_size || !snd_pcm_jack_fifo_fill(jack));
+}
+
+/*
+ * While draining, the last frames written are still in the resampler
+ * when the ring and the FIFO have run empty; push them out with
+ * silence.  Returns the frames produced at port offset done, at most n.
+ */
+static unsigned int snd_pcm_jack_resample_flush(snd_pcm_ioplug_t *io,
+						snd_pcm_uframes_t done,
+						unsigned int n)
+{
+	snd_pcm_jack_t *jack = io->private_data;
+	struct jack_resampler *r = jack->resampler;
+	int flush = atomic_load_explicit(&jack->rs_flush,
+					 memory_order_relaxed);
+	unsigned int ch, in;
+	float *const *planes;
+
+	if (flush < 0)
+		flush = jack_resampler_tail(r);
+	in = jack_resampler_input_for(r, n);
+	if (in > (unsigned int)flush) {
+		n = jack_resampler_output_for(r, flush);
+		in = jack_resampler_input_for(r, n);
 	}
-	
-	for (channel = 0; channel < io->channels; channel++) {
-		jack->areas[channel].addr = 
-			jack_port_get_buffer (jack->ports[channel], nframes);
-		jack->areas[channel].first = 0;
-		jack->areas[channel].step = jack->sample_bits;
+	planes = jack_resampler_in(r);
+	for (ch = 0; ch < io->channels; ch++)
+		memset(planes[ch], 0, in * sizeof(float));
+	jack_resampler_commit(r, in);
+	for (ch = 0; ch < io->channels; ch++)
+		jack->rs_planes[ch] = jack->port_bufs[ch] + done;
+	jack_resampler_read(r, jack->rs_planes, n);
+	atomic_store_explicit(&jack->rs_flush, flush - in, memory_order_relaxed);
+	return n;
+}
+
+/*
+ * Resample one process cycle between the ports and the application
+ * side, in steps of at most JACK_CONV_FRAMES JACK frames.  Returns the
+ * JACK frames done; fewer than nframes when the application side ran
+ * out of frames (playback) or room (capture).
+ */
+static snd_pcm_uframes_t snd_pcm_jack_resample(snd_pcm_ioplug_t *io,
+					       jack_nframes_t nframes)
+{
+	snd_pcm_jack_t *jack = io->private_data;
+	struct jack_resampler *r = jack->resampler;
+	snd_pcm_uframes_t done = 0, avail;
+	unsigned int ch, n, want, in, out;
+	double delay;
+
+	snd_pcm_jack_rate_control(io, nframes);
+
+	while (done < nframes) {
+		n = nframes - done;
+		if (n > JACK_CONV_FRAMES)
+			n = JACK_CONV_FRAMES;
+		avail = snd_pcm_jack_rt_avail(io);
+
+		if (io->stream == SND_PCM_STREAM_PLAYBACK) {
+			want = n;
+			in = jack_resampler_input_for(r, n);
+			if (in > avail && snd_pcm_jack_drained(io)) {
+				n = snd_pcm_jack_resample_flush(io, done, n);
+				done += n;
+				if (n < want)
+					break;
+				continue;
+			}
+			if (in > avail) {
+				n = jack_resampler_output_for(r, avail);
+				in = jack_resampler_input_for(r, n);
+			}
+			snd_pcm_jack_rt_move(io, jack_resampler_in(r), in);
+			jack_resampler_commit(r, in);
+			for (ch = 0; ch < io->channels; ch++)
+				jack->rs_planes[ch] = jack->port_bufs[ch] + done;
+			jack_resampler_read(r, jack->rs_planes, n);
+			done += n;
+			/* at the end of a drain, go on with the flush */
+			if (n < want && !snd_pcm_jack_drained(io))
+				break;
+		} else {
+			float *const *planes = jack_resampler_in(r);
+
+			for (ch = 0; ch < io->channels; ch++)
+				memcpy(planes[ch], jack->port_bufs[ch] + done,
+				       n * sizeof(float));
+			jack_resampler_commit(r, n);
+			out = jack_resampler_output_for(r, 0);
+			if (out > avail) {
+				/* no room for all; an xrun anyway */
+				jack_resampler_read(r, jack->rs_out, avail);
+				snd_pcm_jack_rt_move(io, jack->rs_out, avail);
+				break;
+			}
+			jack_resampler_read(r, jack->rs_out, out);
+			snd_pcm_jack_rt_move(io, jack->rs_out, out);
+			done += n;
+		}
 	}
 
-	if (io->state == SND_PCM_STATE_RUNNING ||
-	    io->state == SND_PCM_STATE_DRAINING) {
-		snd_pcm_uframes_t hw_ptr = jack->hw_ptr;
-		const snd_pcm_uframes_t hw_avail = snd_pcm_ioplug_hw_avail(io, hw_ptr,
-									   io->appl_ptr);
+	delay = jack_resampler_delay(r);
+	if (io->stream == SND_PCM_STREAM_CAPTURE)
+		delay = delay * io->rate / jack->jack_rate;
+	atomic_store_explicit(&jack->rs_delay, (unsigned int)delay,
+			      memory_order_relaxed);
+	return done;
+}
 
-		if (hw_avail > 0) {
-			const snd_pcm_channel_area_t *areas = snd_pcm_ioplug_mmap_areas(io);
-			const snd_pcm_uframes_t offset = hw_ptr % io->buffer_size;
+static int
+snd_pcm_jack_process_cb(jack_nframes_t nframes, snd_pcm_ioplug_t *io)
+{
+	snd_pcm_jack_t *jack = io->private_data;
+	const uint64_t start = jack_stats_now();
+	snd_pcm_uframes_t xfer = 0;
+	unsigned int channel;
+	bool running;
 
-			xfer = nframes;
-			if (xfer > hw_avail)
-				xfer = hw_avail;
+	/* No lock is taken here: running and the pointers are handed over
+	 * with atomics, and start/stop/prepare wait for the cycle count
+	 * to become even again (see snd_pcm_jack_sync_cycle()).
+	 */
+	atomic_fetch_add(&jack->cycle, 1);
+	if (!atomic_load(&jack->running)) {
+		/* the ports stay connected while stopped or reconfigured */
+		if (io->stream == SND_PCM_STREAM_PLAYBACK)
+			for (channel = 0; channel < io->channels; channel++)
+				memset(jack_port_get_buffer(jack->ports[channel],
+							    nframes),
+				       0, nframes * sizeof(float));
+		jack_stats_inc(&jack->stats.not_running);
+		atomic_fetch_add_explicit(&jack->cycle, 1, memory_order_release);
+		return 0;
+	}
+	/* stays stopped after an xrun until the next prepare */
+	running = !atomic_load_explicit(&jack->xrun_detected,
+					memory_order_relaxed);
+
+	for (channel = 0; channel < io->channels; channel++)
+		jack->port_bufs[channel] =
+			jack_port_get_buffer(jack->ports[channel], nframes);
+
+	if (running) {
+		atomic_store_explicit(&jack->cycle_start,
+				      jack_last_frame_time(jack->client),
+				      memory_order_relaxed);
+		atomic_store_explicit(&jack->cycle_frames, nframes,
+				      memory_order_relaxed);
+	}
 
-			if (io->stream == SND_PCM_STREAM_PLAYBACK)
-				snd_pcm_areas_copy_wrap(jack->areas, 0, nframes,
-							areas, offset,
-							io->buffer_size,
-							io->channels, xfer,
-							io->format);
-			else
-				snd_pcm_areas_copy_wrap(areas, offset,
-							io->buffer_size,
-							jack->areas, 0, nframes,
-							io->channels, xfer,
-							io->format);
-
-			hw_ptr += xfer;
-			if (hw_ptr >= jack->boundary)
-				hw_ptr -= jack->boundary;
-			jack->hw_ptr = hw_ptr;
+	if (running) {
+		if (jack->resampler) {
+			xfer = snd_pcm_jack_resample(io, nframes);
+		} else {
+			xfer = snd_pcm_jack_rt_avail(io);
+			if (xfer > nframes)
+				xfer = nframes;
+			snd_pcm_jack_rt_move(io, jack->port_bufs, xfer);
 		}
+		if (jack->fifo_size && snd_pcm_jack_fifo_wants_service(io) &&
+		    !atomic_exchange(&jack->fifo_kicked, true))
+			sem_post(&jack->fifo_sem);
 	}
 
 	/* check if requested frames were copied */
@@ -272,20 +1449,39 @@ snd_pcm_jack_process_cb(jack_nframes_t nframes, snd_pcm_ioplug_t *io)
 		if (io->stream == SND_PCM_STREAM_PLAYBACK) {
 			const snd_pcm_uframes_t frames = nframes - xfer;
 
-			snd_pcm_areas_silence(jack->areas, xfer, io->channels,
-					      frames, io->format);
+			for (channel = 0; channel < io->channels; channel++)
+				memset(jack->port_bufs[channel] + xfer, 0,
+				       frames * sizeof(float));
 		}
 
-		if (io->state == SND_PCM_STATE_RUNNING ||
-		    io->state == SND_PCM_STATE_DRAINING) {
+		if (running && io->stream == SND_PCM_STREAM_PLAYBACK &&
+		    snd_pcm_jack_drained(io) &&
+		    (!jack->resampler ||
+		     !atomic_load_explicit(&jack->rs_flush,
+					   memory_order_relaxed))) {
+			/* all played out, drain() is about to stop us */
+			jack_stats_inc(&jack->stats.not_running);
+		} else if (running) {
+			/* with data left in the ring, the FIFO thread was late */
+			if (jack->fifo_size && snd_pcm_jack_ring_ready(io))
+				jack_stats_inc(&jack->stats.fifo_late);
+			else
+				jack_stats_inc(&jack->stats.starved);
 			/* report Xrun to user application */
-			jack->xrun_detected = true;
-		}
+			atomic_store_explicit(&jack->xrun_detected, true,
+					      memory_order_release);
+		} else
+			jack_stats_inc(&jack->stats.not_running);
 	}
 
-	pcm_poll_unblock_check(io); /* unblock socket for polling if needed */
+	/* wake up a waiting application if needed; with the FIFO, the
+	 * FIFO thread does that except for xruns
+	 */
+	if (!running || !jack->fifo_size || xfer < nframes)
+		pcm_poll_unblock_check(io);
 
-	pthread_mutex_unlock (&jack->running_mutex);
+	jack_stats_cycle(&jack->stats, start);
+	atomic_fetch_add_explicit(&jack->cycle, 1, memory_order_release);
 
 	return 0;
 }
@@ -296,29 +1492,264 @@ static void jack_allocate_and_register_ports(snd_pcm_ioplug_t *io)
 	unsigned int i;
 
 	jack->ports = calloc(io->channels, sizeof(jack_port_t *));
+	jack->port_nums = malloc(io->channels * sizeof(int));
+	if (!jack->ports || !jack->port_nums) {
+		free(jack->ports);
+		free(jack->port_nums);
+		jack->ports = NULL;
+		jack->port_nums = NULL;
+		return;
+	}
 
+	/* port names are numbered per direction across the shared client */
 	for (i = 0; i < io->channels; i++) {
 		char port_name[32];
+		int num = snd_pcm_jack_port_num_get(jack->shared, io->stream);
 
+		jack->port_nums[i] = num;
+		if (num < 0)
+			continue;
 		if (io->stream == SND_PCM_STREAM_PLAYBACK) {
-			sprintf(port_name, "out_%03d", i);
+			sprintf(port_name, "out_%03d", num);
 			jack->ports[i] = jack_port_register(jack->client, port_name,
 							    JACK_DEFAULT_AUDIO_TYPE,
 							    JackPortIsOutput, 0);
 		} else {
-			sprintf(port_name, "in_%03d", i);
+			sprintf(port_name, "in_%03d", num);
 			jack->ports[i] = jack_port_register(jack->client, port_name,
 							    JACK_DEFAULT_AUDIO_TYPE,
 							    JackPortIsInput, 0);
 		}
+		if (!jack->ports[i]) {
+			snd_pcm_jack_port_num_put(jack->shared, io->stream, num);
+			jack->port_nums[i] = -1;
+		}
 	}
 }
 
-static int snd_pcm_jack_prepare(snd_pcm_ioplug_t *io)
+/*
+ * Our side of the graph ends at the application, so the FIFO shows up
+ * as capture latency of the playback ports and as playback latency of
+ * the capture ports.  The other direction is set up by libjack from the
+ * connections; its maximum over the ports is kept for the delay.
+ */
+static void snd_pcm_jack_latency_cb(jack_latency_callback_mode_t mode,
+				    snd_pcm_ioplug_t *io)
 {
 	snd_pcm_jack_t *jack = io->private_data;
+	const jack_latency_callback_mode_t graph_mode =
+		io->stream == SND_PCM_STREAM_PLAYBACK ?
+		JackPlaybackLatency : JackCaptureLatency;
+	jack_latency_range_t range;
+	jack_nframes_t latency = 0;
 	unsigned int i;
+
+	if (mode == graph_mode) {
+		for (i = 0; i < io->channels; i++) {
+			jack_port_get_latency_range(jack->ports[i], mode, &range);
+			if (range.max > latency)
+				latency = range.max;
+		}
+		atomic_store_explicit(&jack->graph_latency, latency,
+				      memory_order_relaxed);
+		return;
+	}
+
+	range.min = range.max = jack->extra_latency;
+	if (jack->resampler)
+		range.min = range.max = (snd_pcm_uframes_t)jack->extra_latency *
+			jack->jack_rate / io->rate;
+	for (i = 0; i < io->channels; i++)
+		jack_port_set_latency_range(jack->ports[i], mode, &range);
+}
+
+/*
+ * (Re)create the resampler when the rate differs from the JACK rate
+ * and reset it; the JACK thread must be stopped.
+ */
+static int snd_pcm_jack_setup_resampler(snd_pcm_ioplug_t *io)
+{
+	snd_pcm_jack_t *jack = io->private_data;
+	unsigned int in_rate, out_rate, max_in, max_out, ch;
+
+	jack->jack_rate = jack_get_sample_rate(jack->client);
+	if (jack->resampler && jack->resampler_rate != io->rate) {
+		jack_resampler_free(jack->resampler);
+		jack->resampler = NULL;
+		free(jack->rs_mem);
+		jack->rs_mem = NULL;
+	}
+	if (io->rate == jack->jack_rate)
+		return 0;
+
+	if (!jack->resampler) {
+		/* the most frames one step of JACK_CONV_FRAMES may take
+		 * in on playback or give out on capture
+		 */
+		if (io->stream == SND_PCM_STREAM_PLAYBACK) {
+			in_rate = io->rate;
+			out_rate = jack->jack_rate;
+			max_in = JACK_CONV_FRAMES * (1 + RC_MAX) * in_rate /
+				out_rate + 2;
+		} else {
+			in_rate = jack->jack_rate;
+			out_rate = io->rate;
+			max_in = JACK_CONV_FRAMES;
+			max_out = JACK_CONV_FRAMES * out_rate /
+				((1 - RC_MAX) * in_rate) + 2;
+			jack->rs_mem = malloc((size_t)max_out * io->channels *
+					      sizeof(float));
+			if (!jack->rs_mem)
+				return -ENOMEM;
+			for (ch = 0; ch < io->channels; ch++)
+				jack->rs_out[ch] = jack->rs_mem + ch * max_out;
+		}
+		jack->resampler = jack_resampler_new(io->channels, in_rate,
+						     out_rate, max_in);
+		if (!jack->resampler)
+			return -ENOMEM;
+		jack->resampler_rate = io->rate;
+	}
+
+	jack_resampler_reset(jack->resampler);
+	atomic_store_explicit(&jack->rs_flush, -1, memory_order_relaxed);
+	atomic_store_explicit(&jack->rs_delay, 0, memory_order_relaxed);
+	jack->rc_fill = -1;
+	jack->rc_integral = 0;
+	jack->rc_settle = RC_SETTLE * jack->jack_rate /
+		jack_get_buffer_size(jack->client) + 1;
+	return 0;
+}
+
+/* (re)allocate and reset the FIFO; the JACK thread must be stopped */
+static int snd_pcm_jack_setup_fifo(snd_pcm_ioplug_t *io)
+{
+	snd_pcm_jack_t *jack = io->private_data;
+	snd_pcm_uframes_t size = 0;
+	unsigned int ch;
+
+	/* one JACK period on top, in application frames */
+	if (jack->extra_latency && jack->resampler)
+		size = jack->extra_latency + JACK_CONV_FRAMES +
+			(snd_pcm_uframes_t)(jack_get_buffer_size(jack->client) *
+					    (1 + RC_MAX) * io->rate /
+					    jack->jack_rate);
+	else if (jack->extra_latency)
+		size = jack->extra_latency + jack_get_buffer_size(jack->client);
+	if (size != jack->fifo_size) {
+		free(jack->fifo_mem);
+		jack->fifo_mem = NULL;
+		jack->fifo_size = 0;
+		if (size) {
+			jack->fifo_mem = malloc(size * io->channels * sizeof(float));
+			if (!jack->fifo_mem)
+				return -ENOMEM;
+		}
+		jack->fifo_size = size;
+	}
+	for (ch = 0; ch < io->channels; ch++)
+		jack->fifo[ch] = jack->fifo_mem + ch * size;
+	atomic_store_explicit(&jack->fifo_head, 0, memory_order_relaxed);
+	atomic_store_explicit(&jack->fifo_tail, 0, memory_order_relaxed);
+	return 0;
+}
+
+/*
+ * alsa-lib only maps a buffer for MMAP access; with RW access the
+ * ring is an interleaved one of our own, filled and drained by the
+ * transfer callback.
+ */
+static int snd_pcm_jack_setup_rw(snd_pcm_ioplug_t *io)
+{
+	snd_pcm_jack_t *jack = io->private_data;
+	unsigned int width = snd_pcm_format_physical_width(io->format);
+	size_t bytes = (size_t)io->buffer_size * io->channels * width / 8;
+	unsigned int ch;
+
+	if (bytes != jack->rw_bytes) {
+		free(jack->rw_mem);
+		jack->rw_bytes = 0;
+		jack->rw_mem = malloc(bytes);
+		if (!jack->rw_mem)
+			return -ENOMEM;
+		jack->rw_bytes = bytes;
+	}
+	for (ch = 0; ch < io->channels; ch++) {
+		jack->rw_areas[ch].addr = jack->rw_mem;
+		jack->rw_areas[ch].first = ch * width;
+		jack->rw_areas[ch].step = io->channels * width;
+	}
+	return 0;
+}
+
+/*
+ * Pick the conversion for the negotiated format and the (de)interleave
+ * kernels for the channel count and ring layout.
+ */
+static int snd_pcm_jack_setup_copy(snd_pcm_ioplug_t *io)
+{
+	snd_pcm_jack_t *jack = io->private_data;
+	const snd_pcm_channel_area_t *ring;
+	unsigned int width = snd_pcm_format_physical_width(io->format);
+	unsigned int ch;
+	int err;
+
+	if (snd_pcm_jack_rw_access(io)) {
+		err = snd_pcm_jack_setup_rw(io);
+		if (err < 0)
+			return err;
+		ring = jack->rw_areas;
+	} else
+		ring = snd_pcm_ioplug_mmap_areas(io);
+	jack->ring = ring;
+	switch (io->format) {
+	case SND_PCM_FORMAT_S16:
+		jack->to_float = jack->dsp.s16_to_float;
+		jack->from_float = jack->dsp.float_to_s16;
+		break;
+	case SND_PCM_FORMAT_S24:
+		jack->to_float = jack->dsp.s24_to_float;
+		jack->from_float = jack->dsp.float_to_s24;
+		break;
+	case SND_PCM_FORMAT_S32:
+		jack->to_float = jack->dsp.s32_to_float;
+		jack->from_float = jack->dsp.float_to_s32;
+		break;
+	default:
+		jack->to_float = NULL;
+		jack->from_float = NULL;
+		break;
+	}
+	jack->deinterleave = jack_dsp_deinterleave(&jack->dsp, io->channels);
+	jack->interleave = jack_dsp_interleave(&jack->dsp, io->channels);
+
+	if (!ring)
+		return -EBADFD;
+	jack->interleaved = 1;
+	for (ch = 0; ch < io->channels; ch++) {
+		if (ring[ch].addr != ring[0].addr ||
+		    ring[ch].first != ring[0].first + ch * width ||
+		    ring[ch].step != io->channels * width) {
+			jack->interleaved = 0;
+			break;
+		}
+	}
+	if (jack->interleaved)
+		return 0;
+	for (ch = 0; ch < io->channels; ch++) {
+		if (ring[ch].step != width || ring[ch].first % 8) {
+			SNDERR("Unsupported buffer layout");
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+static int snd_pcm_jack_prepare(snd_pcm_ioplug_t *io)
+{
+	snd_pcm_jack_t *jack = io->private_data;
 	snd_pcm_sw_params_t *swparams;
+	snd_pcm_uframes_t min_avail;
 	int err;
 
 	if (io->channels != jack->num_ports) {
@@ -327,67 +1758,79 @@ static int snd_pcm_jack_prepare(snd_pcm_ioplug_t *io)
 		return -EINVAL;
 	}
 
-	jack->hw_ptr = 0;
-	jack->xrun_detected = false;
+	/* the callback must not touch the ring while it is reset */
+	atomic_store(&jack->running, false);
+	snd_pcm_jack_sync_cycle(jack);
+	snd_pcm_jack_fifo_sync(jack);
 
-	jack->min_avail = io->period_size;
+	err = snd_pcm_jack_setup_copy(io);
+	if (err < 0)
+		return err;
+	err = snd_pcm_jack_setup_resampler(io);
+	if (err < 0)
+		return err;
+	err = snd_pcm_jack_setup_fifo(io);
+	if (err < 0)
+		return err;
+
+	atomic_store_explicit(&jack->hw_ptr, 0, memory_order_relaxed);
+	atomic_store_explicit(&jack->xrun_detected, false, memory_order_relaxed);
+	atomic_store_explicit(&jack->draining, false, memory_order_relaxed);
+	atomic_store_explicit(&jack->cycle_frames, 0, memory_order_relaxed);
+	snd_pcm_jack_sync_appl(jack, io->appl_ptr);
+
+	min_avail = io->period_size;
 	snd_pcm_sw_params_alloca(&swparams);
 	err = snd_pcm_sw_params_current(io->pcm, swparams);
 	if (err == 0) {
-		snd_pcm_sw_params_get_avail_min(swparams, &jack->min_avail);
+		snd_pcm_sw_params_get_avail_min(swparams, &min_avail);
 		/* get boundary for available calulation */
 		snd_pcm_sw_params_get_boundary(swparams, &jack->boundary);
 	}
+	atomic_store_explicit(&jack->min_avail, min_avail, memory_order_relaxed);
 
-	if (io->stream == SND_PCM_STREAM_PLAYBACK)
-		pcm_poll_unblock_check(io); /* playback pcm initially accepts writes */
-	else
+	if (io->stream == SND_PCM_STREAM_PLAYBACK) {
+		/* playback pcm initially accepts writes */
+		atomic_store(&jack->waiter, false);
+		pcm_poll_wakeup(io);
+	} else
 		pcm_poll_block_check(io); /* block capture pcm if that's XRUN recovery */
 
-	if (!jack->ports) {
+	if (!jack->ports)
 		jack_allocate_and_register_ports(io);
-		jack_set_process_callback(jack->client,
-					  (JackProcessCallback)snd_pcm_jack_process_cb, io);
-	}
-
-	if (jack->activated)
-		return 0;
 
-	if (jack_activate(jack->client))
-		return -EIO;
-
-	jack->activated = 1;
-
-	for (i = 0; i < io->channels && i < jack->num_ports; i++) {
-		const char * const own_port = jack_port_name(jack->ports[i]);
-		snd_pcm_jack_port_list_t *port_elem;
-
-		for (port_elem = jack->port_names[i]; port_elem != NULL;
-		     port_elem = port_elem->next) {
-			const char *src, *dst;
-			if (io->stream == SND_PCM_STREAM_PLAYBACK) {
-				src = own_port;
-				dst = port_elem->name;
-			} else {
-				src = port_elem->name;
-				dst = own_port;
-			}
-			if (jack_connect(jack->client, src, dst)) {
-				fprintf(stderr, "cannot connect %s to %s\n",
-					src, dst);
-				return -EIO;
-			}
-		}
+	/*
+	 * Ports stay registered, served and connected across hw_free,
+	 * so only the first prepare costs server round trips.  Connections
+	 * lost since are made again in the background; until then, the
+	 * process callback simply plays to (or records from) fewer ports.
+	 */
+	if (!jack->activated) {
+		err = snd_pcm_jack_client_activate(jack->shared);
+		if (err < 0)
+			return err;
+		err = snd_pcm_jack_client_add(jack->shared, io);
+		if (err < 0)
+			return err;
+		jack->activated = 1;
 	}
+	snd_pcm_jack_client_connect(jack->shared, io);
 	return 0;
 }
 
 static int snd_pcm_jack_start(snd_pcm_ioplug_t *io)
 {
 	snd_pcm_jack_t *jack = io->private_data;
-	pthread_mutex_lock (&jack->running_mutex);
-	jack->running = 1;
-	pthread_mutex_unlock (&jack->running_mutex);
+
+	/* releases everything set up by prepare to the JACK thread */
+	snd_pcm_jack_sync_appl(jack, io->appl_ptr);
+	if (jack->fifo_size) {
+		/* prefill */
+		pthread_mutex_lock(&jack->fifo_mutex);
+		snd_pcm_jack_fifo_pump(io);
+		pthread_mutex_unlock(&jack->fifo_mutex);
+	}
+	atomic_store(&jack->running, true);
 	/*
 	 * Since the processing of jack_activate() and jack_connect() take a
 	 * while longer, snd_pcm_jack_start() was blocked.
@@ -405,48 +1848,103 @@ static int snd_pcm_jack_start(snd_pcm_ioplug_t *io)
 static int snd_pcm_jack_stop(snd_pcm_ioplug_t *io)
 {
 	snd_pcm_jack_t *jack = io->private_data;
-	pthread_mutex_lock (&jack->running_mutex);
-	jack->running = 0;
-	pthread_mutex_unlock (&jack->running_mutex);
+
+	atomic_store(&jack->running, false);
+	snd_pcm_jack_sync_cycle(jack);
+	snd_pcm_jack_fifo_sync(jack);
 	return 0;
 }
 
 static int snd_pcm_jack_hw_free(snd_pcm_ioplug_t *io)
+{
+	/*
+	 * The client and the ports stay up for the next prepare; the
+	 * process callback only has to let go of the buffer and go silent.
+	 */
+	return snd_pcm_jack_stop(io);
+}
+
+/* frames written by the application but not yet in the port buffers */
+static bool snd_pcm_jack_drain_pending(snd_pcm_ioplug_t *io)
 {
 	snd_pcm_jack_t *jack = io->private_data;
 
-	if (jack->activated) {
-		jack_deactivate(jack->client);
-		jack->activated = 0;
-	}
-#if 0
-	unsigned i;
-	for (i = 0; i < io->channels; i++) {
-		if (jack->ports[i]) {
-			jack_port_unregister(jack->client, jack->ports[i]);
-			jack->ports[i] = NULL;
-		}
+	if (!snd_pcm_jack_drained(io))
+		return true;
+	return jack->resampler &&
+		atomic_load_explicit(&jack->rs_flush, memory_order_relaxed);
+}
+
+/*
+ * The ring runs empty before the last frames reach the ports when they
+ * pass the FIFO or the resampler, and alsa-lib stops the PCM as soon as
+ * this returns.  So wait until the process callback has taken all of
+ * them.  In non-blocking mode the application calls again after poll,
+ * which reports POLLOUT once the ring is empty.
+ */
+static int snd_pcm_jack_drain(snd_pcm_ioplug_t *io)
+{
+	snd_pcm_jack_t *jack = io->private_data;
+	useconds_t period;
+
+	if (io->stream != SND_PCM_STREAM_PLAYBACK)
+		return 0;
+
+	snd_pcm_jack_sync_appl(jack, io->appl_ptr);
+	atomic_store(&jack->draining, true);
+	period = 1000000ULL * jack_get_buffer_size(jack->client) /
+		jack->jack_rate;
+
+	while (atomic_load(&jack->running) &&
+	       !atomic_load(&jack->xrun_detected) &&
+	       snd_pcm_jack_drain_pending(io)) {
+		if (io->nonblock)
+			return -EAGAIN;
+		usleep(period / 2 + 1);
 	}
-#endif
 	return 0;
 }
 
 static int snd_pcm_jack_sw_params(snd_pcm_ioplug_t *io, snd_pcm_sw_params_t *params)
 {
 	snd_pcm_jack_t *jack = io->private_data;
-	snd_pcm_sw_params_get_avail_min(params, &jack->min_avail);
+	snd_pcm_uframes_t min_avail;
+
+	snd_pcm_sw_params_get_avail_min(params, &min_avail);
+	atomic_store_explicit(&jack->min_avail, min_avail, memory_order_relaxed);
 	return 0;
 }
 
+static void snd_pcm_jack_dump(snd_pcm_ioplug_t *io, snd_output_t *out)
+{
+	snd_pcm_jack_t *jack = io->private_data;
+
+	snd_output_printf(out, "%s\n", io->name);
+	snd_output_printf(out, "Its setup is:\n");
+	snd_pcm_dump_setup(io->pcm, out);
+	snd_output_printf(out, "  %-13s: %s\n", "client",
+			  jack->shared->name);
+	snd_output_printf(out, "  %-13s: %lu\n", "extra_latency",
+			  jack->extra_latency);
+	if (jack->fifo_size)
+		snd_output_printf(out, "  %-13s: %lu\n", "fifo_fill",
+				  snd_pcm_jack_fifo_fill(jack));
+	jack_stats_dump(&jack->stats, out);
+}
+
 static snd_pcm_ioplug_callback_t jack_pcm_callback = {
 	.close = snd_pcm_jack_close,
 	.start = snd_pcm_jack_start,
 	.stop = snd_pcm_jack_stop,
+	.drain = snd_pcm_jack_drain,
 	.pointer = snd_pcm_jack_pointer,
+	.transfer = snd_pcm_jack_transfer,
+	.delay = snd_pcm_jack_delay,
 	.hw_free = snd_pcm_jack_hw_free,
 	.prepare = snd_pcm_jack_prepare,
 	.poll_revents = snd_pcm_jack_poll_revents,
 	.sw_params = snd_pcm_jack_sw_params,
+	.dump = snd_pcm_jack_dump,
 };
 
 #define ARRAY_SIZE(ary)	(sizeof(ary)/sizeof(ary[0]))
@@ -459,8 +1957,19 @@ static int jack_set_hw_constraint(snd_pcm_jack_t *jack)
 		SND_PCM_ACCESS_RW_INTERLEAVED,
 		SND_PCM_ACCESS_RW_NONINTERLEAVED
 	};
+	/* integer formats are converted in the process callback */
+	unsigned int format_list[] = {
+		SND_PCM_FORMAT_FLOAT,
+		SND_PCM_FORMAT_S16,
+		SND_PCM_FORMAT_S24,
+		SND_PCM_FORMAT_S32
+	};
+	/* the period bytes follow FLOAT, so the periods of S16 are even
+	 * multiples of the JACK period
+	 */
 	unsigned int format = SND_PCM_FORMAT_FLOAT;
 	unsigned int rate = jack_get_sample_rate(jack->client);
+	unsigned int rate_min = rate, rate_max = rate;
 	unsigned int psize_list[MAX_PERIODS_MULTIPLE];
 	unsigned int nframes = jack_get_buffer_size(jack->client);
 	unsigned int jack_buffer_bytes = (snd_pcm_format_size(format, nframes) *
@@ -475,15 +1984,22 @@ static int jack_set_hw_constraint(snd_pcm_jack_t *jack)
 	for (i = 1; i <= ARRAY_SIZE(psize_list); i++)
 		psize_list[i-1] = jack_buffer_bytes * i;
 
-	jack->sample_bits = snd_pcm_format_physical_width(format);
+	/* anything else is resampled in the process callback */
+	if (jack->resample) {
+		if (rate_min > JACK_RESAMPLE_MIN_RATE)
+			rate_min = JACK_RESAMPLE_MIN_RATE;
+		if (rate_max < JACK_RESAMPLE_MAX_RATE)
+			rate_max = JACK_RESAMPLE_MAX_RATE;
+	}
+
 	if ((err = snd_pcm_ioplug_set_param_list(&jack->io, SND_PCM_IOPLUG_HW_ACCESS,
 						 ARRAY_SIZE(access_list), access_list)) < 0 ||
 	    (err = snd_pcm_ioplug_set_param_list(&jack->io, SND_PCM_IOPLUG_HW_FORMAT,
-						 1, &format)) < 0 ||
+						 ARRAY_SIZE(format_list), format_list)) < 0 ||
 	    (err = snd_pcm_ioplug_set_param_minmax(&jack->io, SND_PCM_IOPLUG_HW_CHANNELS,
 						   jack->num_ports, jack->num_ports)) < 0 ||
 	    (err = snd_pcm_ioplug_set_param_minmax(&jack->io, SND_PCM_IOPLUG_HW_RATE,
-						   rate, rate)) < 0 ||
+						   rate_min, rate_max)) < 0 ||
 	    (err = jack->use_period_alignment ?
 				snd_pcm_ioplug_set_param_list(&jack->io, SND_PCM_IOPLUG_HW_PERIOD_BYTES, ARRAY_SIZE(psize_list), psize_list) :
 				snd_pcm_ioplug_set_param_minmax(&jack->io, SND_PCM_IOPLUG_HW_PERIOD_BYTES, 128, 64*1024) ) < 0 ||
@@ -550,30 +2066,18 @@ static int parse_ports(snd_pcm_jack_t *jack, snd_config_t *conf)
 	return 0;
 }
 
-static int make_nonblock(int fd)
-{
-	int fl;
-
-	if ((fl = fcntl(fd, F_GETFL)) < 0)
-		return fl;
-
-	if (fl & O_NONBLOCK)
-		return 0;
-
-	return fcntl(fd, F_SETFL, fl | O_NONBLOCK);
-}
-
 static int snd_pcm_jack_open(snd_pcm_t **pcmp, const char *name,
 			     const char *client_name,
 			     snd_config_t *playback_conf,
 			     snd_config_t *capture_conf,
 			     int use_period_alignment,
+			     snd_pcm_uframes_t extra_latency,
+			     unsigned int stats_interval,
+			     int resample,
 			     snd_pcm_stream_t stream, int mode)
 {
 	snd_pcm_jack_t *jack;
 	int err;
-	int fd[2];
-	static unsigned int num = 0;
 	char jack_client_name[32];
 	
 	assert(pcmp);
@@ -581,11 +2085,22 @@ static int snd_pcm_jack_open(snd_pcm_t **pcmp, const char *name,
 	if (!jack)
 		return -ENOMEM;
 
-	pthread_mutex_init (&jack->running_mutex, NULL);
-
-	jack->fd = -1;
 	jack->io.poll_fd = -1;
 	jack->use_period_alignment = use_period_alignment;
+	jack->extra_latency = extra_latency;
+	jack->stats_interval = stats_interval;
+	jack->resample = resample;
+	pthread_mutex_init(&jack->fifo_mutex, NULL);
+	sem_init(&jack->fifo_sem, 0, 0);
+	pthread_mutex_init(&jack->stats_lock, NULL);
+	{
+		pthread_condattr_t attr;
+
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&jack->stats_cond, &attr);
+		pthread_condattr_destroy(&attr);
+	}
 
 	err = parse_ports(jack, stream == SND_PCM_STREAM_PLAYBACK ?
 			  playback_conf : capture_conf);
@@ -611,9 +2126,7 @@ static int snd_pcm_jack_open(snd_pcm_t **pcmp, const char *name,
 			pname = "alsa-jack";
 		}
 		err = snprintf(jack_client_name, sizeof(jack_client_name),
-			       "%s.%s.%d.%d", pname,
-			       stream == SND_PCM_STREAM_PLAYBACK ? "P" : "C",
-			       getpid(), num++);
+			       "%s.%d", pname, getpid());
 	} else
 		err = snprintf(jack_client_name, sizeof(jack_client_name),
 			       "%s", client_name);
@@ -623,33 +2136,41 @@ static int snd_pcm_jack_open(snd_pcm_t **pcmp, const char *name,
 			__func__, jack_client_name, (int)strlen(jack_client_name));
 	}
 
-	jack->client = jack_client_open(jack_client_name, JackNoStartServer, NULL);
+	jack->shared = snd_pcm_jack_client_get(jack_client_name);
 
-	if (jack->client == 0) {
+	if (jack->shared == NULL) {
 		snd_pcm_jack_free(jack);
 		return -ENOENT;
 	}
-
-	jack->areas = calloc(jack->num_ports, sizeof(snd_pcm_channel_area_t));
-	if (! jack->areas) {
+	jack->client = jack->shared->client;
+
+	jack->port_bufs = calloc(jack->num_ports, sizeof(float *));
+	jack->bufs = calloc(jack->num_ports, sizeof(float *));
+	jack->fifo = calloc(jack->num_ports, sizeof(float *));
+	jack->rs_planes = calloc(jack->num_ports, sizeof(float *));
+	jack->rs_out = calloc(jack->num_ports, sizeof(float *));
+	jack->scratch = malloc(jack->num_ports * JACK_CONV_FRAMES * sizeof(float));
+	jack->rw_areas = calloc(jack->num_ports, sizeof(*jack->rw_areas));
+	if (!jack->port_bufs || !jack->bufs || !jack->fifo || !jack->scratch ||
+	    !jack->rs_planes || !jack->rs_out || !jack->rw_areas) {
 		snd_pcm_jack_free(jack);
 		return -ENOMEM;
 	}
 
-	socketpair(AF_LOCAL, SOCK_STREAM, 0, fd);
-	
-	make_nonblock(fd[0]);
-	make_nonblock(fd[1]);
+	jack_dsp_init(&jack->dsp);
 
-	jack->fd = fd[0];
+	jack->io.poll_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (jack->io.poll_fd < 0) {
+		err = -errno;
+		snd_pcm_jack_free(jack);
+		return err;
+	}
 
 	jack->io.version = SND_PCM_IOPLUG_VERSION;
 	jack->io.name = "ALSA <-> JACK PCM I/O Plugin";
 	jack->io.callback = &jack_pcm_callback;
 	jack->io.private_data = jack;
-	jack->io.poll_fd = fd[1];
 	jack->io.poll_events = POLLIN;
-	jack->io.mmap_rw = 1;
 
 #ifdef SND_PCM_IOPLUG_FLAG_BOUNDARY_WA
 	jack->io.flags = SND_PCM_IOPLUG_FLAG_BOUNDARY_WA;
@@ -669,6 +2190,26 @@ static int snd_pcm_jack_open(snd_pcm_t **pcmp, const char *name,
 		return err;
 	}
 
+	if (jack->extra_latency) {
+		err = pthread_create(&jack->fifo_thread, NULL,
+				     snd_pcm_jack_fifo_thread, &jack->io);
+		if (err) {
+			snd_pcm_ioplug_delete(&jack->io);
+			return -err;
+		}
+		jack->fifo_thread_started = 1;
+	}
+
+	if (jack->stats_interval) {
+		err = pthread_create(&jack->stats_thread, NULL,
+				     snd_pcm_jack_stats_thread, jack);
+		if (err) {
+			snd_pcm_ioplug_delete(&jack->io);
+			return -err;
+		}
+		jack->stats_thread_started = 1;
+	}
+
 	*pcmp = jack->io.pcm;
 
 	return 0;
@@ -683,6 +2224,9 @@ SND_PCM_PLUGIN_DEFINE_FUNC(jack)
 	const char *client_name = NULL;
 	int err;
 	int align_jack_period = 1; /*by default we allow only JACK aligned period size*/
+	long extra_latency = 0;
+	long stats_interval = 0;
+	int resample = 0;
 	
 	snd_config_for_each(i, next, conf) {
 		snd_config_t *n = snd_config_iterator_entry(i);
@@ -718,11 +2262,34 @@ SND_PCM_PLUGIN_DEFINE_FUNC(jack)
 			align_jack_period = err ? 1 : 0;
 			continue;
 		}
+		if (strcmp(id, "extra_latency") == 0) {
+			if (snd_config_get_integer(n, &extra_latency) < 0 ||
+			    extra_latency < 0) {
+				SNDERR("Invalid value for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
+		if (strcmp(id, "resample") == 0) {
+			err = snd_config_get_bool(n);
+			if (err < 0)
+				return err;
+			resample = err;
+			continue;
+		}
+		if (strcmp(id, "stats_interval") == 0) {
+			if (snd_config_get_integer(n, &stats_interval) < 0 ||
+			    stats_interval < 0) {
+				SNDERR("Invalid value for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
 		SNDERR("Unknown field %s", id);
 		return -EINVAL;
 	}
 
-	err = snd_pcm_jack_open(pcmp, name, client_name, playback_conf, capture_conf, align_jack_period, stream, mode);
+	err = snd_pcm_jack_open(pcmp, name, client_name, playback_conf, capture_conf, align_jack_period, extra_latency, stats_interval, resample, stream, mode);
 
 	return err;
 }
@@ -21,6 +21,10 @@
  */
 
 #include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <time.h>
 #include <sys/poll.h>
 
 #include <alsa/asoundlib.h>
@@ -28,6 +32,10 @@
 
 #include "pulse.h"
 
+#ifndef PA_CHECK_VERSION
+#define PA_CHECK_VERSION(x, y, z)	0
+#endif
+
 typedef struct snd_pcm_pulse {
 	snd_pcm_ioplug_t io;
 
@@ -49,8 +57,38 @@ typedef struct snd_pcm_pulse {
 	pa_sample_spec ss;
 	size_t frame_size;
 	pa_buffer_attr buffer_attr;
+
+	/*
+	 * Stream status as of the last stream event or I/O, so that
+	 * pointer, delay and poll need not take the mainloop lock.
+	 * Written by publish_timing() only, guarded by the odd/even
+	 * sequence count.
+	 */
+	struct {
+		atomic_uint seq;
+		atomic_int err;
+		atomic_size_t ptr;
+		atomic_size_t size;		/* writable or readable */
+		atomic_ullong latency;		/* usecs */
+		atomic_ullong stamp;		/* when latency was taken */
+		atomic_bool latency_valid;
+		atomic_bool playing;
+		atomic_bool underrun;
+	} timing;
 } snd_pcm_pulse_t;
 
+/* a consistent copy of snd_pcm_pulse_t.timing */
+struct pulse_timing {
+	int err;
+	size_t ptr;
+	size_t size;
+	pa_usec_t latency;
+	uint64_t stamp;
+	bool latency_valid;
+	bool playing;
+	bool underrun;
+};
+
 static int check_stream(snd_pcm_pulse_t *pcm)
 {
 	int err;
@@ -157,6 +195,97 @@ finish:
 	return ret;
 }
 
+static uint64_t timing_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Refresh the status snapshot.  Must be called with the mainloop lock
+ * held, which also makes this the only writer at any time.
+ */
+static void publish_timing(snd_pcm_pulse_t *pcm)
+{
+	const pa_timing_info *ti;
+	unsigned int seq;
+	size_t size = 0;
+	pa_usec_t lat = 0;
+	bool latency_valid = false, playing = false;
+	int err;
+
+	err = check_stream(pcm);
+	if (err == 0)
+		err = update_ptr(pcm);
+	if (err == 0) {
+		if (pcm->io.stream == SND_PCM_STREAM_PLAYBACK)
+			size = pa_stream_writable_size(pcm->stream);
+		else
+			size = pa_stream_readable_size(pcm->stream);
+		latency_valid = pa_stream_get_latency(pcm->stream, &lat,
+						      NULL) == 0;
+		ti = pa_stream_get_timing_info(pcm->stream);
+		playing = ti && ti->playing;
+	}
+
+	seq = atomic_load_explicit(&pcm->timing.seq, memory_order_relaxed);
+	atomic_store_explicit(&pcm->timing.seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&pcm->timing.err, err, memory_order_relaxed);
+	atomic_store_explicit(&pcm->timing.ptr, pcm->ptr,
+			      memory_order_relaxed);
+	atomic_store_explicit(&pcm->timing.size, size, memory_order_relaxed);
+	atomic_store_explicit(&pcm->timing.latency, lat,
+			      memory_order_relaxed);
+	atomic_store_explicit(&pcm->timing.stamp, timing_now(),
+			      memory_order_relaxed);
+	atomic_store_explicit(&pcm->timing.latency_valid, latency_valid,
+			      memory_order_relaxed);
+	atomic_store_explicit(&pcm->timing.playing, playing,
+			      memory_order_relaxed);
+	atomic_store_explicit(&pcm->timing.underrun, pcm->underrun,
+			      memory_order_relaxed);
+	atomic_store_explicit(&pcm->timing.seq, seq + 2, memory_order_release);
+}
+
+/* lock-free; retries while publish_timing() is in the middle */
+static void read_timing(snd_pcm_pulse_t *pcm, struct pulse_timing *t)
+{
+	unsigned int seq;
+
+	for (;;) {
+		seq = atomic_load_explicit(&pcm->timing.seq,
+					   memory_order_acquire);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		t->err = atomic_load_explicit(&pcm->timing.err,
+					      memory_order_relaxed);
+		t->ptr = atomic_load_explicit(&pcm->timing.ptr,
+					      memory_order_relaxed);
+		t->size = atomic_load_explicit(&pcm->timing.size,
+					       memory_order_relaxed);
+		t->latency = atomic_load_explicit(&pcm->timing.latency,
+						  memory_order_relaxed);
+		t->stamp = atomic_load_explicit(&pcm->timing.stamp,
+						memory_order_relaxed);
+		t->latency_valid =
+			atomic_load_explicit(&pcm->timing.latency_valid,
+					     memory_order_relaxed);
+		t->playing = atomic_load_explicit(&pcm->timing.playing,
+						  memory_order_relaxed);
+		t->underrun = atomic_load_explicit(&pcm->timing.underrun,
+						   memory_order_relaxed);
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&pcm->timing.seq,
+					 memory_order_relaxed) == seq)
+			return;
+	}
+}
+
 static int wait_stream_state(snd_pcm_pulse_t *pcm, pa_stream_state_t target)
 {
 	pa_stream_state_t state;
@@ -241,6 +370,7 @@ static int pulse_start(snd_pcm_ioplug_t * io)
 	}
 
 finish:
+	publish_timing(pcm);
 	pa_threaded_mainloop_unlock(pcm->p->mainloop);
 
 	return err;
@@ -288,6 +418,7 @@ static int pulse_stop(snd_pcm_ioplug_t * io)
 	}
 
 finish:
+	publish_timing(pcm);
 	pa_threaded_mainloop_unlock(pcm->p->mainloop);
 
 	return err;
@@ -334,6 +465,7 @@ finish:
 static snd_pcm_sframes_t pulse_pointer(snd_pcm_ioplug_t * io)
 {
 	snd_pcm_pulse_t *pcm = io->private_data;
+	struct pulse_timing t;
 	snd_pcm_sframes_t ret = 0;
 
 	assert(pcm);
@@ -347,31 +479,18 @@ static snd_pcm_sframes_t pulse_pointer(snd_pcm_ioplug_t * io)
 	if (io->state != SND_PCM_STATE_RUNNING)
 		return 0;
 
-	pa_threaded_mainloop_lock(pcm->p->mainloop);
-
-	ret = check_stream(pcm);
-	if (ret < 0)
-		goto finish;
-
-	if (pcm->underrun) {
-		ret = -EPIPE;
-		goto finish;
-	}
-
-	ret = update_ptr(pcm);
-	if (ret < 0) {
-		ret = -EPIPE;
-		goto finish;
-	}
+	/*
+	 * The sizes the pointer follows change only with stream events
+	 * and our own I/O, which all publish the result.
+	 */
+	read_timing(pcm, &t);
 
-	if (pcm->underrun)
+	if (t.err < 0)
+		ret = t.err;
+	else if (t.underrun)
 		ret = -EPIPE;
 	else
-		ret = snd_pcm_bytes_to_frames(io->pcm, pcm->ptr);
-
-finish:
-
-	pa_threaded_mainloop_unlock(pcm->p->mainloop);
+		ret = snd_pcm_bytes_to_frames(io->pcm, t.ptr);
 
 	return ret;
 }
@@ -379,14 +498,40 @@ finish:
 static int pulse_delay(snd_pcm_ioplug_t * io, snd_pcm_sframes_t * delayp)
 {
 	snd_pcm_pulse_t *pcm = io->private_data;
+	struct pulse_timing t;
 	int err = 0;
 	pa_usec_t lat = 0;
+	uint64_t elapsed;
 
 	assert(pcm);
 
 	if (!pcm->p || !pcm->p->mainloop)
 		return -EBADFD;
 
+	/*
+	 * Carry the published latency forward by the time since, the way
+	 * PA_STREAM_INTERPOLATE_TIMING does.  Only errors and a latency
+	 * not known yet need the lock.
+	 */
+	read_timing(pcm, &t);
+	if (t.err == 0 && t.latency_valid) {
+		lat = t.latency;
+		if (t.playing) {
+			elapsed = timing_now() - t.stamp;
+			if (io->stream == SND_PCM_STREAM_CAPTURE)
+				lat += elapsed;
+			else if (lat > elapsed)
+				lat -= elapsed;
+			else
+				lat = 0;
+		}
+		*delayp = snd_pcm_bytes_to_frames(io->pcm,
+						  pa_usec_to_bytes(lat, &pcm->ss));
+		if (t.underrun && io->state == SND_PCM_STATE_RUNNING)
+			snd_pcm_ioplug_set_state(io, SND_PCM_STATE_XRUN);
+		return 0;
+	}
+
 	pa_threaded_mainloop_lock(pcm->p->mainloop);
 
 	for (;;) {
@@ -422,6 +567,49 @@ finish:
 	return err;
 }
 
+/*
+ * Copy the frames into a memblock handed out by the stream, which
+ * pa_stream_write() then queues as is.  A plain pa_stream_write()
+ * makes the same single copy, but into a memblock it allocates for
+ * every call; this saves that allocation, not a copy.  Falls back to
+ * the plain write for what could not be placed that way.
+ */
+static int write_frames(snd_pcm_pulse_t *pcm, const char *buf, size_t bytes)
+{
+#if PA_CHECK_VERSION(0,9,16)
+	while (bytes > 0) {
+		void *data;
+		size_t n = bytes;
+
+		if (pa_stream_begin_write(pcm->stream, &data, &n) < 0 || !data)
+			break;
+
+		if (n > bytes)
+			n = bytes;
+		n -= n % pcm->frame_size;
+		if (n == 0) {
+			pa_stream_cancel_write(pcm->stream);
+			break;
+		}
+
+		memcpy(data, buf, n);
+		if (pa_stream_write(pcm->stream, data, n, NULL, 0,
+				    PA_SEEK_RELATIVE) < 0)
+			return -EIO;
+
+		buf += n;
+		bytes -= n;
+	}
+#endif
+
+	if (bytes > 0 &&
+	    pa_stream_write(pcm->stream, buf, bytes, NULL, 0,
+			    PA_SEEK_RELATIVE) < 0)
+		return -EIO;
+
+	return 0;
+}
+
 static snd_pcm_sframes_t pulse_write(snd_pcm_ioplug_t * io,
 				     const snd_pcm_channel_area_t * areas,
 				     snd_pcm_uframes_t offset,
@@ -453,11 +641,9 @@ static snd_pcm_sframes_t pulse_write(snd_pcm_ioplug_t * io,
 				    areas->step * offset) / 8;
 
 	writebytes = size * pcm->frame_size;
-	ret = pa_stream_write(pcm->stream, buf, writebytes, NULL, 0, 0);
-	if (ret < 0) {
-		ret = -EIO;
+	ret = write_frames(pcm, buf, writebytes);
+	if (ret < 0)
 		goto finish;
-	}
 
 	/* Make sure the buffer pointer is in sync */
 	pcm->last_size -= writebytes;
@@ -475,6 +661,7 @@ static snd_pcm_sframes_t pulse_write(snd_pcm_ioplug_t * io,
 	pcm->underrun = 0;
 
 finish:
+	publish_timing(pcm);
 	pa_threaded_mainloop_unlock(pcm->p->mainloop);
 
 	return ret;
@@ -559,6 +746,7 @@ static snd_pcm_sframes_t pulse_read(snd_pcm_ioplug_t * io,
 	ret = size - (remain_size / pcm->frame_size);
 
 finish:
+	publish_timing(pcm);
 	pa_threaded_mainloop_unlock(pcm->p->mainloop);
 
 	return ret;
@@ -578,6 +766,7 @@ static void stream_state_cb(pa_stream * p, void *userdata)
 	if (!PA_STREAM_IS_GOOD(state))
 		pulse_poll_activate(pcm->p);
 
+	publish_timing(pcm);
 	pa_threaded_mainloop_signal(pcm->p->mainloop, 0);
 }
 
@@ -591,12 +780,9 @@ static void stream_request_cb(pa_stream * p, size_t length, void *userdata)
 		return;
 
 	update_active(pcm);
+	publish_timing(pcm);
 }
 
-#ifndef PA_CHECK_VERSION
-#define PA_CHECK_VERSION(x, y, z)	0
-#endif
-
 #if PA_CHECK_VERSION(0,99,0)
 #define DEFAULT_HANDLE_UNDERRUN		1
 #define do_underrun_detect(pcm, p) \
@@ -615,8 +801,10 @@ static void stream_underrun_cb(pa_stream * p, void *userdata)
 	if (!pcm->p)
 		return;
 
-	if (do_underrun_detect(pcm, p))
+	if (do_underrun_detect(pcm, p)) {
 		pcm->underrun = 1;
+		publish_timing(pcm);
+	}
 }
 
 static void stream_latency_cb(pa_stream *p, void *userdata) {
@@ -627,6 +815,7 @@ static void stream_latency_cb(pa_stream *p, void *userdata) {
 	if (!pcm->p)
 		return;
 
+	publish_timing(pcm);
 	pa_threaded_mainloop_signal(pcm->p->mainloop, 0);
 }
 
@@ -634,36 +823,31 @@ static int pulse_pcm_poll_revents(snd_pcm_ioplug_t * io,
 				  struct pollfd *pfd, unsigned int nfds,
 				  unsigned short *revents)
 {
-	int err = 0;
 	snd_pcm_pulse_t *pcm = io->private_data;
+	struct pulse_timing t;
+	int active;
 
 	assert(pcm);
 
 	if (!pcm->p || !pcm->p->mainloop)
 		return -EBADFD;
 
-	pa_threaded_mainloop_lock(pcm->p->mainloop);
-
-	err = check_stream(pcm);
-	if (err < 0)
-		goto finish;
+	/* same test as check_active(), on the published sizes */
+	read_timing(pcm, &t);
+	if (t.err < 0)
+		return t.err;
 
-	err = check_active(pcm);
-	if (err < 0)
-		goto finish;
+	if (io->stream == SND_PCM_STREAM_PLAYBACK)
+		active = t.size >= pcm->buffer_attr.minreq;
+	else
+		active = t.size >= pcm->buffer_attr.fragsize;
 
-	if (err > 0)
+	if (active)
 		*revents = io->stream == SND_PCM_STREAM_PLAYBACK ? POLLOUT : POLLIN;
 	else
 		*revents = 0;
 
-	err = 0;
-
-finish:
-
-	pa_threaded_mainloop_unlock(pcm->p->mainloop);
-
-	return err;
+	return 0;
 }
 
 static int pulse_prepare(snd_pcm_ioplug_t * io)
@@ -771,6 +955,7 @@ static int pulse_prepare(snd_pcm_ioplug_t * io)
 	update_ptr(pcm);
 
       finish:
+	publish_timing(pcm);
 	pa_threaded_mainloop_unlock(pcm->p->mainloop);
 
 	return err;
@@ -1134,6 +1319,7 @@ SND_PCM_PLUGIN_DEFINE_FUNC(pulse)
 
 	pcm->handle_underrun = handle_underrun;
 	pcm->buffer_attr.prebuf = -1;
+	atomic_init(&pcm->timing.err, -EBADFD);
 
 	err = pulse_connect(pcm->p, server, fallback_name != NULL);
 	if (err < 0)